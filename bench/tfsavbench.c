@@ -0,0 +1,354 @@
+/*
+ * This file is part of tfsavcodec.
+ * 
+ * Copyright (c) 2016, Oskar Eisemuth
+ * 
+ * For the full copyright and license information,
+ * please view the LICENSE file that was distributed with this source code.
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdbool.h>
+
+#if defined(_WIN32)
+#include <direct.h>
+#define bench_mkdir(directory) _mkdir(directory)
+#else
+#include <sys/stat.h>
+#define bench_mkdir(directory) mkdir(directory, 0777)
+#endif
+
+#include "../src/misc.h"
+#include "../src/memfunc.h"
+#include "../src/filefunc.h"
+#include "../src/threadpool.h"
+#include "../src/tfsavegame.h"
+#include "../src/libtfsav.h"
+#include "tfsavgen.h"
+
+/*
+ * Times extract, info, verify and compress end to end on a synthetic
+ * savegame, or on the given one. Every operation runs in process like a
+ * --serve job: extract decodes both frames and writes all sections,
+ * info reads the header fields, verify decodes and checks all checksums,
+ * compress imports the extracted sections and encodes both frames again.
+ * Each one is repeated and reported as median, p95 and min.
+ *
+ * Built from the library sources, see README.
+ */
+
+typedef struct _BENCH_OP BENCH_OP;
+struct _BENCH_OP {
+	const char* name;
+	bool (*run)(void);
+	double* samples;	// seconds
+	bool ok;
+};
+
+static char* benchdir = "tfsavbench.tmp";
+static FILEPATH* savfile;	// savegame all operations start from
+static FILEPATH* extractdir;
+static FILEPATH* uncompressedfile;
+static FILEPATH* compressedfile;
+static size_t contentlen;
+
+static double bench_clock() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static bool bench_result(TFSAV_RESULT result, const char* what) {
+	if (result != TFSAV_OK) {
+		print_err(0, "%s: %s\n", what, tfsav_strerror(result));
+		return false;
+	}
+	return true;
+}
+
+static bool bench_extract() {
+	TFSAV* sav;
+	const void* content;
+	size_t len;
+	if (!bench_result(tfsav_open_file(savfile->filepath, NULL, &sav), savfile->filepath)) {
+		return false;
+	}
+	tfsav_content(sav, &content, &len);
+	FILE* fd = fopen(uncompressedfile->filepath, "w+b");
+	bool ok = fd != NULL && fwrite(content, len, 1, fd) == 1;
+	tfsav_close(sav);
+	if (!ok) {
+		print_err(0, "Writing %s failed\n", uncompressedfile->filepath);
+	} else {
+		fseek(fd, 0, SEEK_SET);
+		ok = tfsavegame_read(fd, uncompressedfile->filepath, extractdir->filepath);
+	}
+	if (fd != NULL) {
+		fclose(fd);
+	}
+	return ok;
+}
+
+static bool bench_info() {
+	static const char* fields[] = { "header.savegameversion", "header.difficulty", "header.startYear",
+		"header.numTiles", "header.date", "header.money" };
+	TFSAV* sav;
+	if (!bench_result(tfsav_open_file(savfile->filepath, NULL, &sav), savfile->filepath)) {
+		return false;
+	}
+	bool ok = true;
+	for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		int64_t value;
+		ok = ok && tfsav_get(sav, fields[i], &value) == TFSAV_OK;
+	}
+	for (int s = 0; s < TFSAV_SECTION_COUNT; s++) {
+		const void* data;
+		size_t len;
+		ok = ok && tfsav_section(sav, s, &data, &len) == TFSAV_OK;
+	}
+	tfsav_close(sav);
+	return ok;
+}
+
+static bool bench_verify() {
+	TFSAV* sav;
+	if (!bench_result(tfsav_open_file(savfile->filepath, NULL, &sav), savfile->filepath)) {
+		return false;
+	}
+	tfsav_close(sav);
+	return true;
+}
+
+static bool bench_compress() {
+	TFSAV* sav;
+	FILEPATH* ff = filepath_new();
+	filepath_basepath(ff, extractdir->filepath);
+	filepath_filename(ff, "uncompressed.tmp");
+	bool ok = tfsavegame_write(ff->filepath, extractdir->filepath)
+		&& bench_result(tfsav_open_file(ff->filepath, NULL, &sav), ff->filepath);
+	filepath_free(ff);
+	if (ok) {
+		ok = bench_result(tfsav_write_file(sav, compressedfile->filepath), compressedfile->filepath);
+		tfsav_close(sav);
+	}
+	return ok;
+}
+
+// extract has to come first, compress reads its sections
+static BENCH_OP ops[] = {
+	{ "extract", bench_extract },
+	{ "info", bench_info },
+	{ "verify", bench_verify },
+	{ "compress", bench_compress }
+};
+#define BENCH_OPS (sizeof(ops) / sizeof(ops[0]))
+
+// Runs on a worker, so big frames are split into block tasks like in tfsavcodec
+static void bench_op_task(void* arg) {
+	BENCH_OP* op = arg;
+	op->ok = op->run();
+}
+
+static bool bench_op_run(THREADPOOL* pool, BENCH_OP* op, double* seconds) {
+	double start = bench_clock();
+	if (pool != NULL) {
+		threadpool_submit(pool, bench_op_task, op);
+		threadpool_wait(pool);
+	} else {
+		bench_op_task(op);
+	}
+	*seconds = bench_clock() - start;
+	return op->ok;
+}
+
+/*
+ * Writes a synthetic savegame of size uncompressed bytes, compressed with
+ * both LZ4 stages like the game does it
+ */
+static bool bench_generate(size_t size, uint32_t seed) {
+	TFSAV* sav;
+	FILEPATH* ff = filepath_new();
+	filepath_basepath(ff, benchdir);
+	filepath_filename(ff, "synthetic.data");
+	FILE* fd = fopen(ff->filepath, "w+b");
+	if (fd == NULL) {
+		print_err(0, "Creating %s, %s\n", ff->filepath, strerror(errno));
+		filepath_free(ff);
+		return false;
+	}
+	bool ok = tfsavgen_generate(fd, size, seed);
+	fclose(fd);
+	if (ok) {
+		ok = bench_result(tfsav_open_file(ff->filepath, NULL, &sav), ff->filepath);
+	}
+	if (ok) {
+		ok = bench_result(tfsav_write_file(sav, savfile->filepath), savfile->filepath);
+		tfsav_close(sav);
+	}
+	remove(ff->filepath);
+	filepath_free(ff);
+	return ok;
+}
+
+static int bench_compare(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static void bench_report(BENCH_OP* op, int repeats) {
+	double* s = op->samples;
+	qsort(s, repeats, sizeof(double), bench_compare);
+	double median = (repeats % 2) ? s[repeats / 2] : (s[repeats / 2 - 1] + s[repeats / 2]) / 2;
+	// nearest rank
+	int p95 = (repeats * 95 + 99) / 100 - 1;
+	printf("%-10s %5d %10.1f %10.1f %10.1f %10.1f\n", op->name, repeats, median * 1000, s[p95] * 1000,
+		s[0] * 1000, median > 0 ? contentlen / median / (1024*1024) : 0);
+}
+
+static size_t bench_parsesize(const char* value) {
+	char* end;
+	size_t size = strtoull(value, &end, 0);
+	switch (*end) {
+		case 'g': case 'G': size *= 1024;
+		case 'm': case 'M': size *= 1024;
+		case 'k': case 'K': size *= 1024;
+	}
+	return size;
+}
+
+void usage(char *name) {
+	printf("Usage: %s <options> [file]\n"
+	" file          benchmark this savegame instead of a synthetic one\n"
+	" -s size       uncompressed size of the synthetic savegame, k, M or G\n"
+	"               may follow, default 64M\n"
+	" --seed=N      seed of the synthetic savegame, default 1\n"
+	" -n N          timed runs of every operation, default 10\n"
+	" -w N          untimed warmup runs of every operation, default 1\n"
+	" -j N          use N worker threads, 0 uses one per cpu\n"
+	" -d directory  working directory, default tfsavbench.tmp\n"
+	" -v            show the messages of the codec\n"
+	" \n", name);
+}
+
+int main(int argc, char** argv) {
+	size_t size = 64*1024*1024;
+	uint32_t seed = 1;
+	int repeats = 10;
+	int warmup = 1;
+	int workers = 1;
+	char* input = NULL;
+
+	tfsav_set_log_level(TFSAV_LOG_WARN);
+	for (int i = 1; i < argc; i++) {
+		char* arg = argv[i];
+		char* value = (i+1 < argc) ? argv[i+1] : NULL;
+		if (strcmp(arg, "-h") == 0) {
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		} else if (strcmp(arg, "-v") == 0) {
+			tfsav_set_log_level(TFSAV_LOG_INFO);
+		} else if (strncmp(arg, "--seed=", 7) == 0) {
+			seed = strtoul(arg + 7, NULL, 0);
+		} else if (arg[0] == '-' && arg[1] != 0 && strchr("snwjd", arg[1]) != NULL && arg[2] == 0 && value != NULL) {
+			i++;
+			switch (arg[1]) {
+				case 's': size = bench_parsesize(value); break;
+				case 'n': repeats = atoi(value); break;
+				case 'w': warmup = atoi(value); break;
+				case 'j': workers = atoi(value); break;
+				case 'd': benchdir = value; break;
+			}
+		} else if (arg[0] != '-' && input == NULL) {
+			input = arg;
+		} else {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (repeats < 1) {
+		repeats = 1;
+	}
+
+	if (bench_mkdir(benchdir) != 0 && errno != EEXIST) {
+		print_err(0, "Creating %s, %s\n", benchdir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	extractdir = filepath_new();
+	filepath_basepath(extractdir, benchdir);
+	filepath_filename(extractdir, "extract");
+	if (bench_mkdir(extractdir->filepath) != 0 && errno != EEXIST) {
+		print_err(0, "Creating %s, %s\n", extractdir->filepath, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	uncompressedfile = filepath_new();
+	filepath_basepath(uncompressedfile, extractdir->filepath);
+	filepath_filename(uncompressedfile, "uncompressed.data");
+	compressedfile = filepath_new();
+	filepath_basepath(compressedfile, benchdir);
+	filepath_filename(compressedfile, "compressed.sav");
+	savfile = filepath_new();
+	if (input != NULL) {
+		filepath_filename(savfile, input);
+	} else {
+		filepath_basepath(savfile, benchdir);
+		filepath_filename(savfile, "synthetic.sav");
+		if (!bench_generate(size, seed)) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	TFSAV* sav;
+	const void* content;
+	if (!bench_result(tfsav_open_file(savfile->filepath, NULL, &sav), savfile->filepath)) {
+		return EXIT_FAILURE;
+	}
+	tfsav_content(sav, &content, &contentlen);
+	tfsav_close(sav);
+	FILE* fd = fopen(savfile->filepath, "rb");
+	size_t savlen = fd ? file_size(fd) : 0;
+	if (fd != NULL) {
+		fclose(fd);
+	}
+
+	int threads = workers < 1 ? threadpool_cpucount() : workers;
+	THREADPOOL* pool = threads > 1 ? threadpool_create(threads) : NULL;
+
+	printf("%s: %zu bytes, %zu uncompressed, %d threads, %d runs\n\n", savfile->filepath, savlen, contentlen, threads, repeats);
+	printf("%-10s %5s %10s %10s %10s %10s\n", "operation", "runs", "median ms", "p95 ms", "min ms", "MB/s");
+	int failed = 0;
+	for (size_t n = 0; n < BENCH_OPS; n++) {
+		BENCH_OP* op = &ops[n];
+		double seconds;
+		op->samples = memory_alloc(sizeof(double) * repeats);
+		bool ok = true;
+		for (int i = 0; i < warmup && ok; i++) {
+			ok = bench_op_run(pool, op, &seconds);
+		}
+		for (int i = 0; i < repeats && ok; i++) {
+			ok = bench_op_run(pool, op, &op->samples[i]);
+		}
+		if (ok) {
+			bench_report(op, repeats);
+		} else {
+			printf("%-10s failed\n", op->name);
+			failed++;
+		}
+		fflush(stdout);
+		memory_free(op->samples);
+	}
+
+	threadpool_free(pool);
+	filepath_free(savfile);
+	filepath_free(extractdir);
+	filepath_free(uncompressedfile);
+	filepath_free(compressedfile);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,203 @@
+/*
+ * This file is part of tfsavcodec.
+ * 
+ * Copyright (c) 2016, Oskar Eisemuth
+ * 
+ * For the full copyright and license information,
+ * please view the LICENSE file that was distributed with this source code.
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <stdbool.h>
+
+#include "../src/misc.h"
+#include "../src/memfunc.h"
+#include "../src/tfsavegamestruct.h"
+#include "tfsavgen.h"
+
+// Generated by OBJSTRUCT_CONSTRUCT in tfsavegame.c
+#define TFSAVGEN_STRUCT(body) \
+	void body##_serialize(FILE* fd, body* obj); \
+	size_t body##_size(body* obj);
+TFSAVGEN_STRUCT(TFHeader)
+TFSAVGEN_STRUCT(TFMods)
+TFSAVGEN_STRUCT(TFSettingsConfig)
+TFSAVGEN_STRUCT(TFAfterSettings)
+TFSAVGEN_STRUCT(TFModelRep)
+
+/*
+ * Synthetic savegames for benchmarks. The sections are built from the TF
+ * structs and written like an imported savegame, the remaining data is
+ * filled with records resembling the game state: increasing ids, model
+ * references, coordinates moving in small steps and a few random bytes,
+ * so both LZ4 stages see data that compresses about like a real one.
+ */
+
+static uint32_t tfsavgen_random(uint32_t* state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static const char* tfsavgenModels[] = {
+	"vehicle/train/br_01.mdl", "vehicle/train/class_a3.mdl", "vehicle/train/ce_6_8.mdl",
+	"vehicle/waggon/goods_1850.mdl", "vehicle/waggon/passenger_1900.mdl",
+	"vehicle/bus/volvo_b10m.mdl", "vehicle/truck/henschel_hs_14.mdl", "vehicle/tram/be_4_4.mdl",
+	"station/rail/era_a/station_1.mdl", "station/road/bus_stop.mdl", "depot/train_depot_era_a.mdl",
+	"street/town_small.mdl", "street/country_large.mdl", "industry/coal_mine.mdl",
+	"industry/steel_mill.mdl", "tree/pinus_sylvestris.mdl", "tree/fagus_sylvatica.mdl",
+	"asset/rock_1.mdl", "building/era_a/res_1_1x1_01.mdl", "building/era_b/com_2_2x2_03.mdl"
+};
+#define TFSAVGEN_MODELS (sizeof(tfsavgenModels) / sizeof(tfsavgenModels[0]))
+
+// Returned by value, the tfstrings are members of packed structs
+static tfstring tfsavgen_string(const char* fmt, ...) {
+	char buffer[256];
+	tfstring string;
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(buffer, sizeof(buffer), fmt, args);
+	va_end(args);
+	string.str = memory_strdup_category(buffer, MEMORY_TFSTRING);
+	string.len = strlen(buffer);
+	return string;
+}
+
+static void tfsavgen_remaining(FILE* fd, size_t len, uint32_t* seed) {
+	uint8_t buffer[64*1024];
+	size_t used = 0;
+	uint32_t id = 0;
+	float x = 1000.0f, y = 1000.0f, z = 50.0f;
+
+	while (len > 0) {
+		uint32_t r = tfsavgen_random(seed);
+		uint32_t record[12];
+		x += (float)((int)(r & 0xFF) - 128) / 16.0f;
+		y += (float)((int)((r >> 8) & 0xFF) - 128) / 16.0f;
+		z += (float)((int)((r >> 16) & 0x0F) - 8) / 64.0f;
+		record[0] = id++;
+		record[1] = (r >> 20) % TFSAVGEN_MODELS;
+		memcpy(&record[2], &x, 4);
+		memcpy(&record[3], &y, 4);
+		memcpy(&record[4], &z, 4);
+		record[5] = 0x3F800000;		// 1.0f, scale
+		record[6] = (r >> 24) & 0x0F;	// flags
+		record[7] = 0;
+		record[8] = 0xFFFFFFFF;
+		record[9] = id / 64;
+		record[10] = (r & 0x1F) == 0 ? tfsavgen_random(seed) : 0;
+		record[11] = (r & 0x1F) == 0 ? tfsavgen_random(seed) : 0;
+
+		size_t n = sizeof(record) < len ? sizeof(record) : len;
+		if (used + n > sizeof(buffer)) {
+			fwrite(buffer, used, 1, fd);
+			used = 0;
+		}
+		memcpy(buffer + used, record, n);
+		used += n;
+		len -= n;
+	}
+	fwrite(buffer, used, 1, fd);
+}
+
+/*
+ * Writes an uncompressed savegame of size bytes, or the size of its
+ * sections if size is smaller. The same seed gives the same savegame.
+ */
+bool tfsavgen_generate(FILE* fd, size_t size, uint32_t seed) {
+	TFHeader header;
+	TFMods mods;
+	TFSettingsConfig settings;
+	TFAfterSettings aftersettings;
+	TFModelRep modelrep;
+	static const char* settingKeys[] = { "climate", "environment", "cargoTypes", "vehicles", "industryDensity",
+		"townDensity", "terrainHeight", "waterLevel", "noEndYear", "autoSave" };
+
+	if (seed == 0) {
+		seed = 1;
+	}
+	memset(&header, 0, sizeof(header));
+	memset(&mods, 0, sizeof(mods));
+	memset(&settings, 0, sizeof(settings));
+	memset(&aftersettings, 0, sizeof(aftersettings));
+	memset(&modelrep, 0, sizeof(modelrep));
+
+	header.num_mods = 3;
+	header.mods = memory_alloc(sizeof(TFModDisplayString) * header.num_mods);
+	mods.num_mods = header.num_mods;
+	mods.mods = memory_alloc(sizeof(TFModEntry) * mods.num_mods);
+	for (int i = 0; i < header.num_mods; i++) {
+		header.mods[i].name = tfsavgen_string("Synthetic mod %d", i + 1);
+		header.mods[i].severity = i;
+		mods.mods[i].name = tfsavgen_string("synthetic_mod_%d", i + 1);
+		mods.mods[i].unknown = 1;
+	}
+	memcpy(header.signature, "tf**", 4);
+	header.savegameversion = TFSAVEGAMEVERSION;
+	header.difficulty = 1;
+	header.startYear = 1850;
+	header.numTiles = 1024;
+	header.date = 1850 * 365 + tfsavgen_random(&seed) % (150 * 365);
+	header.money = 5000000 + tfsavgen_random(&seed) % 100000000;
+	header.achievementsEarnable = 1;
+
+	settings.numentries = sizeof(settingKeys) / sizeof(settingKeys[0]);
+	settings.entries = memory_alloc(sizeof(TFKeyValueString) * settings.numentries);
+	for (uint32_t i = 0; i < settings.numentries; i++) {
+		settings.entries[i].key = tfsavgen_string("%s", settingKeys[i]);
+		settings.entries[i].value = tfsavgen_string("%u", tfsavgen_random(&seed) % 4);
+	}
+
+	aftersettings.unknownA1 = 1;
+	aftersettings.startYear = header.startYear;
+	aftersettings.date = header.date;
+
+	// Real savegames reference a few thousand models, more with bigger maps
+	modelrep.numentries = 1000 + size / (64*1024);
+	modelrep.entries = memory_alloc(sizeof(TFModelRepEntry) * modelrep.numentries);
+	for (uint32_t i = 0; i < modelrep.numentries; i++) {
+		const char* model = tfsavgenModels[i % TFSAVGEN_MODELS];
+		modelrep.entries[i].key = tfsavgen_string("%.*s_%u.mdl", (int)(strlen(model) - 4), model, i / TFSAVGEN_MODELS);
+		modelrep.entries[i].unknown = i;
+	}
+
+	size_t offset = TFHeader_size(&header) + TFMods_size(&mods) + TFSettingsConfig_size(&settings)
+			+ TFAfterSettings_size(&aftersettings) + TFModelRep_size(&modelrep);
+	TFHeader_serialize(fd, &header);
+	TFMods_serialize(fd, &mods);
+	TFSettingsConfig_serialize(fd, &settings);
+	TFAfterSettings_serialize(fd, &aftersettings);
+	TFModelRep_serialize(fd, &modelrep);
+	tfsavgen_remaining(fd, size > offset ? size - offset : 0, &seed);
+
+	for (int i = 0; i < header.num_mods; i++) {
+		memory_free(header.mods[i].name.str);
+		memory_free(mods.mods[i].name.str);
+	}
+	for (uint32_t i = 0; i < settings.numentries; i++) {
+		memory_free(settings.entries[i].key.str);
+		memory_free(settings.entries[i].value.str);
+	}
+	for (uint32_t i = 0; i < modelrep.numentries; i++) {
+		memory_free(modelrep.entries[i].key.str);
+	}
+	memory_free(header.mods);
+	memory_free(mods.mods);
+	memory_free(settings.entries);
+	memory_free(modelrep.entries);
+
+	if (fflush(fd) != 0 || ferror(fd)) {
+		print_err(0, "Writing synthetic savegame failed\n");
+		return false;
+	}
+	return true;
+}
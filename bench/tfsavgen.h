@@ -0,0 +1,25 @@
+/*
+ * This file is part of tfsavcodec.
+ * 
+ * Copyright (c) 2016, Oskar Eisemuth
+ * 
+ * For the full copyright and license information,
+ * please view the LICENSE file that was distributed with this source code.
+ * 
+ */
+
+#ifndef TFSAVGEN_H
+#define TFSAVGEN_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Writes an uncompressed savegame of size bytes with made up content, or
+ * the size of its sections if size is smaller. The same seed gives the
+ * same savegame.
+ */
+bool tfsavgen_generate(FILE* fd, size_t size, uint32_t seed);
+
+#endif /* TFSAVGEN_H */
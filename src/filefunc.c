@@ -16,12 +16,14 @@
 #include <strings.h>
 #include <string.h>
 
+#include "misc.h"
 #include "memfunc.h"
 #include "filefunc.h"
 #include "tfstring.h"
 
 #include <errno.h>
 #include <sys/stat.h>
+#include <dirent.h>
 
 #define FILEPATH_BUFFERSIZE 2048
 
@@ -31,7 +33,7 @@ char* filename_noext(const char *file) {
 	dotpos = strrchr(file, '.');
 	if (dotpos != NULL) {
 		len = dotpos - file;
-		basename = malloc(len + 1);
+		basename = memory_alloc(len + 1);
 		basename[len] = 0;
 		strncpy(basename, file, len);
 	} else {
@@ -46,7 +48,7 @@ char* filename_directory(const char *file) {
 	pointer = strrchr(file, PATH_SEP_C);
 	if (pointer != NULL) {
 		len = pointer - file;
-		directory = malloc(len + 1);
+		directory = memory_alloc(len + 1);
 		directory[len] = 0;
 		strncpy(directory, file, len);
 	} else {
@@ -63,7 +65,7 @@ char* filename_replace(const char *filepath, const char* filename) {
 	size_t filepath_len = strlen(filepath);
 	size_t filename_len = strlen(filename);
 	
-	newfilepath = malloc(filepath_len+filename_len+10);
+	newfilepath = memory_alloc(filepath_len+filename_len+10);
 	pointer = strrchr(filepath, PATH_SEP_C);
 	if (pointer != NULL) {
 		len = pointer - filepath;
@@ -98,7 +100,50 @@ int is_dir(const char *directory) {
 	return 0;
 }
 
+static int dir_list_compare(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
 
+/*
+ * Lists the files in directory ending with ext (case insensitive), sorted
+ * by name. Returns NULL if the directory can't be read.
+ */
+char** dir_list(const char *directory, const char* ext, size_t* count) {
+	DIR* dir = opendir(directory);
+	struct dirent* entry;
+	char** files = NULL;
+	size_t ext_len = strlen(ext);
+	size_t dir_len = strlen(directory);
+	
+	*count = 0;
+	if (dir == NULL) {
+		return NULL;
+	}
+	files = memory_alloc(sizeof(char*));
+	while ((entry = readdir(dir)) != NULL) {
+		size_t len = strlen(entry->d_name);
+		if (len <= ext_len || strcasecmp(entry->d_name + len - ext_len, ext) != 0) {
+			continue;
+		}
+		char* file = memory_alloc(dir_len + len + 2);
+		strcpy(file, directory);
+		if (dir_len > 0 && directory[dir_len-1] != PATH_SEP_C) {
+			strcat(file, PATH_SEP_STR);
+		}
+		strcat(file, entry->d_name);
+		if (!file_exists(file)) {
+			memory_free(file);
+			continue;
+		}
+		files = memory_realloc(files, sizeof(char*) * (*count + 1));
+		files[(*count)++] = file;
+	}
+	closedir(dir);
+	if (*count > 1) {
+		qsort(files, *count, sizeof(char*), dir_list_compare);
+	}
+	return files;
+}
 
 
 void file_align(FILE* fd, size_t align) {
@@ -120,20 +165,21 @@ size_t file_size(FILE* fd) {
 }
 
 void _file_print_error_eof(FILE* fd, char* fmt, ...) {
+	char message[512];
 	va_list ap;
 	va_start(ap, fmt);
-	printf("Unexpected end of file:");
-	vprintf(fmt, ap);
+	vsnprintf(message, sizeof(message), fmt, ap);
 	va_end(ap);
+	print_err(0, "Unexpected end of file: %s", message);
 }
 
 
+// Both return NULL after printing the error
 FILE* file_open_read(char* filename) {
 	FILE* fd;
 	fd = fopen(filename, "rb");
 	if (fd == NULL) {
-		printf("Opening file %s, %s", filename, strerror(errno));
-		exit(-1);
+		print_err(0, "Opening file %s, %s\n", filename, strerror(errno));
 	}
 	return fd;
 }
@@ -141,18 +187,17 @@ FILE* file_open_read(char* filename) {
 
 FILE* file_open_write(char* filename) {
 	FILE* fd;
-	printf("Creating file %s\n", filename);
+	print(0, "Creating file %s\n", filename);
 	fd = fopen(filename, "wb");
 	if (fd == NULL) {
-		printf("ERROR %s, %s", filename, strerror(errno));
-		exit(-1);
+		print_err(0, "Creating file %s, %s\n", filename, strerror(errno));
 	}
 	return fd;
 }
 
 
 
-void file_copy_bytes(FILE* fdsrc, FILE* fddest, size_t len) {
+bool file_copy_bytes(FILE* fdsrc, FILE* fddest, size_t len) {
 	size_t buffermaxsize = 4*1024;
 	uint8_t buffer[4*1024];
 	
@@ -163,25 +208,33 @@ void file_copy_bytes(FILE* fdsrc, FILE* fddest, size_t len) {
 		size_t n = fread(buffer, 1, buffermaxsize, fdsrc);
 		if (n != buffermaxsize) {
 			_file_print_error_eof(fdsrc, "Reading file with size %i\n", len);
-			exit(-1);
+			return false;
+		}
+		if (fwrite(buffer, 1, n, fddest) != n) {
+			print_err(0, "Writing file, %s\n", strerror(errno));
+			return false;
 		}
-		fwrite(buffer, 1, n, fddest);
 		len -= n;
 		if (len < buffermaxsize) {
 			buffermaxsize = len;
 		}
 	}
+	return true;
 }
 
 
 
+/*
+ * Reads past the end return 0 and leave feof(fd) set, only the first one
+ * is reported. Struct readers check feof(fd) to fail as a whole.
+ */
 #define FILE_READ_TYP_DEF(typname, typ) \
 typ file_read_##typname(FILE* fd) {					\
-	typ data;							\
-	if (fread(&data, sizeof(data), 1, fd) != sizeof(data)) {	\
+	typ data = 0;							\
+	if (!feof(fd) && fread(&data, sizeof(data), 1, fd) != 1) {	\
+		data = 0;						\
 		if (feof(fd)) {						\
 			_file_print_error_eof(fd, "Reading "#typname);	\
-			exit(-1);					\
 		}							\
 	}								\
 	return data;							\
@@ -202,11 +255,11 @@ uint32_t file_read_u32_bigendian(FILE* fd) {
 }
 
 void file_readinto_bytes(FILE* fd, void* buffer, int size) {
-	if (fread(buffer, size, 1, fd) != 1) {
-		//if (feof(fd)) {
+	if (feof(fd)) {
+		memset(buffer, 0, size);
+	} else if (fread(buffer, size, 1, fd) != 1) {
+		memset(buffer, 0, size);
 		_file_print_error_eof(fd, "Reading bytestream with size %i\n", size);
-		exit(-1);
-		//}
 	}
 }
 
@@ -266,7 +319,6 @@ void file_readinto_string(FILE* fd, char** string, int times) {
 		c = fgetc(fd);
 		if (c == EOF) {
 			_file_print_error_eof(fd, "Reading string failed\n");
-			exit(-1);
 			buffer[count] = '\0';
 		} else {
 			buffer[count] = (char) c;
@@ -284,7 +336,7 @@ void file_readinto_tfstring(FILE* fd, tfstring* string, int times) {
 	}
 	for (int i = 0; i < times; i++) {
 		size_t buffer_size = file_read_u32(fd);
-		char* buffer = memory_alloc(buffer_size+1);
+		char* buffer = memory_alloc_category(buffer_size+1, MEMORY_TFSTRING);
 		if (buffer_size > 0) {
 			file_readinto_bytes(fd, buffer, buffer_size);
 		}
@@ -398,8 +450,8 @@ char* file_read_cstr(FILE* fd) {
 
 FILEPATH* filepath_new() {
 	FILEPATH* filepath;
-	filepath = malloc(sizeof(FILEPATH));
-	filepath->filepath = calloc(FILEPATH_BUFFERSIZE, 1);
+	filepath = memory_alloc(sizeof(FILEPATH));
+	filepath->filepath = memory_alloc(FILEPATH_BUFFERSIZE);
 	filepath->rel_path = filepath->filepath;
 	filepath->filename = filepath->filepath;
 	return filepath;
@@ -407,8 +459,8 @@ FILEPATH* filepath_new() {
 void filepath_free(FILEPATH* obj) {
 //	FILEPATH* filepath;
 //	filepath = malloc(sizeof(FILEPATH));
-	free(obj->filepath);
-	free(obj);
+	memory_free(obj->filepath);
+	memory_free(obj);
 }
 
 FILEPATH* filepath_clone(FILEPATH* old) {
@@ -477,4 +529,4 @@ void filepath_rebase(FILEPATH* obj) {
 	if (pointer != NULL) {
 		obj->filename = pointer+1;
 	}
-}
\ No newline at end of file
+}
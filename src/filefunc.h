@@ -19,6 +19,7 @@
 #define PATH_SEP_C '/'
 #endif
 #include "tfstring.h"
+#include <stdbool.h>
 
 char* filename_noext(const char *file);
 char* filename_directory(const char *file);
@@ -27,13 +28,14 @@ char* filename_replace(const char *filepath, const char* filename);
 int fileordir_present(const char *filedir);
 int file_exists(const char *file);
 int is_dir(const char *directory);
+char** dir_list(const char *directory, const char* ext, size_t* count);
 
 void file_align(FILE* fd, size_t align);
 
 FILE* file_open_read(char* filename);
 FILE* file_open_write(char* filename);
 size_t file_size(FILE* fd);
-void file_copy_bytes(FILE* fdsrc, FILE* fddest, size_t len);
+bool file_copy_bytes(FILE* fdsrc, FILE* fddest, size_t len);
 
 
 #define FILE_READ_TYP(typname, typ) \
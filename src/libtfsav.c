@@ -0,0 +1,322 @@
+/*
+ * This file is part of tfsavcodec.
+ *
+ * Copyright (c) 2016, Oskar Eisemuth
+ *
+ * For the full copyright and license information,
+ * please view the LICENSE file that was distributed with this source code.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <stdbool.h>
+
+#include "misc.h"
+#include "memfunc.h"
+#include "stats.h"
+#include "lz4helper.h"
+#include "tfsavegamestruct.h"
+#include "tfsavegame.h"
+#include "libtfsav.h"
+#include "libtfsavinternal.h"
+
+#define MAGICNUMBER_COMPRESSED 0x184D2204
+
+// The savegame buffers stay in codec memory, the allocator is only used
+// for the handle and the buffers handed out by tfsav_write_buffer
+struct _TFSAV {
+	TFSAV_ALLOCATOR allocator;
+	uint8_t* content;	// uncompressed savegame
+	size_t contentlen;
+	void* frame;		// compressed savegame it was opened from, NULL if it wasn't compressed
+	size_t framelen;
+	void* stage1;		// inner frame of frame
+	size_t stage1len;
+	size_t sections[TFSAVEGAME_SECTIONS + 1];
+};
+
+static void* tfsav_default_alloc(void* opaque, size_t size) {
+	return malloc(size);
+}
+
+static void tfsav_default_free(void* opaque, void* ptr) {
+	free(ptr);
+}
+
+static uint32_t tfsav_readLE32(const uint8_t* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void tfsav_set_log_level(TFSAV_LOG_LEVEL level) {
+	verbose = level;
+}
+
+const char* tfsav_strerror(TFSAV_RESULT result) {
+	switch (result) {
+		case TFSAV_OK:			return "no error";
+		case TFSAV_ERROR_ARGUMENT:	return "invalid argument";
+		case TFSAV_ERROR_MEMORY:	return "out of memory";
+		case TFSAV_ERROR_IO:		return "file access failed";
+		case TFSAV_ERROR_FORMAT:	return "not a valid savegame";
+		case TFSAV_ERROR_VERSION:	return "unsupported savegame version";
+		case TFSAV_ERROR_SECTION:	return "savegame sections damaged";
+	}
+	return "unknown error";
+}
+
+static TFSAV_RESULT tfsav_parse(TFSAV* sav) {
+	if (sav->contentlen < 8 || tfsav_readLE32(sav->content) != MAGICNUMBER_TFUNCOMPRESSED) {
+		return TFSAV_ERROR_FORMAT;
+	}
+	if ((int32_t)tfsav_readLE32(sav->content + 4) != TFSAVEGAMEVERSION) {
+		return TFSAV_ERROR_VERSION;
+	}
+	if (!tfsavegame_sections(sav->content, sav->contentlen, sav->sections)) {
+		return TFSAV_ERROR_SECTION;
+	}
+	return TFSAV_OK;
+}
+
+TFSAV_RESULT tfsav_open_owned(void* data, size_t len, const TFSAV_ALLOCATOR* allocator, TFSAV** handle) {
+	TFSAV_ALLOCATOR defaultAllocator = { tfsav_default_alloc, tfsav_default_free, NULL };
+	TFSAV_RESULT result;
+	void* content = NULL;
+	size_t contentlen = 0;
+
+	if (handle == NULL || data == NULL) {
+		memory_free(data);
+		return TFSAV_ERROR_ARGUMENT;
+	}
+	*handle = NULL;
+	if (allocator == NULL) {
+		allocator = &defaultAllocator;
+	}
+	TFSAV* sav = allocator->alloc(allocator->opaque, sizeof(TFSAV));
+	if (sav == NULL) {
+		memory_free(data);
+		return TFSAV_ERROR_MEMORY;
+	}
+	memset(sav, 0, sizeof(TFSAV));
+	sav->allocator = *allocator;
+
+	if (len >= 4 && tfsav_readLE32(data) == MAGICNUMBER_COMPRESSED) {
+		sav->frame = data;
+		sav->framelen = len;
+		if (!decompressBuffer(sav->frame, len, &sav->stage1, &sav->stage1len)) {
+			result = TFSAV_ERROR_FORMAT;
+			goto fail;
+		}
+		if (!decompressBuffer(sav->stage1, sav->stage1len, &content, &contentlen)) {
+			result = TFSAV_ERROR_FORMAT;
+			goto fail;
+		}
+		sav->content = content;
+		sav->contentlen = contentlen;
+	} else {
+		sav->content = data;
+		sav->contentlen = len;
+	}
+
+	result = tfsav_parse(sav);
+	if (result != TFSAV_OK) {
+		goto fail;
+	}
+	*handle = sav;
+	return TFSAV_OK;
+fail:
+	tfsav_close(sav);
+	return result;
+}
+
+TFSAV_RESULT tfsav_open_buffer(const void* data, size_t len, const TFSAV_ALLOCATOR* allocator, TFSAV** handle) {
+	if (handle == NULL || data == NULL) {
+		return TFSAV_ERROR_ARGUMENT;
+	}
+	*handle = NULL;
+	void* copy = memory_tryalloc_category(len, MEMORY_OTHER);
+	if (copy == NULL) {
+		return TFSAV_ERROR_MEMORY;
+	}
+	memcpy(copy, data, len);
+	return tfsav_open_owned(copy, len, allocator, handle);
+}
+
+TFSAV_RESULT tfsav_open_file(const char* filename, const TFSAV_ALLOCATOR* allocator, TFSAV** handle) {
+	if (handle == NULL || filename == NULL) {
+		return TFSAV_ERROR_ARGUMENT;
+	}
+	*handle = NULL;
+	STATS_TIMER timer;
+	stats_start(&timer);
+	FILE* fd = fopen(filename, "rb");
+	if (fd == NULL) {
+		return TFSAV_ERROR_IO;
+	}
+	fseek(fd, 0, SEEK_END);
+	long len = ftell(fd);
+	fseek(fd, 0, SEEK_SET);
+	if (len <= 0) {
+		fclose(fd);
+		return len < 0 ? TFSAV_ERROR_IO : TFSAV_ERROR_FORMAT;
+	}
+	// Read straight into the buffer the handle keeps
+	void* data = memory_tryalloc_category(len, MEMORY_OTHER);
+	if (data == NULL) {
+		fclose(fd);
+		return TFSAV_ERROR_MEMORY;
+	}
+	if (fread(data, len, 1, fd) != 1) {
+		memory_free(data);
+		fclose(fd);
+		return TFSAV_ERROR_IO;
+	}
+	fclose(fd);
+	stats_span(&timer, "read input", len);
+
+	return tfsav_open_owned(data, len, allocator, handle);
+}
+
+TFSAV_RESULT tfsav_section(TFSAV* handle, TFSAV_SECTION section, const void** data, size_t* len) {
+	if (handle == NULL || data == NULL || len == NULL || section < 0 || section >= TFSAV_SECTION_COUNT) {
+		return TFSAV_ERROR_ARGUMENT;
+	}
+	*data = handle->content + handle->sections[section];
+	*len = handle->sections[section + 1] - handle->sections[section];
+	return TFSAV_OK;
+}
+
+TFSAV_RESULT tfsav_content(TFSAV* handle, const void** data, size_t* len) {
+	if (handle == NULL || data == NULL || len == NULL) {
+		return TFSAV_ERROR_ARGUMENT;
+	}
+	*data = handle->content;
+	*len = handle->contentlen;
+	return TFSAV_OK;
+}
+
+TFSAV_RESULT tfsav_get(TFSAV* handle, const char* field, int64_t* value) {
+	size_t offset, width;
+	bool issigned;
+	if (handle == NULL || field == NULL || value == NULL || !tfsavegame_locate(field, &offset, &width, &issigned)) {
+		return TFSAV_ERROR_ARGUMENT;
+	}
+	if (offset + width > handle->contentlen) {
+		return TFSAV_ERROR_SECTION;
+	}
+	uint64_t raw = 0;
+	for (size_t i = 0; i < width; i++) {
+		raw |= (uint64_t)handle->content[offset + i] << (i*8);
+	}
+	if (issigned && width < 8 && (raw >> (width*8 - 1)) & 1) {
+		raw |= ~(uint64_t)0 << (width*8);
+	}
+	*value = (int64_t)raw;
+	return TFSAV_OK;
+}
+
+TFSAV_RESULT tfsav_set(TFSAV* handle, const char* field, const char* value) {
+	size_t offset, width;
+	bool issigned;
+	uint8_t data[8];
+	if (handle == NULL || field == NULL || value == NULL || !tfsavegame_locate(field, &offset, &width, &issigned)) {
+		return TFSAV_ERROR_ARGUMENT;
+	}
+	if (!tfsavegame_parsefield(value, width, issigned, data)) {
+		return TFSAV_ERROR_ARGUMENT;
+	}
+	if (offset + width > handle->contentlen) {
+		return TFSAV_ERROR_SECTION;
+	}
+	memcpy(handle->content + offset, data, width);
+	return TFSAV_OK;
+}
+
+// Compresses the savegame into a buffer of the codec
+static TFSAV_RESULT tfsav_compress(TFSAV* handle, void** out, size_t* outlen) {
+	void* stage1 = NULL;
+	size_t stage1len = 0;
+	bool ok;
+
+	if (handle->stage1 != NULL) {
+		ok = compressBufferReference(handle->content, handle->contentlen, handle->stage1, handle->stage1len, &stage1, &stage1len, false);
+	} else {
+		ok = compressBuffer(handle->content, handle->contentlen, &stage1, &stage1len);
+	}
+	if (!ok) {
+		return TFSAV_ERROR_FORMAT;
+	}
+	ok = compressBufferReference(stage1, stage1len, handle->frame, handle->framelen, out, outlen, true);
+	memory_free(stage1);
+	return ok ? TFSAV_OK : TFSAV_ERROR_FORMAT;
+}
+
+TFSAV_RESULT tfsav_write_buffer(TFSAV* handle, void** data, size_t* len) {
+	void* out = NULL;
+	size_t outlen = 0;
+
+	if (handle == NULL || data == NULL || len == NULL) {
+		return TFSAV_ERROR_ARGUMENT;
+	}
+	TFSAV_RESULT result = tfsav_compress(handle, &out, &outlen);
+	if (result != TFSAV_OK) {
+		return result;
+	}
+	// Handed out, so it has to come from the allocator
+	*data = handle->allocator.alloc(handle->allocator.opaque, outlen);
+	if (*data != NULL) {
+		memcpy(*data, out, outlen);
+	}
+	memory_free(out);
+	if (*data == NULL) {
+		return TFSAV_ERROR_MEMORY;
+	}
+	*len = outlen;
+	return TFSAV_OK;
+}
+
+TFSAV_RESULT tfsav_write_file(TFSAV* handle, const char* filename) {
+	void* data = NULL;
+	size_t len = 0;
+	if (handle == NULL || filename == NULL) {
+		return TFSAV_ERROR_ARGUMENT;
+	}
+	TFSAV_RESULT result = tfsav_compress(handle, &data, &len);
+	if (result != TFSAV_OK) {
+		return result;
+	}
+	STATS_TIMER timer;
+	stats_start(&timer);
+	FILE* fd = fopen(filename, "wb");
+	if (fd == NULL) {
+		memory_free(data);
+		return TFSAV_ERROR_IO;
+	}
+	bool written = fwrite(data, len, 1, fd) == 1;
+	if (fclose(fd) != 0) {
+		written = false;
+	}
+	stats_span(&timer, "write output", len);
+	memory_free(data);
+	return written ? TFSAV_OK : TFSAV_ERROR_IO;
+}
+
+void tfsav_free(TFSAV* handle, void* data) {
+	if (handle != NULL && data != NULL) {
+		handle->allocator.free(handle->allocator.opaque, data);
+	}
+}
+
+void tfsav_close(TFSAV* handle) {
+	if (handle == NULL) {
+		return;
+	}
+	memory_free(handle->content);
+	memory_free(handle->stage1);
+	memory_free(handle->frame);
+	handle->allocator.free(handle->allocator.opaque, handle);
+}
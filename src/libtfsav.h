@@ -0,0 +1,94 @@
+/*
+ * This file is part of tfsavcodec.
+ *
+ * Copyright (c) 2016, Oskar Eisemuth
+ *
+ * For the full copyright and license information,
+ * please view the LICENSE file that was distributed with this source code.
+ *
+ */
+
+#ifndef LIBTFSAV_H
+#define LIBTFSAV_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Library interface of the codec. Every call returns a TFSAV_RESULT
+ * instead of ending the process. A handle holds one savegame, different
+ * handles may be used from different threads at the same time.
+ */
+
+typedef enum {
+	TFSAV_OK = 0,
+	TFSAV_ERROR_ARGUMENT,	// NULL handle, unknown section or field, value out of range
+	TFSAV_ERROR_MEMORY,	// the allocator or the codec returned NULL
+	TFSAV_ERROR_IO,		// reading or writing a file failed
+	TFSAV_ERROR_FORMAT,	// not a savegame or the LZ4 frames are damaged
+	TFSAV_ERROR_VERSION,	// savegame version isn't supported
+	TFSAV_ERROR_SECTION	// sections don't fit into the savegame
+} TFSAV_RESULT;
+
+typedef enum {
+	TFSAV_SECTION_HEADER = 0,
+	TFSAV_SECTION_MODS,
+	TFSAV_SECTION_SETTINGS,
+	TFSAV_SECTION_AFTERSETTINGS,
+	TFSAV_SECTION_MODELREP,
+	TFSAV_SECTION_REMAINING,
+	TFSAV_SECTION_COUNT
+} TFSAV_SECTION;
+
+// Same values as the levels in misc.h
+typedef enum {
+	TFSAV_LOG_ERROR = 0,
+	TFSAV_LOG_WARN = 10,
+	TFSAV_LOG_INFO = 20,	// progress like reused blocks
+	TFSAV_LOG_DEBUG = 30
+} TFSAV_LOG_LEVEL;
+
+typedef struct _TFSAV TFSAV;
+typedef struct _TFSAV_ALLOCATOR TFSAV_ALLOCATOR;
+
+// Used for the handle and the buffers of tfsav_write_buffer, NULL uses
+// malloc/free. The savegame itself stays in memory of the codec.
+struct _TFSAV_ALLOCATOR {
+	void* (*alloc)(void* opaque, size_t size);	// returns NULL on failure
+	void (*free)(void* opaque, void* ptr);
+	void* opaque;
+};
+
+const char* tfsav_strerror(TFSAV_RESULT result);
+
+// Messages above level aren't written to stderr, process wide, default TFSAV_LOG_WARN
+void tfsav_set_log_level(TFSAV_LOG_LEVEL level);
+
+// Compressed or uncompressed savegames, tfsav_open_buffer copies data
+TFSAV_RESULT tfsav_open_buffer(const void* data, size_t len, const TFSAV_ALLOCATOR* allocator, TFSAV** handle);
+TFSAV_RESULT tfsav_open_file(const char* filename, const TFSAV_ALLOCATOR* allocator, TFSAV** handle);
+
+// Points into the uncompressed savegame, valid until the handle is closed
+TFSAV_RESULT tfsav_section(TFSAV* handle, TFSAV_SECTION section, const void** data, size_t* len);
+TFSAV_RESULT tfsav_content(TFSAV* handle, const void** data, size_t* len);
+
+// Header fields by name, e.g. "header.money"
+TFSAV_RESULT tfsav_get(TFSAV* handle, const char* field, int64_t* value);
+TFSAV_RESULT tfsav_set(TFSAV* handle, const char* field, const char* value);
+
+// Compresses the savegame again, reusing unchanged blocks of the opened one
+TFSAV_RESULT tfsav_write_buffer(TFSAV* handle, void** data, size_t* len);
+TFSAV_RESULT tfsav_write_file(TFSAV* handle, const char* filename);
+// Frees a buffer from tfsav_write_buffer
+void tfsav_free(TFSAV* handle, void* data);
+
+void tfsav_close(TFSAV* handle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBTFSAV_H */
@@ -0,0 +1,24 @@
+/*
+ * This file is part of tfsavcodec.
+ *
+ * Copyright (c) 2016, Oskar Eisemuth
+ *
+ * For the full copyright and license information,
+ * please view the LICENSE file that was distributed with this source code.
+ *
+ */
+
+#ifndef LIBTFSAVINTERNAL_H
+#define LIBTFSAVINTERNAL_H
+
+#include "libtfsav.h"
+
+/*
+ * Calls for the tools built with the library, not part of the interface.
+ */
+
+// Like tfsav_open_buffer, but takes data instead of copying it. data has to
+// come from memory_alloc and is freed by the handle, also when opening fails.
+TFSAV_RESULT tfsav_open_owned(void* data, size_t len, const TFSAV_ALLOCATOR* allocator, TFSAV** handle);
+
+#endif /* LIBTFSAVINTERNAL_H */
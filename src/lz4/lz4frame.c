@@ -369,6 +369,12 @@ LZ4F_errorCode_t LZ4F_createCompressionContext(LZ4F_compressionContext_t* LZ4F_c
     return LZ4F_OK_NoError;
 }
 
+void LZ4F_resetCompressionContext(LZ4F_compressionContext_t LZ4F_compressionContext)
+{
+    LZ4F_cctx_t* cctxPtr = (LZ4F_cctx_t*)LZ4F_compressionContext;
+    cctxPtr->cStage = 0;
+}
+
 
 LZ4F_errorCode_t LZ4F_freeCompressionContext(LZ4F_compressionContext_t LZ4F_compressionContext)
 {
@@ -802,6 +808,12 @@ typedef enum { dstage_getHeader=0, dstage_storeHeader,
     dstage_getCBlockChecksum, dstage_storeCBlockChecksum
 } dStage_t;
 
+void LZ4F_resetDecompressionContext(LZ4F_decompressionContext_t LZ4F_decompressionContext)
+{
+    LZ4F_dctx_t* dctxPtr = (LZ4F_dctx_t*)LZ4F_decompressionContext;
+    dctxPtr->dStage = dstage_getHeader;
+}
+
 
 /* LZ4F_decodeHeader
    return : nb Bytes read from srcVoidPtr (necessarily <= srcSize)
@@ -1157,7 +1169,7 @@ size_t LZ4F_decompress(LZ4F_decompressionContext_t decompressionContext,
                     break;
                 }
                 if (nextCBlockSize > dctxPtr->maxBlockSize) return (size_t)-LZ4F_ERROR_GENERIC;   /* invalid cBlockSize */
-                if (dctxPtr->frameInfo.blockChecksumFlag)
+                if (dctxPtr->frameInfo.blockChecksumFlag && !decompressOptionsPtr->skipBlockChecksum)
                 {
                     /* Require reseting block checksum state */
                     XXH32_reset(&(dctxPtr->xxhBlock), 0);
@@ -1211,9 +1223,12 @@ size_t LZ4F_decompress(LZ4F_decompressionContext_t decompressionContext,
 
         /* case dstage_checkCBlockChecksum: */
             {
-                U32 readCRC = LZ4F_readLE32(selectedIn);
-                U32 resultCRC = XXH32_digest(&(dctxPtr->xxhBlock));
-                if (readCRC != resultCRC) return (size_t)-LZ4F_ERROR_blockChecksum_invalid;
+                if (!decompressOptionsPtr->skipBlockChecksum)
+                {
+                    U32 readCRC = LZ4F_readLE32(selectedIn);
+                    U32 resultCRC = XXH32_digest(&(dctxPtr->xxhBlock));
+                    if (readCRC != resultCRC) return (size_t)-LZ4F_ERROR_blockChecksum_invalid;
+                }
                 dctxPtr->dStage = dstage_getCBlockSize;
                 break;
             }
@@ -1226,8 +1241,8 @@ size_t LZ4F_decompress(LZ4F_decompressionContext_t decompressionContext,
                 if ((size_t)(srcEnd-srcPtr) < sizeToCopy) sizeToCopy = srcEnd - srcPtr;  /* not enough input to read full block */
                 if ((size_t)(dstEnd-dstPtr) < sizeToCopy) sizeToCopy = dstEnd - dstPtr;
                 memcpy(dstPtr, srcPtr, sizeToCopy);
-                if (dctxPtr->frameInfo.blockChecksumFlag) XXH32_update(&(dctxPtr->xxhBlock), srcPtr, sizeToCopy);
-                if (dctxPtr->frameInfo.contentChecksumFlag) XXH32_update(&(dctxPtr->xxh), srcPtr, sizeToCopy);
+                if (dctxPtr->frameInfo.blockChecksumFlag && !decompressOptionsPtr->skipBlockChecksum) XXH32_update(&(dctxPtr->xxhBlock), srcPtr, sizeToCopy);
+                if (dctxPtr->frameInfo.contentChecksumFlag && !decompressOptionsPtr->skipContentChecksum) XXH32_update(&(dctxPtr->xxh), srcPtr, sizeToCopy);
                 if (dctxPtr->frameInfo.contentSize) dctxPtr->frameRemainingSize -= sizeToCopy;
 
                 /* dictionary management */
@@ -1284,7 +1299,7 @@ size_t LZ4F_decompress(LZ4F_decompressionContext_t decompressionContext,
 
         case dstage_decodeCBlock:
             {
-                if (dctxPtr->frameInfo.blockChecksumFlag)
+                if (dctxPtr->frameInfo.blockChecksumFlag && !decompressOptionsPtr->skipBlockChecksum)
                 {
                     XXH32_update(&(dctxPtr->xxhBlock), selectedIn, dctxPtr->tmpInTarget);
                 }
@@ -1307,7 +1322,7 @@ size_t LZ4F_decompress(LZ4F_decompressionContext_t decompressionContext,
 
                 decodedSize = decoder((const char*)selectedIn, (char*)dstPtr, (int)dctxPtr->tmpInTarget, (int)dctxPtr->maxBlockSize, (const char*)dctxPtr->dict, (int)dctxPtr->dictSize);
                 if (decodedSize < 0) return (size_t)-LZ4F_ERROR_GENERIC;   /* decompression failed */
-                if (dctxPtr->frameInfo.contentChecksumFlag) XXH32_update(&(dctxPtr->xxh), dstPtr, decodedSize);
+                if (dctxPtr->frameInfo.contentChecksumFlag && !decompressOptionsPtr->skipContentChecksum) XXH32_update(&(dctxPtr->xxh), dstPtr, decodedSize);
                 if (dctxPtr->frameInfo.contentSize) dctxPtr->frameRemainingSize -= decodedSize;
 
                 /* dictionary management */
@@ -1356,7 +1371,7 @@ size_t LZ4F_decompress(LZ4F_decompressionContext_t decompressionContext,
                 /* Decode */
                 decodedSize = decoder((const char*)selectedIn, (char*)dctxPtr->tmpOut, (int)dctxPtr->tmpInTarget, (int)dctxPtr->maxBlockSize, (const char*)dctxPtr->dict, (int)dctxPtr->dictSize);
                 if (decodedSize < 0) return (size_t)-LZ4F_ERROR_decompressionFailed;   /* decompression failed */
-                if (dctxPtr->frameInfo.contentChecksumFlag) XXH32_update(&(dctxPtr->xxh), dctxPtr->tmpOut, decodedSize);
+                if (dctxPtr->frameInfo.contentChecksumFlag && !decompressOptionsPtr->skipContentChecksum) XXH32_update(&(dctxPtr->xxh), dctxPtr->tmpOut, decodedSize);
                 if (dctxPtr->frameInfo.contentSize) dctxPtr->frameRemainingSize -= decodedSize;
                 dctxPtr->tmpOutSize = decodedSize;
                 dctxPtr->tmpOutStart = 0;
@@ -1433,9 +1448,12 @@ size_t LZ4F_decompress(LZ4F_decompressionContext_t decompressionContext,
 
         /* case dstage_checkSuffix: */   /* no direct call, to avoid scan-build warning */
             {
-                U32 readCRC = LZ4F_readLE32(selectedIn);
-                U32 resultCRC = XXH32_digest(&(dctxPtr->xxh));
-                if (readCRC != resultCRC) return (size_t)-LZ4F_ERROR_contentChecksum_invalid;
+                if (!decompressOptionsPtr->skipContentChecksum)
+                {
+                    U32 readCRC = LZ4F_readLE32(selectedIn);
+                    U32 resultCRC = XXH32_digest(&(dctxPtr->xxh));
+                    if (readCRC != resultCRC) return (size_t)-LZ4F_ERROR_contentChecksum_invalid;
+                }
                 nextSrcSizeHint = 0;
                 dctxPtr->dStage = dstage_getHeader;
                 doAnotherStage = 0;
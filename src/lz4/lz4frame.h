@@ -164,6 +164,7 @@ typedef struct {
 #define LZ4F_VERSION 100
 LZ4F_errorCode_t LZ4F_createCompressionContext(LZ4F_compressionContext_t* cctxPtr, unsigned version);
 LZ4F_errorCode_t LZ4F_freeCompressionContext(LZ4F_compressionContext_t cctx);
+void LZ4F_resetCompressionContext(LZ4F_compressionContext_t cctx);
 /* LZ4F_createCompressionContext() :
  * The first thing to do is to create a compressionContext object, which will be used in all compression operations.
  * This is achieved using LZ4F_createCompressionContext(), which takes as argument a version and an LZ4F_preferences_t structure.
@@ -236,7 +237,9 @@ typedef struct LZ4F_dctx_s* LZ4F_decompressionContext_t;   /* must be aligned on
 
 typedef struct {
   unsigned stableDst;       /* guarantee that decompressed data will still be there on next function calls (avoid storage into tmp buffers) */
-  unsigned reserved[3];
+  unsigned skipBlockChecksum; /* block checksums were verified by the caller, only skip over them */
+  unsigned skipContentChecksum; /* content checksum is verified by the caller */
+  unsigned reserved[1];
 } LZ4F_decompressOptions_t;
 
 
@@ -244,6 +247,10 @@ typedef struct {
 
 LZ4F_errorCode_t LZ4F_createDecompressionContext(LZ4F_decompressionContext_t* dctxPtr, unsigned version);
 LZ4F_errorCode_t LZ4F_freeDecompressionContext(LZ4F_decompressionContext_t dctx);
+void LZ4F_resetDecompressionContext(LZ4F_decompressionContext_t dctx);
+/* LZ4F_resetDecompressionContext() / LZ4F_resetCompressionContext() :
+ * abandon a frame that wasn't finished (e.g. after an error), buffers are kept for the next frame.
+ */
 /* LZ4F_createDecompressionContext() :
  * The first thing to do is to create an LZ4F_decompressionContext_t object, which will be used in all decompression operations.
  * This is achieved using LZ4F_createDecompressionContext().
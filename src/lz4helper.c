@@ -8,14 +8,46 @@
  * 
  */
 
+#include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include "lz4/lz4.h"
 #include "lz4/lz4frame.h"
+#include "lz4/xxhash.h"
+#include "lz4helper.h"
+#include "xxhmulti.h"
+#include "spscqueue.h"
+#include "threadpool.h"
 #include "memfunc.h"
 #include "misc.h"
+#include "stats.h"
+
+// Everything allocated here counts as LZ4 memory
+#define memory_alloc(size) memory_alloc_category(size, MEMORY_LZ4)
+#define memory_realloc(ptr, size) memory_realloc_category(ptr, size, MEMORY_LZ4)
+// Buffers sized by the input fail the call instead of ending the process
+#define memory_tryalloc(size) memory_tryalloc_category(size, MEMORY_LZ4)
+#define memory_tryrealloc(ptr, size) memory_tryrealloc_category(ptr, size, MEMORY_LZ4)
+
+static const char* allocError = "Can't alloc memory for the output buffer";
+
+// Grows buf to size, on failure buf stays valid and has to be freed by the caller
+static bool growBuffer(void** buf, size_t size) {
+	void* grown = memory_tryrealloc(*buf, size);
+	if (grown == NULL) {
+		return false;
+	}
+	*buf = grown;
+	return true;
+}
+
+int hashthread = 0;
 
 struct lz4helper_dctx {
+	bool skipBlockChecksum;
+	LZ4HELPER_BLOCKINDEX* index;	// set when the content checksum is hashed on its own thread
 	size_t srcSize;
 	void* srcBuf;
 	void* dstBuf;
@@ -36,26 +68,135 @@ struct lz4helper_cctx {
 };
 
 typedef struct lz4helper_cctx lz4helper_cctx;
+#define KiB *(1 <<10)
 #define MiB *(1 <<20)
 
+#define LZ4HELPER_MAGIC 0x184D2204U
+#define LZ4HELPER_BLOCKUNCOMPRESSED 0x80000000U
+#define LZ4HELPER_HEADERMIN 7	// magic, FLG, BD and header checksum
+#define LZ4HELPER_BLOCKSIZE (256 KiB)	// LZ4F_max256KB
+
+/*
+ * Frames of at least LZ4HELPER_SPLITBLOCKS blocks are split into tasks of
+ * LZ4HELPER_TASKBLOCKS blocks when the caller runs on a pool worker, so
+ * idle workers can steal parts of a big savegame. Smaller frames stay a
+ * single task.
+ */
+#define LZ4HELPER_SPLITBLOCKS 16
+#define LZ4HELPER_TASKBLOCKS 4
+
+/*
+ * Every thread keeps one compression and one decompression context. They
+ * are reset after each frame instead of being created and freed for every
+ * buffer, so the internal buffers stay allocated across frames and files.
+ * The contexts are freed when the thread ends.
+ */
+struct _LZ4HELPER_CONTEXTS {
+	LZ4F_compressionContext_t cctx;
+	LZ4F_decompressionContext_t dctx;
+};
+
+static pthread_key_t contextsKey;
+static pthread_once_t contextsOnce = PTHREAD_ONCE_INIT;
+
+static void contextsFree(void* arg) {
+	LZ4HELPER_CONTEXTS* contexts = arg;
+	LZ4F_freeCompressionContext(contexts->cctx);
+	LZ4F_freeDecompressionContext(contexts->dctx);
+	memory_free(contexts);
+}
+
+static void contextsKeyCreate(void) {
+	pthread_key_create(&contextsKey, contextsFree);
+}
+
+LZ4HELPER_CONTEXTS* lz4helper_contexts_get(void) {
+	pthread_once(&contextsOnce, contextsKeyCreate);
+	LZ4HELPER_CONTEXTS* contexts = pthread_getspecific(contextsKey);
+	if (contexts != NULL) {
+		return contexts;
+	}
+	LZ4F_errorCode_t lz4err;
+	contexts = memory_alloc(sizeof(LZ4HELPER_CONTEXTS));
+	lz4err = LZ4F_createCompressionContext(&contexts->cctx, LZ4F_VERSION);
+	if(LZ4F_isError(lz4err)) {
+		print_err(1, "LZ4 (createCompressionContext) %s\n", LZ4F_getErrorName(lz4err));
+		contextsFree(contexts);
+		return NULL;
+	}
+	lz4err = LZ4F_createDecompressionContext(&contexts->dctx, LZ4F_VERSION);
+	if(LZ4F_isError(lz4err)) {
+		print_err(1, "LZ4 (createDecompressionContext) %s\n", LZ4F_getErrorName(lz4err));
+		contextsFree(contexts);
+		return NULL;
+	}
+	pthread_setspecific(contextsKey, contexts);
+	return contexts;
+}
+
+/*
+ * Frees the contexts of the calling thread, the main thread has no
+ * destructor run on exit.
+ */
+void lz4helper_contexts_release(void) {
+	pthread_once(&contextsOnce, contextsKeyCreate);
+	LZ4HELPER_CONTEXTS* contexts = pthread_getspecific(contextsKey);
+	if (contexts != NULL) {
+		pthread_setspecific(contextsKey, NULL);
+		contextsFree(contexts);
+	}
+}
+
+static void compressPreferences(LZ4F_preferences_t* compressPref) {
+	memset(compressPref, 0, sizeof(*compressPref));
+	compressPref->compressionLevel = 0;
+	compressPref->frameInfo.blockSizeID = LZ4F_max256KB;
+	compressPref->frameInfo.blockMode = LZ4F_blockIndependent; // LZ4F_blockLinked; TF braucht LZ4F_blockIndependent
+	compressPref->frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+	compressPref->frameInfo.frameType = LZ4F_frame;
+	compressPref->frameInfo.blockChecksumFlag = LZ4F_blockChecksumEnabled; // LZ4F_noBlockChecksum;
+	
+	compressPref->frameInfo.contentSize = 0; //helper_ctx->srcSize;  // TF braucht 0
+}
+
+static uint32_t readLE32(const uint8_t* p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void writeLE32(uint8_t* p, uint32_t value) {
+	p[0] = (uint8_t)value;
+	p[1] = (uint8_t)(value >> 8);
+	p[2] = (uint8_t)(value >> 16);
+	p[3] = (uint8_t)(value >> 24);
+}
+
 bool decompressBufferInner(lz4helper_dctx* helper_ctx) {	
 	LZ4F_decompressOptions_t decOpt;
 	memset(&decOpt, 0, sizeof(decOpt));
+	decOpt.skipBlockChecksum = helper_ctx->skipBlockChecksum;
 	
 	helper_ctx->dstSize = helper_ctx->srcSize;
-	helper_ctx->dstBuf = memory_alloc(helper_ctx->dstSize);
-	
+	helper_ctx->dstBuf = memory_tryalloc(helper_ctx->dstSize);
+	if (helper_ctx->dstBuf == NULL) {
+		helper_ctx->errstring = allocError;
+		return false;
+	}
 	
 	size_t srcPos = 0;
 	size_t dstPos = 0;
+	// One block per call, so every block gets its own span, LZ4F hints the size of the next one
+	size_t nextSize = LZ4HELPER_HEADERMIN;
 	
 	LZ4F_errorCode_t errOrSizeHint = 0;
 	while(srcPos < helper_ctx->srcSize) {
-		print(0, "Loop... \n");
+		print_debug(0, "Loop... \n");
 		if ( (dstPos+(128 MiB)) >= helper_ctx->dstSize ) {
+			if (!growBuffer(&helper_ctx->dstBuf, helper_ctx->dstSize + (128 MiB))) {
+				helper_ctx->errstring = allocError;
+				return false;
+			}
 			helper_ctx->dstSize += (128 MiB);
-			helper_ctx->dstBuf = memory_realloc(helper_ctx->dstBuf, helper_ctx->dstSize);
-			print(0, "Reallocing DstBuffer %d\n", helper_ctx->dstSize);
+			print_debug(0, "Reallocing DstBuffer %zu\n", helper_ctx->dstSize);
 		}
 		
 		const char* srcBufPtr = helper_ctx->srcBuf + srcPos;
@@ -64,7 +205,12 @@ bool decompressBufferInner(lz4helper_dctx* helper_ctx) {
 	
 		size_t srcSize = helper_ctx->srcSize - srcPos;
 		size_t dstSize = helper_ctx->dstSize - dstPos;
+		if (nextSize < srcSize) {
+			srcSize = nextSize;
+		}
 
+		STATS_TIMER timer;
+		stats_start(&timer);
 		// decSize and srcSize are updated in LZ4F_decompress()
 		errOrSizeHint = LZ4F_decompress(helper_ctx->lz4ctx, dstBufPtr, &dstSize, srcBufPtr, &srcSize, &decOpt);
 		if(LZ4F_isError(errOrSizeHint)) {
@@ -72,40 +218,197 @@ bool decompressBufferInner(lz4helper_dctx* helper_ctx) {
 			print_err(0, "%s\n", helper_ctx->errstring);
 			return false;
 		}
+		if (dstSize > 0) {
+			stats_span(&timer, "decode block", dstSize);
+		}
+		// 0 ends the frame, another one may follow
+		nextSize = errOrSizeHint > 0 ? errOrSizeHint : LZ4HELPER_HEADERMIN;
 
 		dstPos += dstSize;
 		srcPos += srcSize;
         }
+	// LZ4F still expects input, the content checksum wasn't checked either
+	if (errOrSizeHint != 0) {
+		helper_ctx->errstring = "Frame truncated";
+		print_err(0, "%s\n", helper_ctx->errstring);
+		return false;
+	}
 	helper_ctx->dstSize = dstPos;
 	return true;
 }
 
 
+struct lz4helper_hashrange {
+	size_t offset;
+	size_t len;		// 0 ends the hashing
+};
+
+struct lz4helper_hasher {
+	SPSCQUEUE* queue;
+	const char* buf;
+	uint32_t digest;
+};
+
+static void* hashThread(void* arg) {
+	struct lz4helper_hasher* hasher = arg;
+	struct lz4helper_hashrange range;
+	XXH32_state_t xxh;
+	
+	XXH32_reset(&xxh, 0);
+	for (;;) {
+		spscqueue_pop(hasher->queue, &range);
+		if (range.len == 0) {
+			break;
+		}
+		STATS_TIMER timer;
+		stats_start(&timer);
+		XXH32_update(&xxh, hasher->buf + range.offset, range.len);
+		stats_span(&timer, "hash content", range.len);
+	}
+	hasher->digest = XXH32_digest(&xxh);
+	return NULL;
+}
+
+/*
+ * Same as decompressBufferInner, but the content checksum is computed on a
+ * separate thread. The frame is fed to LZ4F one block at a time and every
+ * decoded range is handed to the hashing thread while the next block is
+ * decoded. The output buffer is allocated up front from the block index,
+ * so it never moves while it is being hashed.
+ */
+bool decompressBufferHashed(lz4helper_dctx* helper_ctx) {
+	LZ4HELPER_BLOCKINDEX* index = helper_ctx->index;
+	LZ4F_decompressOptions_t decOpt;
+	struct lz4helper_hasher hasher;
+	struct lz4helper_hashrange range;
+	pthread_t thread;
+	bool ok = true;
+	
+	helper_ctx->dstSize = index->count * index->blocksize + 1;
+	helper_ctx->dstBuf = memory_tryalloc(helper_ctx->dstSize);
+	if (helper_ctx->dstBuf == NULL) {
+		helper_ctx->errstring = allocError;
+		return false;
+	}
+	
+	hasher.queue = spscqueue_create(256, sizeof(struct lz4helper_hashrange));
+	hasher.buf = helper_ctx->dstBuf;
+	bool threaded = pthread_create(&thread, NULL, hashThread, &hasher) == 0;
+	
+	memset(&decOpt, 0, sizeof(decOpt));
+	decOpt.skipBlockChecksum = helper_ctx->skipBlockChecksum;
+	decOpt.skipContentChecksum = threaded;
+	
+	size_t srcPos = 0;
+	size_t dstPos = 0;
+	
+	for (size_t i = 0; i <= index->count && ok; i++) {
+		STATS_TIMER timer;
+		stats_start(&timer);
+		size_t blockStart = dstPos;
+		size_t srcEnd = helper_ctx->srcSize;
+		if (i < index->count) {
+			srcEnd = index->blocks[i].offset + index->blocks[i].size + (index->blockchecksum ? 4 : 0);
+		}
+		while (srcPos < srcEnd) {
+			size_t srcSize = srcEnd - srcPos;
+			size_t dstSize = helper_ctx->dstSize - dstPos;
+			
+			LZ4F_errorCode_t errOrSizeHint = LZ4F_decompress(helper_ctx->lz4ctx, (char*)helper_ctx->dstBuf + dstPos, &dstSize, (const char*)helper_ctx->srcBuf + srcPos, &srcSize, &decOpt);
+			if (LZ4F_isError(errOrSizeHint)) {
+				helper_ctx->errstring = LZ4F_getErrorName(errOrSizeHint);
+				ok = false;
+				break;
+			}
+			if (srcSize == 0 && dstSize == 0) {
+				helper_ctx->errstring = "Decompression stalled";
+				ok = false;
+				break;
+			}
+			if (threaded && dstSize > 0) {
+				range.offset = dstPos;
+				range.len = dstSize;
+				spscqueue_push(hasher.queue, &range);
+			}
+			dstPos += dstSize;
+			srcPos += srcSize;
+		}
+		stats_span(&timer, "decode block", dstPos - blockStart);
+	}
+	
+	if (threaded) {
+		range.offset = 0;
+		range.len = 0;
+		spscqueue_push(hasher.queue, &range);
+		pthread_join(thread, NULL);
+		if (ok && hasher.digest != readLE32((const uint8_t*)helper_ctx->srcBuf + index->framesize - 4)) {
+			helper_ctx->errstring = "ERROR_contentChecksum_invalid";
+			ok = false;
+		}
+	}
+	spscqueue_free(hasher.queue);
+	
+	if (!ok) {
+		print_err(0, "%s\n", helper_ctx->errstring);
+	}
+	helper_ctx->dstSize = dstPos;
+	return ok;
+}
+
+static bool decompressBufferSplit(THREADPOOL* pool, LZ4HELPER_BLOCKINDEX* index, const void* frame, void** outbuffer, size_t* outlen);
 
 bool decompressBuffer(void *inbuffer, size_t inlen, void **outbuffer, size_t* outlen) {
 	lz4helper_dctx ctx;
 	memset(&ctx, 0, sizeof(ctx));
-	LZ4F_errorCode_t lz4err;
 	
 	ctx.srcBuf = inbuffer;
 	ctx.srcSize = inlen;
 	
-	lz4err = LZ4F_createDecompressionContext(&(ctx.lz4ctx), LZ4F_VERSION);
-	if(LZ4F_isError(lz4err)) {
-		print_err(1, "LZ4 (createDecompressionContext) %s", LZ4F_getErrorName(lz4err));
-		exit(-1);
+	// Check all block checksums at once, LZ4F only has to skip them
+	STATS_TIMER timer;
+	stats_start(&timer);
+	LZ4HELPER_BLOCKINDEX* index = lz4helper_blockindex_new(inbuffer, inlen);
+	if (index != NULL && index->blockchecksum) {
+		if (!lz4helper_blockindex_verify(index, inbuffer)) {
+			print_err(1, "LZ4 block checksum invalid\n");
+			lz4helper_blockindex_free(index);
+			return false;
+		}
+		ctx.skipBlockChecksum = true;
+	}
+	stats_span(&timer, "verify block checksums", inlen);
+	THREADPOOL* pool = threadpool_current();
+	if (pool != NULL && index != NULL && index->blockindependent && index->headersize == 7
+		&& index->count >= LZ4HELPER_SPLITBLOCKS && index->framesize == inlen) {
+		if (decompressBufferSplit(pool, index, inbuffer, outbuffer, outlen)) {
+			lz4helper_blockindex_free(index);
+			return true;
+		}
+	}
+	// Hashing on its own thread only pays off with a second cpu, frames followed by more data stay with LZ4F
+	if (hashthread && index != NULL && index->blockindependent && index->contentchecksum && index->framesize == inlen
+		&& threadpool_cpucount() > 1) {
+		ctx.index = index;
+	} else {
+		lz4helper_blockindex_free(index);
 	}
 	
-	
-	if (!decompressBufferInner(&ctx)) {
-		print_err(1, "LZ4 %s\n", ctx.errstring);
-		exit(-1);
+	LZ4HELPER_CONTEXTS* contexts = lz4helper_contexts_get();
+	if (contexts == NULL) {
+		lz4helper_blockindex_free(ctx.index);
+		return false;
 	}
+	ctx.lz4ctx = contexts->dctx;
 	
-	lz4err = LZ4F_freeDecompressionContext(ctx.lz4ctx);
-	if(LZ4F_isError(lz4err)) {
-		print_err(1, "LZ4 (freeDecompressionContext) %s\n", LZ4F_getErrorName(lz4err));
-		exit(-1);
+	bool ok = ctx.index ? decompressBufferHashed(&ctx) : decompressBufferInner(&ctx);
+	stats_span(&timer, "decode frame", ctx.dstSize);
+	lz4helper_blockindex_free(ctx.index);
+	// A frame may end early, the context has to start with a header again
+	LZ4F_resetDecompressionContext(ctx.lz4ctx);
+	if (!ok) {
+		print_err(1, "LZ4 %s\n", ctx.errstring);
+		memory_free(ctx.dstBuf);
+		return false;
 	}
 	
 	*outbuffer = ctx.dstBuf;
@@ -115,19 +418,14 @@ bool decompressBuffer(void *inbuffer, size_t inlen, void **outbuffer, size_t* ou
 
 bool compressBufferInner(lz4helper_cctx* helper_ctx) {	
 	LZ4F_preferences_t compressPref;
-	memset(&compressPref, 0, sizeof(compressPref));
-	compressPref.compressionLevel = 0;
-	compressPref.frameInfo.blockSizeID = LZ4F_max256KB;
-	compressPref.frameInfo.blockMode = LZ4F_blockIndependent; // LZ4F_blockLinked; TF braucht LZ4F_blockIndependent
-	compressPref.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
-	compressPref.frameInfo.frameType = LZ4F_frame;
-	compressPref.frameInfo.blockChecksumFlag = LZ4F_blockChecksumEnabled; // LZ4F_noBlockChecksum;
-	
-	compressPref.frameInfo.contentSize = 0; //helper_ctx->srcSize;  // TF braucht 0
+	compressPreferences(&compressPref);
 	
 	helper_ctx->dstSize = helper_ctx->srcSize;
-	helper_ctx->dstBuf = memory_alloc(helper_ctx->dstSize);
-	
+	helper_ctx->dstBuf = memory_tryalloc(helper_ctx->dstSize);
+	if (helper_ctx->dstBuf == NULL) {
+		helper_ctx->errstring = allocError;
+		return false;
+	}
 	
 	size_t srcPos = 0;
 	size_t dstPos = 0;
@@ -151,42 +449,63 @@ bool compressBufferInner(lz4helper_cctx* helper_ctx) {
 		
 	size_t maxsize = LZ4F_compressBound(helper_ctx->srcSize, &compressPref);
 	if ( (dstPos+(maxsize)) >= helper_ctx->dstSize ) {
+		if (!growBuffer(&helper_ctx->dstBuf, helper_ctx->dstSize + maxsize)) {
+			helper_ctx->errstring = allocError;
+			return false;
+		}
 		helper_ctx->dstSize += maxsize;
-		helper_ctx->dstBuf = memory_realloc(helper_ctx->dstBuf, helper_ctx->dstSize);
-		print(0, "Reallocing DstBuffer %d (added %d)\n", helper_ctx->dstSize, maxsize);
+		print_debug(0, "Reallocing DstBuffer %zu (added %zu)\n", helper_ctx->dstSize, maxsize);
 	}
 	
-	const char* srcBufPtr = helper_ctx->srcBuf + srcPos;
-	char* dstBufPtr = helper_ctx->dstBuf + dstPos;
+	// One block per call, gives the same frame as a single call but a span per block
+	while (srcPos < helper_ctx->srcSize) {
+		const char* srcBufPtr = helper_ctx->srcBuf + srcPos;
+		char* dstBufPtr = helper_ctx->dstBuf + dstPos;
 		
-	
-	srcSize = helper_ctx->srcSize - srcPos;
-	dstSize = helper_ctx->dstSize - dstPos;
+		srcSize = helper_ctx->srcSize - srcPos;
+		if (srcSize > LZ4HELPER_BLOCKSIZE) {
+			srcSize = LZ4HELPER_BLOCKSIZE;
+		}
+		dstSize = helper_ctx->dstSize - dstPos;
 
+		STATS_TIMER timer;
+		stats_start(&timer);
+		errOrSizeHint = LZ4F_compressUpdate(helper_ctx->lz4ctx, dstBufPtr, dstSize, srcBufPtr, srcSize, NULL);
+		if(LZ4F_isError(errOrSizeHint)) {
+			helper_ctx->errstring = LZ4F_getErrorName(errOrSizeHint);
+			print_err(0, "%s\n", helper_ctx->errstring);
+			return false;
+		}
+		// A last partial block is only buffered, compressEnd encodes it
+		if (errOrSizeHint > 0) {
+			stats_span(&timer, "encode block", srcSize);
+		}
 
-	errOrSizeHint = LZ4F_compressUpdate(helper_ctx->lz4ctx, dstBufPtr, dstSize, srcBufPtr, srcSize, NULL);
-	if(LZ4F_isError(errOrSizeHint)) {
-		helper_ctx->errstring = LZ4F_getErrorName(errOrSizeHint);
-		print_err(0, "%s\n", helper_ctx->errstring);
-		return false;
+		dstPos += errOrSizeHint;
+		srcPos += srcSize;
 	}
-
-	dstPos += errOrSizeHint;
-	srcPos += srcSize;
 	
 	// Make room for remaining data
 	if ( (dstPos+(128 MiB)) >= helper_ctx->dstSize ) {
+		if (!growBuffer(&helper_ctx->dstBuf, helper_ctx->dstSize + (128 MiB))) {
+			helper_ctx->errstring = allocError;
+			return false;
+		}
 		helper_ctx->dstSize += (128 MiB);
-		helper_ctx->dstBuf = memory_realloc(helper_ctx->dstBuf, helper_ctx->dstSize);
-		print(0, "Reallocing DstBuffer for compressEnd %d\n", helper_ctx->dstSize);
+		print_debug(0, "Reallocing DstBuffer for compressEnd %zu\n", helper_ctx->dstSize);
 	}
 	
+	STATS_TIMER timer;
+	stats_start(&timer);
 	errOrSizeHint = LZ4F_compressEnd(helper_ctx->lz4ctx, helper_ctx->dstBuf + dstPos, helper_ctx->dstSize - dstPos, NULL);
 	if(LZ4F_isError(errOrSizeHint)) {
 		helper_ctx->errstring = LZ4F_getErrorName(errOrSizeHint);
 		print_err(0, "%s\n", helper_ctx->errstring);
 		return false;
 	}
+	if (helper_ctx->srcSize % LZ4HELPER_BLOCKSIZE != 0) {
+		stats_span(&timer, "encode block", helper_ctx->srcSize % LZ4HELPER_BLOCKSIZE);
+	}
 	dstPos += errOrSizeHint;
 	
 	helper_ctx->dstSize = dstPos;
@@ -198,30 +517,1055 @@ bool compressBufferInner(lz4helper_cctx* helper_ctx) {
 bool compressBuffer(void *inbuffer, size_t inlen, void **outbuffer, size_t* outlen) {
 	lz4helper_cctx ctx;
 	memset(&ctx, 0, sizeof(ctx));
-	LZ4F_errorCode_t lz4err;
 	
+	// Without a reference this gives the same frame, but split into block tasks
+	if (threadpool_current() != NULL && inlen >= LZ4HELPER_SPLITBLOCKS * LZ4HELPER_BLOCKSIZE) {
+		return compressBufferReference(inbuffer, inlen, NULL, 0, outbuffer, outlen, false);
+	}
+	
+	LZ4HELPER_CONTEXTS* contexts = lz4helper_contexts_get();
+	if (contexts == NULL) {
+		return false;
+	}
 	ctx.srcBuf = inbuffer;
 	ctx.srcSize = inlen;
+	ctx.lz4ctx = contexts->cctx;
 	
-	lz4err = LZ4F_createCompressionContext(&(ctx.lz4ctx), LZ4F_VERSION);
-	if(LZ4F_isError(lz4err)) {
-		print_err(1, "LZ4 (createCompressionContext) %s", LZ4F_getErrorName(lz4err));
-		exit(-1);
+	STATS_TIMER timer;
+	stats_start(&timer);
+	bool ok = compressBufferInner(&ctx);
+	stats_span(&timer, "encode frame", inlen);
+	LZ4F_resetCompressionContext(ctx.lz4ctx);
+	if (!ok) {
+		print_err(1, "LZ4 %s\n", ctx.errstring);
+		memory_free(ctx.dstBuf);
+		return false;
 	}
 	
+	*outbuffer = ctx.dstBuf;
+	*outlen = ctx.dstSize;
+	return true;
+}
+
+/*
+ * Streaming for pipes: frames nested into each other are decoded or
+ * encoded chunk by chunk, each stage handing its output to the next one.
+ * Nothing is seeked and only a few blocks are kept in memory. The block
+ * checksums are checked by LZ4F itself, there is no block index.
+ */
+#define LZ4HELPER_STREAMCHUNK (256 KiB)
+#define LZ4HELPER_STREAMFRAMES 4
+
+typedef struct lz4helper_stream lz4helper_stream;
+struct lz4helper_stream {
+	LZ4F_compressionContext_t cctx;
+	LZ4F_decompressionContext_t dctx;
+	char* buf;
+	size_t bufSize;
+	size_t hint;		// 0 once a decoded frame is complete
+	lz4helper_stream* next;	// NULL writes to out
+	FILE* out;
+	const char* errstring;
+};
+
+static bool streamPut(lz4helper_stream* stream, const char* src, size_t len);
+
+static bool streamOut(lz4helper_stream* stream, const char* data, size_t len) {
+	if (len == 0) {
+		return true;
+	}
+	if (stream->next != NULL) {
+		return streamPut(stream->next, data, len);
+	}
+	STATS_TIMER timer;
+	stats_start(&timer);
+	if (fwrite(data, len, 1, stream->out) != 1) {
+		stream->errstring = "Writing output failed";
+		return false;
+	}
+	stats_span(&timer, "write output", len);
+	return true;
+}
+
+static bool streamPut(lz4helper_stream* stream, const char* src, size_t len) {
+	if (stream->dctx != NULL) {
+		// An empty src flushes what LZ4F still holds
+		do {
+			size_t srcSize = len;
+			size_t dstSize = stream->bufSize;
+			STATS_TIMER timer;
+			stats_start(&timer);
+			size_t hint = LZ4F_decompress(stream->dctx, stream->buf, &dstSize, src, &srcSize, NULL);
+			if (LZ4F_isError(hint)) {
+				stream->errstring = LZ4F_getErrorName(hint);
+				return false;
+			}
+			if (dstSize > 0) {
+				stats_span(&timer, "decode block", dstSize);
+			}
+			if (srcSize > 0) {
+				// A call without input would ask for the next frame header
+				stream->hint = hint;
+			}
+			if (!streamOut(stream, stream->buf, dstSize)) {
+				return false;
+			}
+			src += srcSize;
+			len -= srcSize;
+			if (len == 0 && dstSize < stream->bufSize) {
+				break;
+			}
+		} while (true);
+		return true;
+	}
+	while (len > 0) {
+		size_t n = len < LZ4HELPER_STREAMCHUNK ? len : LZ4HELPER_STREAMCHUNK;
+		STATS_TIMER timer;
+		stats_start(&timer);
+		size_t written = LZ4F_compressUpdate(stream->cctx, stream->buf, stream->bufSize, src, n, NULL);
+		if (LZ4F_isError(written)) {
+			stream->errstring = LZ4F_getErrorName(written);
+			return false;
+		}
+		if (written > 0) {
+			stats_span(&timer, "encode block", n);
+		}
+		if (!streamOut(stream, stream->buf, written)) {
+			return false;
+		}
+		src += n;
+		len -= n;
+	}
+	return true;
+}
+
+// Runs in through all stages, stages[0] sees the input
+static bool streamRun(lz4helper_stream* stages, FILE* in) {
+	char* chunk = memory_alloc(LZ4HELPER_STREAMCHUNK);
+	bool ok = true;
+	size_t n;
+	STATS_TIMER timer;
+	stats_start(&timer);
+	while (ok && (n = fread(chunk, 1, LZ4HELPER_STREAMCHUNK, in)) > 0) {
+		stats_span(&timer, "read input", n);
+		ok = streamPut(&stages[0], chunk, n);
+		stats_start(&timer);
+	}
+	if (ok && ferror(in)) {
+		stages[0].errstring = "Reading input failed";
+		ok = false;
+	}
+	memory_free(chunk);
+	return ok;
+}
+
+static const char* streamError(lz4helper_stream* stages, int frames) {
+	for (int i = 0; i < frames; i++) {
+		if (stages[i].errstring != NULL) {
+			return stages[i].errstring;
+		}
+	}
+	return "Stream failed";
+}
+
+/*
+ * Decodes frames nested frames deep from in and writes the innermost
+ * content to out
+ */
+bool decompressStream(FILE* in, FILE* out, int frames) {
+	lz4helper_stream stages[LZ4HELPER_STREAMFRAMES];
+	bool ok = frames > 0 && frames <= LZ4HELPER_STREAMFRAMES;
 	
-	if (!compressBufferInner(&ctx)) {
-		print_err(1, "LZ4 %s\n", ctx.errstring);
-		exit(-1);
+	memset(stages, 0, sizeof(stages));
+	for (int i = 0; ok && i < frames; i++) {
+		if (LZ4F_isError(LZ4F_createDecompressionContext(&stages[i].dctx, LZ4F_VERSION))) {
+			stages[i].dctx = NULL;
+			stages[i].errstring = "Can't create decompression context";
+			ok = false;
+			break;
+		}
+		// Fits a block of any size, so LZ4F decodes straight into buf
+		stages[i].bufSize = 4 MiB;
+		stages[i].buf = memory_alloc(stages[i].bufSize);
+		stages[i].hint = 1;
+		stages[i].next = (i + 1 < frames) ? &stages[i + 1] : NULL;
+		stages[i].out = out;
+	}
+	if (ok) {
+		ok = streamRun(stages, in);
+	}
+	// Flush from the outside in, every frame has to be complete
+	for (int i = 0; ok && i < frames; i++) {
+		ok = streamPut(&stages[i], NULL, 0);
+		if (ok && stages[i].hint != 0) {
+			stages[i].errstring = "Frame truncated";
+			ok = false;
+		}
 	}
+	if (!ok) {
+		print_err(1, "LZ4 %s\n", streamError(stages, frames));
+	}
+	for (int i = 0; i < LZ4HELPER_STREAMFRAMES; i++) {
+		if (stages[i].dctx != NULL) {
+			LZ4F_freeDecompressionContext(stages[i].dctx);
+		}
+		memory_free(stages[i].buf);
+	}
+	return ok;
+}
+
+/*
+ * Encodes in into frames nested frames with the savegame preferences and
+ * writes the outermost frame to out
+ */
+bool compressStream(FILE* in, FILE* out, int frames) {
+	lz4helper_stream stages[LZ4HELPER_STREAMFRAMES];
+	LZ4F_preferences_t compressPref;
+	bool ok = frames > 0 && frames <= LZ4HELPER_STREAMFRAMES;
 	
-	lz4err = LZ4F_freeCompressionContext(ctx.lz4ctx);
-	if(LZ4F_isError(lz4err)) {
-		print_err(1, "LZ4 (freeCompressionContext) %s\n", LZ4F_getErrorName(lz4err));
-		exit(-1);
+	compressPreferences(&compressPref);
+	memset(stages, 0, sizeof(stages));
+	for (int i = 0; ok && i < frames; i++) {
+		if (LZ4F_isError(LZ4F_createCompressionContext(&stages[i].cctx, LZ4F_VERSION))) {
+			stages[i].cctx = NULL;
+			stages[i].errstring = "Can't create compression context";
+			ok = false;
+			break;
+		}
+		stages[i].bufSize = LZ4F_compressBound(LZ4HELPER_STREAMCHUNK, &compressPref);
+		stages[i].buf = memory_alloc(stages[i].bufSize);
+		stages[i].next = (i + 1 < frames) ? &stages[i + 1] : NULL;
+		stages[i].out = out;
+	}
+	// The outer frames begin first, they wrap the header of the inner ones
+	for (int i = frames - 1; ok && i >= 0; i--) {
+		size_t written = LZ4F_compressBegin(stages[i].cctx, stages[i].buf, stages[i].bufSize, &compressPref);
+		if (LZ4F_isError(written)) {
+			stages[i].errstring = LZ4F_getErrorName(written);
+			ok = false;
+			break;
+		}
+		ok = streamOut(&stages[i], stages[i].buf, written);
+	}
+	if (ok) {
+		ok = streamRun(stages, in);
 	}
+	for (int i = 0; ok && i < frames; i++) {
+		size_t written = LZ4F_compressEnd(stages[i].cctx, stages[i].buf, stages[i].bufSize, NULL);
+		if (LZ4F_isError(written)) {
+			stages[i].errstring = LZ4F_getErrorName(written);
+			ok = false;
+			break;
+		}
+		ok = streamOut(&stages[i], stages[i].buf, written);
+	}
+	if (!ok) {
+		print_err(1, "LZ4 %s\n", streamError(stages, frames));
+	}
+	for (int i = 0; i < LZ4HELPER_STREAMFRAMES; i++) {
+		if (stages[i].cctx != NULL) {
+			LZ4F_freeCompressionContext(stages[i].cctx);
+		}
+		memory_free(stages[i].buf);
+	}
+	return ok;
+}
+
+
+#define PROBE_SAMPLESIZE (64 KiB)	// the LZ4 window, so matches are found like in the whole block
+
+/*
+ * Cheap guess whether a block is worth compressing: one contiguous sample
+ * from the middle of the block is compressed, only if it doesn't shrink at
+ * all the whole block is taken as incompressible. Small samples without
+ * their match history look worse than the block, so the sample spans a
+ * full LZ4 window. Used for stage 2, which mostly sees data that is
+ * already LZ4 compressed.
+ */
+static bool blockIncompressible(void* lz4state, const char* src, size_t srcSize, char* scratch) {
+	if (srcSize < PROBE_SAMPLESIZE * 4) {
+		return false;
+	}
+	const char* sample = src + (srcSize - PROBE_SAMPLESIZE) / 2;
+	return LZ4_compress_limitedOutput_withState(lz4state, sample, scratch, PROBE_SAMPLESIZE, PROBE_SAMPLESIZE - 1) == 0;
+}
+
+/*
+ * Writes one independent block (size field and data) to dst, the same way
+ * LZ4F_compressBlock does, so the output matches compressBuffer.
+ * With probe, blocks that look incompressible are stored right away.
+ */
+static size_t compressBlock(void* lz4state, const char* src, size_t srcSize, uint8_t* dst, bool probe) {
+	int cSize = 0;
+	// dst has room for the whole block, the samples are compressed into it
+	if (!probe || !blockIncompressible(lz4state, src, srcSize, (char*)dst + 4)) {
+		cSize = LZ4_compress_limitedOutput_withState(lz4state, src, (char*)dst + 4, (int)srcSize, (int)srcSize - 1);
+	}
+	if (cSize == 0) {
+		writeLE32(dst, (uint32_t)srcSize | LZ4HELPER_BLOCKUNCOMPRESSED);
+		memcpy(dst + 4, src, srcSize);
+		return 4 + srcSize;
+	}
+	writeLE32(dst, (uint32_t)cSize);
+	return 4 + cSize;
+}
+
+/*
+ * Decompresses one block of an indexed frame, returns a pointer to the content
+ * (either the frame itself for stored blocks or dst) or NULL on corrupt data.
+ */
+static const char* decompressBlock(LZ4HELPER_BLOCKINDEX* index, const void* frame, size_t i, char* dst, size_t* dstSize) {
+	LZ4HELPER_BLOCK* block = &index->blocks[i];
+	const char* data = (const char*)frame + block->offset;
+	if (block->stored) {
+		*dstSize = block->size;
+		return data;
+	}
+	STATS_TIMER timer;
+	stats_start(&timer);
+	int size = LZ4_decompress_safe(data, dst, block->size, index->blocksize);
+	stats_span(&timer, "decode block", size > 0 ? size : 0);
+	if (size < 0) {
+		return NULL;
+	}
+	*dstSize = size;
+	return dst;
+}
+
+/*
+ * Walks the block structure of a LZ4 frame without decompressing it.
+ * Returns NULL if the buffer isn't a complete frame.
+ */
+LZ4HELPER_BLOCKINDEX* lz4helper_blockindex_new(const void *frame, size_t framelen) {
+	static const size_t blockSizes[4] = { 64 KiB, 256 KiB, 1 MiB, 4 MiB };
+	const uint8_t* src = frame;
+	size_t pos = 0;
+	size_t allocated = 0;
+	unsigned blockSizeID;
 	
-	*outbuffer = ctx.dstBuf;
-	*outlen = ctx.dstSize;
+	if (framelen < 7 || readLE32(src) != LZ4HELPER_MAGIC) {
+		return NULL;
+	}
+	
+	LZ4HELPER_BLOCKINDEX* index = memory_alloc(sizeof(LZ4HELPER_BLOCKINDEX));
+	memset(index, 0, sizeof(LZ4HELPER_BLOCKINDEX));
+	index->flg = src[4];
+	index->bd = src[5];
+	index->blockindependent = (index->flg >> 5) & 1;
+	index->blockchecksum = (index->flg >> 4) & 1;
+	index->contentchecksum = (index->flg >> 2) & 1;
+	index->headersize = ((index->flg >> 3) & 1) ? 15 : 7;
+	
+	blockSizeID = (index->bd >> 4) & 7;
+	if ((index->flg >> 6) != 1 || blockSizeID < 4 || index->headersize > framelen) {
+		goto fail;
+	}
+	index->blocksize = blockSizes[blockSizeID - 4];
+	
+	pos = index->headersize;
+	while (1) {
+		if (pos + 4 > framelen) {
+			goto fail;
+		}
+		uint32_t blockSize = readLE32(src + pos);
+		pos += 4;
+		if (blockSize == 0) {
+			break;
+		}
+		
+		if (index->count == allocated) {
+			allocated = allocated ? allocated * 2 : 64;
+			index->blocks = memory_realloc(index->blocks, allocated * sizeof(LZ4HELPER_BLOCK));
+		}
+		LZ4HELPER_BLOCK* block = &index->blocks[index->count++];
+		block->offset = pos;
+		block->stored = (blockSize & LZ4HELPER_BLOCKUNCOMPRESSED) != 0;
+		block->size = blockSize & ~LZ4HELPER_BLOCKUNCOMPRESSED;
+		
+		if (block->size > index->blocksize || pos + block->size > framelen) {
+			goto fail;
+		}
+		pos += block->size;
+		if (index->blockchecksum) {
+			pos += 4;
+		}
+	}
+	if (index->contentchecksum) {
+		pos += 4;
+	}
+	if (pos > framelen) {
+		goto fail;
+	}
+	index->framesize = pos;
+	return index;
+fail:
+	lz4helper_blockindex_free(index);
+	return NULL;
+}
+
+void lz4helper_blockindex_free(LZ4HELPER_BLOCKINDEX* index) {
+	if (index == NULL) {
+		return;
+	}
+	memory_free(index->blocks);
+	memory_free(index->states);
+	memory_free(index);
+}
+
+/*
+ * Writes block i of the content to dst, copied from the reference frame
+ * if the content there is the same, otherwise compressed. index is NULL
+ * without a reference frame.
+ */
+static size_t compressBlockReference(LZ4HELPER_BLOCKINDEX* index, const void* refbuffer, size_t i, const char* src, size_t srcSize, char* refBlock, void* lz4state, uint8_t* dst, bool probe, bool* reused) {
+	STATS_TIMER timer;
+	stats_start(&timer);
+	if (index != NULL && i < index->count) {
+		LZ4HELPER_BLOCK* block = &index->blocks[i];
+		size_t refContentSize = 0;
+		const char* refContent = decompressBlock(index, refbuffer, i, refBlock, &refContentSize);
+		if (refContent != NULL && refContentSize == srcSize && memcmp(refContent, src, srcSize) == 0) {
+			writeLE32(dst, block->size | (block->stored ? LZ4HELPER_BLOCKUNCOMPRESSED : 0));
+			memcpy(dst + 4, (const char*)refbuffer + block->offset, block->size);
+			*reused = true;
+			stats_span(&timer, "reuse block", srcSize);
+			return 4 + block->size;
+		}
+	}
+	*reused = false;
+	size_t written = compressBlock(lz4state, src, srcSize, dst, probe);
+	stats_span(&timer, "encode block", srcSize);
+	return written;
+}
+
+typedef struct lz4helper_blocktask lz4helper_blocktask;
+struct lz4helper_blocktask {
+	LZ4HELPER_BLOCKINDEX* index;	// index of the frame to decompress, or of the reference frame
+	const void* frame;		// frame to decompress, or reference frame (may be NULL)
+	const char* src;		// content to compress
+	size_t srcSize;
+	uint8_t* dst;			// block i is written at dst + i * slot
+	size_t slot;
+	size_t first;
+	size_t count;
+	bool probe;
+	size_t* written;		// compression: bytes written for every block
+	uint8_t* reused;		// compression: block copied from the reference frame
+	bool failed;
+};
+
+static void decompressBlocksTask(void* arg) {
+	lz4helper_blocktask* task = arg;
+	LZ4HELPER_BLOCKINDEX* index = task->index;
+	for (size_t i = task->first; i < task->first + task->count; i++) {
+		char* dst = (char*)task->dst + i * task->slot;
+		size_t size = 0;
+		const char* content = decompressBlock(index, task->frame, i, dst, &size);
+		// Only the last block may be short, otherwise the offsets don't add up
+		if (content == NULL || (i + 1 < index->count && size != index->blocksize)) {
+			task->failed = true;
+			return;
+		}
+		if (content != dst) {
+			memcpy(dst, content, size);
+		}
+		if (i + 1 == index->count) {
+			task->srcSize = size;
+		}
+	}
+}
+
+static void compressBlocksTask(void* arg) {
+	lz4helper_blocktask* task = arg;
+	void* lz4state = memory_alloc(LZ4_sizeofState());
+	char* refBlock = task->index ? memory_alloc(task->index->blocksize) : NULL;
+	for (size_t i = task->first; i < task->first + task->count; i++) {
+		size_t srcPos = i * (task->slot - 4);
+		size_t srcSize = task->srcSize - srcPos;
+		if (srcSize > task->slot - 4) {
+			srcSize = task->slot - 4;
+		}
+		bool reused = false;
+		task->written[i] = compressBlockReference(task->index, task->frame, i, task->src + srcPos, srcSize, refBlock, lz4state, task->dst + i * task->slot, task->probe, &reused);
+		task->reused[i] = reused;
+	}
+	memory_free(refBlock);
+	memory_free(lz4state);
+}
+
+typedef struct lz4helper_hashtask lz4helper_hashtask;
+struct lz4helper_hashtask {
+	const void* data;
+	size_t len;
+	uint32_t digest;
+};
+
+static void hashTask(void* arg) {
+	lz4helper_hashtask* task = arg;
+	STATS_TIMER timer;
+	stats_start(&timer);
+	task->digest = XXH32(task->data, task->len, 0);
+	stats_span(&timer, "hash content", task->len);
+}
+
+/*
+ * Decompresses an independent frame with one task per few blocks. Returns
+ * false for anything unusual, the caller falls back to LZ4F which reports
+ * the actual error.
+ */
+static bool decompressBufferSplit(THREADPOOL* pool, LZ4HELPER_BLOCKINDEX* index, const void* frame, void** outbuffer, size_t* outlen) {
+	THREADPOOL_GROUP group = {0};
+	size_t ntasks = (index->count + LZ4HELPER_TASKBLOCKS - 1) / LZ4HELPER_TASKBLOCKS;
+	uint8_t* dstBuf = memory_tryalloc(index->count * index->blocksize);
+	if (dstBuf == NULL) {
+		return false;
+	}
+	lz4helper_blocktask* tasks = memory_alloc(sizeof(lz4helper_blocktask) * ntasks);
+	
+	for (size_t t = 0; t < ntasks; t++) {
+		memset(&tasks[t], 0, sizeof(lz4helper_blocktask));
+		tasks[t].index = index;
+		tasks[t].frame = frame;
+		tasks[t].dst = dstBuf;
+		tasks[t].slot = index->blocksize;
+		tasks[t].first = t * LZ4HELPER_TASKBLOCKS;
+		tasks[t].count = index->count - tasks[t].first;
+		if (tasks[t].count > LZ4HELPER_TASKBLOCKS) {
+			tasks[t].count = LZ4HELPER_TASKBLOCKS;
+		}
+		threadpool_group_submit(pool, &group, decompressBlocksTask, &tasks[t]);
+	}
+	threadpool_group_wait(pool, &group);
+	
+	bool ok = true;
+	for (size_t t = 0; t < ntasks; t++) {
+		ok &= !tasks[t].failed;
+	}
+	size_t dstSize = (index->count - 1) * index->blocksize + tasks[ntasks - 1].srcSize;
+	if (ok && index->contentchecksum) {
+		STATS_TIMER timer;
+		stats_start(&timer);
+		ok = XXH32(dstBuf, dstSize, 0) == readLE32((const uint8_t*)frame + index->framesize - 4);
+		stats_span(&timer, "hash content", dstSize);
+	}
+	memory_free(tasks);
+	if (!ok) {
+		memory_free(dstBuf);
+		return false;
+	}
+	*outbuffer = dstBuf;
+	*outlen = dstSize;
+	return true;
+}
+
+/*
+ * Compresses inbuffer like compressBuffer, but copies the compressed blocks
+ * of refbuffer (a previous frame of the same data) for every block whose
+ * content didn't change. Only changed blocks are compressed again.
+ * refbuffer may be NULL. With probe, incompressible blocks are stored
+ * without a full compression attempt.
+ */
+bool compressBufferReference(void *inbuffer, size_t inlen, void *refbuffer, size_t reflen, void **outbuffer, size_t* outlen, bool probe) {
+	LZ4F_preferences_t compressPref;
+	XXH32_state_t xxh;
+	size_t reused = 0;
+	
+	compressPreferences(&compressPref);
+	size_t blocksize = LZ4HELPER_BLOCKSIZE;
+	
+	LZ4HELPER_BLOCKINDEX* index = NULL;
+	if (refbuffer != NULL) {
+		index = lz4helper_blockindex_new(refbuffer, reflen);
+		if (index == NULL || !index->blockindependent || index->blocksize != blocksize) {
+			print(0, "Reference frame not usable, compressing everything\n");
+			lz4helper_blockindex_free(index);
+			index = NULL;
+		}
+	}
+	size_t stored = 0;
+	
+	LZ4HELPER_CONTEXTS* contexts = lz4helper_contexts_get();
+	size_t dstSize = LZ4F_compressBound(inlen, &compressPref) + 15;
+	uint8_t* dstBuf = contexts != NULL ? memory_tryalloc(dstSize) : NULL;
+	if (dstBuf == NULL) {
+		if (contexts != NULL) {
+			print_err(1, "LZ4 %s\n", allocError);
+		}
+		lz4helper_blockindex_free(index);
+		return false;
+	}
+	char* refBlock = memory_alloc(blocksize);
+	void* lz4state = memory_alloc(LZ4_sizeofState());
+	
+	LZ4F_compressionContext_t lz4ctx = contexts->cctx;
+	size_t dstPos = LZ4F_compressBegin(lz4ctx, dstBuf, dstSize, &compressPref);
+	LZ4F_resetCompressionContext(lz4ctx);
+	if(LZ4F_isError(dstPos)) {
+		print_err(1, "LZ4 %s\n", LZ4F_getErrorName(dstPos));
+		memory_free(lz4state);
+		memory_free(refBlock);
+		memory_free(dstBuf);
+		lz4helper_blockindex_free(index);
+		return false;
+	}
+	
+	const char* src = inbuffer;
+	size_t srcPos = 0;
+	size_t i = 0;
+	size_t count = (inlen + blocksize - 1) / blocksize;
+	bool split = false;
+	uint32_t splitDigest = 0;
+	THREADPOOL* pool = threadpool_current();
+	size_t slot = 4 + blocksize;
+	// Every block gets a full size slot, without room for that the blocks are compressed in sequence
+	if (pool != NULL && count >= LZ4HELPER_SPLITBLOCKS && dstSize < dstPos + count * slot + 8) {
+		uint8_t* grown = memory_tryrealloc(dstBuf, dstPos + count * slot + 8);
+		if (grown != NULL) {
+			dstBuf = grown;
+			dstSize = dstPos + count * slot + 8;
+		} else {
+			pool = NULL;
+		}
+	}
+	if (pool != NULL && count >= LZ4HELPER_SPLITBLOCKS) {
+		// The blocks are moved together afterwards
+		THREADPOOL_GROUP group = {0};
+		size_t ntasks = (count + LZ4HELPER_TASKBLOCKS - 1) / LZ4HELPER_TASKBLOCKS;
+		lz4helper_blocktask* tasks = memory_alloc(sizeof(lz4helper_blocktask) * ntasks);
+		size_t* written = memory_alloc(sizeof(size_t) * count);
+		uint8_t* blockReused = memory_alloc(count);
+		lz4helper_hashtask hash = { inbuffer, inlen, 0 };
+		
+		threadpool_group_submit(pool, &group, hashTask, &hash);
+		for (size_t t = 0; t < ntasks; t++) {
+			memset(&tasks[t], 0, sizeof(lz4helper_blocktask));
+			tasks[t].index = index;
+			tasks[t].frame = refbuffer;
+			tasks[t].src = src;
+			tasks[t].srcSize = inlen;
+			tasks[t].dst = dstBuf + dstPos;
+			tasks[t].slot = slot;
+			tasks[t].first = t * LZ4HELPER_TASKBLOCKS;
+			tasks[t].count = count - tasks[t].first;
+			if (tasks[t].count > LZ4HELPER_TASKBLOCKS) {
+				tasks[t].count = LZ4HELPER_TASKBLOCKS;
+			}
+			tasks[t].probe = probe;
+			tasks[t].written = written;
+			tasks[t].reused = blockReused;
+			threadpool_group_submit(pool, &group, compressBlocksTask, &tasks[t]);
+		}
+		threadpool_group_wait(pool, &group);
+		
+		size_t start = dstPos;
+		for (i = 0; i < count; i++) {
+			memmove(dstBuf + dstPos, dstBuf + start + i * slot, written[i]);
+			if (blockReused[i]) {
+				reused++;
+			} else if (readLE32(dstBuf + dstPos) & LZ4HELPER_BLOCKUNCOMPRESSED) {
+				stored++;
+			}
+			dstPos += written[i];
+		}
+		srcPos = inlen;
+		split = true;
+		splitDigest = hash.digest;
+		memory_free(blockReused);
+		memory_free(written);
+		memory_free(tasks);
+	}
+	
+	XXH32_reset(&xxh, 0);
+	
+	while (srcPos < inlen) {
+		size_t srcSize = inlen - srcPos;
+		if (srcSize > blocksize) {
+			srcSize = blocksize;
+		}
+		XXH32_update(&xxh, src + srcPos, srcSize);
+		
+		bool blockReused = false;
+		size_t written = compressBlockReference(index, refbuffer, i, src + srcPos, srcSize, refBlock, lz4state, dstBuf + dstPos, probe, &blockReused);
+		if (blockReused) {
+			reused++;
+		} else if (readLE32(dstBuf + dstPos) & LZ4HELPER_BLOCKUNCOMPRESSED) {
+			stored++;
+		}
+		dstPos += written;
+		srcPos += srcSize;
+		i++;
+	}
+	
+	writeLE32(dstBuf + dstPos, 0);
+	dstPos += 4;
+	writeLE32(dstBuf + dstPos, split ? splitDigest : XXH32_digest(&xxh));
+	dstPos += 4;
+	
+	if (index != NULL) {
+		print(1, "Reused %zu of %zu blocks\n", reused, i);
+	}
+	print(1, "Stored %zu of %zu blocks uncompressed\n", stored, i);
+	
+	memory_free(lz4state);
+	memory_free(refBlock);
+	lz4helper_blockindex_free(index);
+	
+	*outbuffer = dstBuf;
+	*outlen = dstPos;
+	return true;
+}
+
+/*
+ * Copies len bytes at offset of the frame content to data, only the blocks
+ * covering the range are decompressed. Expects all blocks but the last one
+ * to be full, which is how LZ4F writes independent blocks.
+ */
+bool readBufferRange(void *frame, size_t framelen, size_t offset, void *data, size_t len) {
+	LZ4HELPER_BLOCKINDEX* index = lz4helper_blockindex_new(frame, framelen);
+	if (index == NULL || !index->blockindependent) {
+		lz4helper_blockindex_free(index);
+		return false;
+	}
+	char* block = memory_alloc(index->blocksize);
+	bool ok = true;
+	
+	while (len > 0) {
+		size_t i = offset / index->blocksize;
+		size_t blockoffset = offset % index->blocksize;
+		size_t contentSize = 0;
+		const char* content = NULL;
+		if (i < index->count) {
+			content = decompressBlock(index, frame, i, block, &contentSize);
+		}
+		if (content == NULL || blockoffset >= contentSize) {
+			ok = false;
+			break;
+		}
+		size_t n = contentSize - blockoffset;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(data, content + blockoffset, n);
+		data = (char*)data + n;
+		offset += n;
+		len -= n;
+	}
+	
+	memory_free(block);
+	lz4helper_blockindex_free(index);
+	return ok;
+}
+
+/*
+ * Overwrites len bytes at offset of the frame content with data. Only the
+ * affected blocks are compressed again, all other blocks are copied. Block
+ * and content checksums are written new.
+ * index may be NULL, otherwise it has to describe frame and is updated to
+ * describe the new frame. With hashed states the content hash resumes in
+ * front of the first patched block instead of starting at the beginning.
+ */
+bool patchBuffer(void *frame, size_t framelen, LZ4HELPER_BLOCKINDEX* index, size_t offset, const void *data, size_t len, void **outbuffer, size_t* outlen) {
+	LZ4HELPER_BLOCKINDEX* ownindex = NULL;
+	if (index == NULL) {
+		index = ownindex = lz4helper_blockindex_new(frame, framelen);
+	}
+	if (index == NULL || !index->blockindependent || len == 0) {
+		lz4helper_blockindex_free(ownindex);
+		return false;
+	}
+	size_t first = offset / index->blocksize;
+	size_t last = (offset + len - 1) / index->blocksize;
+	if (last >= index->count) {
+		lz4helper_blockindex_free(ownindex);
+		return false;
+	}
+	bool hashed = index->states != NULL;
+	
+	size_t dstSize = framelen + (last - first + 1) * (index->blocksize + 8);
+	uint8_t* dstBuf = memory_tryalloc(dstSize);
+	if (dstBuf == NULL) {
+		print_err(1, "LZ4 %s\n", allocError);
+		lz4helper_blockindex_free(ownindex);
+		return false;
+	}
+	char* block = memory_alloc(index->blocksize);
+	void* lz4state = memory_alloc(LZ4_sizeofState());
+	LZ4HELPER_BLOCK* blocks = memory_alloc(sizeof(LZ4HELPER_BLOCK) * index->count);
+	XXH32_state_t* states = memory_alloc(sizeof(XXH32_state_t) * (index->count + 1));
+	
+	if (hashed) {
+		memcpy(states, index->states, sizeof(XXH32_state_t) * (first + 1));
+	} else {
+		XXH32_reset(&states[0], 0);
+	}
+	
+	memcpy(dstBuf, frame, index->headersize);
+	size_t dstPos = index->headersize;
+	
+	for (size_t i = 0; i < index->count; i++) {
+		LZ4HELPER_BLOCK* ref = &index->blocks[i];
+		bool patched = i >= first && i <= last;
+		size_t contentSize = 0;
+		const char* content = NULL;
+		
+		if (patched || i > last || !hashed) {
+			content = decompressBlock(index, frame, i, block, &contentSize);
+			if (content == NULL) {
+				goto fail;
+			}
+		}
+		blocks[i] = *ref;
+		blocks[i].offset = dstPos + 4;
+		
+		if (!patched) {
+			size_t copySize = 4 + ref->size + (index->blockchecksum ? 4 : 0);
+			memcpy(dstBuf + dstPos, (const char*)frame + ref->offset - 4, copySize);
+			dstPos += copySize;
+		} else {
+			// Patch the part of the range inside this block
+			size_t blockstart = i * index->blocksize;
+			size_t from = offset > blockstart ? offset - blockstart : 0;
+			size_t to = offset + len - blockstart;
+			if (to > contentSize) {
+				to = contentSize;
+			}
+			if (from >= to) {
+				goto fail;
+			}
+			if (content != block) {
+				memcpy(block, content, contentSize);
+				content = block;
+			}
+			memcpy(block + from, (const char*)data + (blockstart + from - offset), to - from);
+			
+			size_t written = compressBlock(lz4state, block, contentSize, dstBuf + dstPos, false);
+			uint32_t blockSize = readLE32(dstBuf + dstPos);
+			blocks[i].stored = (blockSize & LZ4HELPER_BLOCKUNCOMPRESSED) != 0;
+			blocks[i].size = blockSize & ~LZ4HELPER_BLOCKUNCOMPRESSED;
+			if (index->blockchecksum) {
+				writeLE32(dstBuf + dstPos + written, XXH32(dstBuf + dstPos + 4, written - 4, 0));
+				written += 4;
+			}
+			dstPos += written;
+		}
+		
+		if (content != NULL) {
+			states[i + 1] = states[i];
+			XXH32_update(&states[i + 1], content, contentSize);
+		}
+	}
+	
+	writeLE32(dstBuf + dstPos, 0);
+	dstPos += 4;
+	if (index->contentchecksum) {
+		writeLE32(dstBuf + dstPos, XXH32_digest(&states[index->count]));
+		dstPos += 4;
+	}
+	
+	memory_free(index->blocks);
+	memory_free(index->states);
+	index->blocks = blocks;
+	index->states = states;
+	index->framesize = dstPos;
+	
+	memory_free(lz4state);
+	memory_free(block);
+	lz4helper_blockindex_free(ownindex);
+	*outbuffer = dstBuf;
+	*outlen = dstPos;
 	return true;
+fail:
+	memory_free(states);
+	memory_free(blocks);
+	memory_free(lz4state);
+	memory_free(block);
+	memory_free(dstBuf);
+	lz4helper_blockindex_free(ownindex);
+	return false;
+}
+
+/*
+ * Records the content hash state in front of every block. Fails if a block
+ * is corrupt or the result doesn't match the content checksum of the frame.
+ */
+bool lz4helper_blockindex_hash(LZ4HELPER_BLOCKINDEX* index, const void *frame) {
+	char* block = memory_alloc(index->blocksize);
+	XXH32_state_t* states = memory_alloc(sizeof(XXH32_state_t) * (index->count + 1));
+	
+	XXH32_reset(&states[0], 0);
+	for (size_t i = 0; i < index->count; i++) {
+		size_t contentSize = 0;
+		const char* content = decompressBlock(index, frame, i, block, &contentSize);
+		if (content == NULL) {
+			goto fail;
+		}
+		states[i + 1] = states[i];
+		XXH32_update(&states[i + 1], content, contentSize);
+	}
+	if (index->contentchecksum && XXH32_digest(&states[index->count]) != readLE32((const uint8_t*)frame + index->framesize - 4)) {
+		goto fail;
+	}
+	
+	memory_free(block);
+	memory_free(index->states);
+	index->states = states;
+	return true;
+fail:
+	memory_free(block);
+	memory_free(states);
+	return false;
+}
+
+#define LZ4HELPER_INDEXMAGIC 0x58494654U // TFIX
+#define LZ4HELPER_INDEXVERSION 1
+
+/*
+ * Index cache file:
+ * u32 magic, u32 version, u64 framesize, u64 count, u32 headersize, header,
+ * count * (u64 offset, u32 size, u8 stored), (count + 1) hash states,
+ * u32 XXH32 of everything in front
+ */
+bool lz4helper_blockindex_save(LZ4HELPER_BLOCKINDEX* index, const void *frame, const char* filename) {
+	if (index->states == NULL) {
+		return false;
+	}
+	uint32_t magic = LZ4HELPER_INDEXMAGIC;
+	uint32_t version = LZ4HELPER_INDEXVERSION;
+	uint64_t framesize = index->framesize;
+	uint64_t count = index->count;
+	uint32_t headersize = index->headersize;
+	
+	BUFFERIOHANDLE* hd = bufferio_create();
+	bufferio_write(hd, &magic, 4);
+	bufferio_write(hd, &version, 4);
+	bufferio_write(hd, &framesize, 8);
+	bufferio_write(hd, &count, 8);
+	bufferio_write(hd, &headersize, 4);
+	bufferio_write(hd, (void*)frame, headersize);
+	for (size_t i = 0; i < index->count; i++) {
+		uint64_t offset = index->blocks[i].offset;
+		uint8_t stored = index->blocks[i].stored;
+		bufferio_write(hd, &offset, 8);
+		bufferio_write(hd, &index->blocks[i].size, 4);
+		bufferio_write(hd, &stored, 1);
+	}
+	bufferio_write(hd, index->states, sizeof(XXH32_state_t) * (index->count + 1));
+	uint32_t checksum = XXH32(bufferio_getbuffer(hd), bufferio_getsize(hd), 0);
+	bufferio_write(hd, &checksum, 4);
+	
+	bool ok = false;
+	STATS_TIMER timer;
+	stats_start(&timer);
+	FILE* fd = fopen(filename, "wb");
+	if (fd != NULL) {
+		ok = fwrite(bufferio_getbuffer(hd), bufferio_getsize(hd), 1, fd) == 1;
+		fclose(fd);
+	}
+	stats_span(&timer, "write block index", bufferio_getsize(hd));
+	bufferio_free(hd);
+	return ok;
+}
+
+/*
+ * Indexes frame and takes the hash states from the cache file if it still
+ * matches: same block layout and the last state has to produce the content
+ * checksum stored in the frame. Otherwise states stay NULL.
+ */
+LZ4HELPER_BLOCKINDEX* lz4helper_blockindex_load(const void *frame, size_t framelen, const char* filename) {
+	LZ4HELPER_BLOCKINDEX* index = lz4helper_blockindex_new(frame, framelen);
+	if (index == NULL || !index->contentchecksum) {
+		return index;
+	}
+	
+	STATS_TIMER timer;
+	stats_start(&timer);
+	FILE* fd = fopen(filename, "rb");
+	if (fd == NULL) {
+		return index;
+	}
+	fseek(fd, 0, SEEK_END);
+	size_t len = ftell(fd);
+	fseek(fd, 0, SEEK_SET);
+	
+	size_t statessize = sizeof(XXH32_state_t) * (index->count + 1);
+	size_t expected = 28 + index->headersize + index->count * 13 + statessize + 4;
+	if (len != expected) {
+		fclose(fd);
+		print(1, "Block index %s is stale\n", filename);
+		return index;
+	}
+	uint8_t* buffer = memory_alloc(len);
+	if (fread(buffer, len, 1, fd) != 1) {
+		fclose(fd);
+		memory_free(buffer);
+		return index;
+	}
+	fclose(fd);
+	stats_span(&timer, "read block index", len);
+	
+	bool valid = readLE32(buffer) == LZ4HELPER_INDEXMAGIC
+		&& readLE32(buffer + 4) == LZ4HELPER_INDEXVERSION
+		&& readLE32(buffer + len - 4) == XXH32(buffer, len - 4, 0);
+	uint64_t framesize, count;
+	memcpy(&framesize, buffer + 8, 8);
+	memcpy(&count, buffer + 16, 8);
+	valid = valid && framesize == index->framesize && count == index->count
+		&& readLE32(buffer + 24) == index->headersize
+		&& memcmp(buffer + 28, frame, index->headersize) == 0;
+	
+	const uint8_t* p = buffer + 28 + index->headersize;
+	for (size_t i = 0; valid && i < index->count; i++, p += 13) {
+		uint64_t offset;
+		memcpy(&offset, p, 8);
+		valid = offset == index->blocks[i].offset && readLE32(p + 8) == index->blocks[i].size && p[12] == index->blocks[i].stored;
+	}
+	
+	if (valid) {
+		XXH32_state_t* states = memory_alloc(statessize);
+		memcpy(states, p, statessize);
+		if (XXH32_digest(&states[index->count]) == readLE32((const uint8_t*)frame + index->framesize - 4)) {
+			index->states = states;
+		} else {
+			memory_free(states);
+			valid = false;
+		}
+	}
+	if (!valid) {
+		print(1, "Block index %s is stale\n", filename);
+	}
+	memory_free(buffer);
+	return index;
+}
+
+/*
+ * Verifies the block checksums of an indexed frame, the blocks are hashed
+ * side by side with xxh32_multi.
+ */
+bool lz4helper_blockindex_verify(LZ4HELPER_BLOCKINDEX* index, const void *frame) {
+	if (!index->blockchecksum || index->count == 0) {
+		return true;
+	}
+	const void** inputs = memory_alloc(sizeof(void*) * index->count);
+	size_t* lengths = memory_alloc(sizeof(size_t) * index->count);
+	uint32_t* digests = memory_alloc(sizeof(uint32_t) * index->count);
+	
+	for (size_t i = 0; i < index->count; i++) {
+		inputs[i] = (const uint8_t*)frame + index->blocks[i].offset;
+		lengths[i] = index->blocks[i].size;
+	}
+	xxh32_multi(inputs, lengths, index->count, 0, digests);
+	
+	bool ok = true;
+	for (size_t i = 0; i < index->count; i++) {
+		LZ4HELPER_BLOCK* block = &index->blocks[i];
+		if (digests[i] != readLE32((const uint8_t*)frame + block->offset + block->size)) {
+			print_err(1, "Block %zu checksum mismatch\n", i);
+			ok = false;
+			break;
+		}
+	}
+	memory_free(digests);
+	memory_free(lengths);
+	memory_free(inputs);
+	return ok;
 }
@@ -15,8 +15,53 @@
 extern "C" {
 #endif
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "lz4/xxhash.h"
+
+typedef struct _LZ4HELPER_BLOCK LZ4HELPER_BLOCK;
+typedef struct _LZ4HELPER_BLOCKINDEX LZ4HELPER_BLOCKINDEX;
+typedef struct _LZ4HELPER_CONTEXTS LZ4HELPER_CONTEXTS;
+
+struct _LZ4HELPER_BLOCK {
+	size_t offset;		// offset of the block data inside the frame
+	uint32_t size;		// size of the block data as stored
+	bool stored;		// block data is uncompressed
+};
+
+struct _LZ4HELPER_BLOCKINDEX {
+	uint8_t flg;
+	uint8_t bd;
+	size_t headersize;
+	size_t blocksize;	// maximum uncompressed block size
+	bool blockindependent;
+	bool blockchecksum;
+	bool contentchecksum;
+	size_t count;
+	LZ4HELPER_BLOCK* blocks;
+	size_t framesize;
+	XXH32_state_t* states;	// content hash state in front of each block and after the last one, NULL if not hashed yet
+};
+
+// NULL when the contexts of the calling thread can't be created
+LZ4HELPER_CONTEXTS* lz4helper_contexts_get(void);
+void lz4helper_contexts_release(void);
+
 bool decompressBuffer(void *inbuffer, size_t inlen, void **outbuffer, size_t* outlen);
 bool compressBuffer(void *inbuffer, size_t inlen, void **outbuffer, size_t* outlen);
+bool compressBufferReference(void *inbuffer, size_t inlen, void *refbuffer, size_t reflen, void **outbuffer, size_t* outlen, bool probe);
+bool decompressStream(FILE* in, FILE* out, int frames);
+bool compressStream(FILE* in, FILE* out, int frames);
+bool readBufferRange(void *frame, size_t framelen, size_t offset, void *data, size_t len);
+bool patchBuffer(void *frame, size_t framelen, LZ4HELPER_BLOCKINDEX* index, size_t offset, const void *data, size_t len, void **outbuffer, size_t* outlen);
+
+LZ4HELPER_BLOCKINDEX* lz4helper_blockindex_new(const void *frame, size_t framelen);
+void lz4helper_blockindex_free(LZ4HELPER_BLOCKINDEX* index);
+bool lz4helper_blockindex_verify(LZ4HELPER_BLOCKINDEX* index, const void *frame);
+bool lz4helper_blockindex_hash(LZ4HELPER_BLOCKINDEX* index, const void *frame);
+LZ4HELPER_BLOCKINDEX* lz4helper_blockindex_load(const void *frame, size_t framelen, const char* filename);
+bool lz4helper_blockindex_save(LZ4HELPER_BLOCKINDEX* index, const void *frame, const char* filename);
 
 #ifdef __cplusplus
 }
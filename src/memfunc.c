@@ -12,8 +12,42 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>	// memcpy
+#if defined(_WIN32)
+#include <malloc.h>
+#define MEMORY_SIZE(ptr) _msize(ptr)
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#define MEMORY_SIZE(ptr) malloc_size(ptr)
+#else
+#include <malloc.h>
+#define MEMORY_SIZE(ptr) malloc_usable_size(ptr)
+#endif
+#include "misc.h"
 #include "memfunc.h"
 
+/*
+ * Accounting: live and peak bytes are taken from the allocator, so they
+ * include its rounding and match what the process really holds. Blocks
+ * have to be freed with memory_free to be subtracted again. The counters
+ * are updated atomically, workers allocate at the same time.
+ */
+static MEMORY_STATS memoryStats;
+
+#define MEMORY_ADD(counter, n) __atomic_add_fetch(&(counter), (n), __ATOMIC_RELAXED)
+#define MEMORY_SUB(counter, n) __atomic_sub_fetch(&(counter), (n), __ATOMIC_RELAXED)
+
+static void memory_account_peak(size_t live) {
+	size_t peak = __atomic_load_n(&memoryStats.peak, __ATOMIC_RELAXED);
+	while (live > peak && !__atomic_compare_exchange_n(&memoryStats.peak, &peak, live, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+static void memory_account_alloc(void* ptr, size_t size, MEMORY_CATEGORY category) {
+	memory_account_peak(MEMORY_ADD(memoryStats.live, MEMORY_SIZE(ptr)));
+	MEMORY_ADD(memoryStats.allocs[category], 1);
+	MEMORY_ADD(memoryStats.bytes[category], size);
+}
+
 uint32_t endian_swap(uint32_t val) {
 	return ((val & 0xff000000) >> 24) | ((val & 0x00ff0000) >> 8) | ((val & 0x0000ff00) << 8) | ((val & 0x000000ff) << 24);
 }
@@ -22,49 +56,133 @@ uint16_t endian_swap_16(uint16_t val) {
 }
 
 
-char* memory_strdup(const char* str) {
+char* memory_strdup_category(const char* str, MEMORY_CATEGORY category) {
 	char *dup;
 	size_t len = strlen(str) + 1;
 	dup = malloc(len);
 	if (dup == NULL) {
-		printf("Can't alloc string memory");
+		print_err(0, "Can't alloc string memory\n");
 		exit(1);
 	}
+	memory_account_alloc(dup, len, category);
 	memcpy(dup, str, len);
 	return dup;
 }
 
-void* memory_alloc(size_t size) {
+char* memory_strdup(const char* str) {
+	return memory_strdup_category(str, MEMORY_OTHER);
+}
+
+void* memory_tryalloc_category(size_t size, MEMORY_CATEGORY category) {
 	void* ptr;
-	if (size < 1) {
-		printf("Can't alloc zero or negative memory");
-		exit(-1);
-	}
 	if (size < 4) {
 		size = 4;
 	}
 	ptr = calloc(1, size);
+	if (ptr != NULL) {
+		memory_account_alloc(ptr, size, category);
+	}
+	return ptr;
+}
+
+void* memory_alloc_category(size_t size, MEMORY_CATEGORY category) {
+	void* ptr;
+	if (size < 1) {
+		print_err(0, "Can't alloc zero or negative memory\n");
+		exit(-1);
+	}
+	ptr = memory_tryalloc_category(size, category);
 	if (ptr == NULL) {
-		printf("Can't alloc more memory");
+		print_err(0, "Can't alloc more memory\n");
 		exit(1);
 	}
 	return ptr;
 }
 
-void* memory_realloc(void* ptr, size_t size) {
+void* memory_alloc(size_t size) {
+	return memory_alloc_category(size, MEMORY_OTHER);
+}
+
+void* memory_tryrealloc_category(void* ptr, size_t size, MEMORY_CATEGORY category) {
+	if (ptr == NULL) {
+		ptr = realloc(NULL, size);
+		if (ptr != NULL) {
+			memory_account_alloc(ptr, size, category);
+		}
+		return ptr;
+	}
+	size_t oldsize = MEMORY_SIZE(ptr);
+	uintptr_t old = (uintptr_t)ptr;
 	ptr = realloc(ptr, size);
 	if (ptr == NULL) {
-		printf("Can't realloc more memory, requested %zu", size);
+		return NULL;
+	}
+	size_t newsize = MEMORY_SIZE(ptr);
+	size_t live;
+	if (newsize >= oldsize) {
+		live = MEMORY_ADD(memoryStats.live, newsize - oldsize);
+	} else {
+		live = MEMORY_SUB(memoryStats.live, oldsize - newsize);
+	}
+	memory_account_peak(live);
+	MEMORY_ADD(memoryStats.reallocs, 1);
+	if ((uintptr_t)ptr != old) {
+		MEMORY_ADD(memoryStats.reallocMoved, 1);
+		MEMORY_ADD(memoryStats.reallocCopied, oldsize < size ? oldsize : size);
+	}
+	return ptr;
+}
+
+void* memory_realloc_category(void* ptr, size_t size, MEMORY_CATEGORY category) {
+	ptr = memory_tryrealloc_category(ptr, size, category);
+	if (ptr == NULL) {
+		print_err(0, "Can't realloc more memory, requested %zu\n", size);
 		exit(1);
 	}
 	return ptr;
 }
 
+void* memory_realloc(void* ptr, size_t size) {
+	return memory_realloc_category(ptr, size, MEMORY_OTHER);
+}
+
 void memory_free(void* ptr) {
-	*(unsigned int*)ptr = 0xDEADBEAF;
+	if (ptr == NULL) {
+		return;
+	}
+	MEMORY_SUB(memoryStats.live, MEMORY_SIZE(ptr));
+	MEMORY_ADD(memoryStats.frees, 1);
+	if (MEMORY_SIZE(ptr) >= sizeof(unsigned int)) {
+		*(unsigned int*)ptr = 0xDEADBEAF;
+	}
 	free(ptr);
 }
 
+void memory_stats(MEMORY_STATS* stats) {
+	size_t i;
+	stats->live = __atomic_load_n(&memoryStats.live, __ATOMIC_RELAXED);
+	stats->peak = __atomic_load_n(&memoryStats.peak, __ATOMIC_RELAXED);
+	for (i = 0; i < MEMORY_CATEGORIES; i++) {
+		stats->allocs[i] = __atomic_load_n(&memoryStats.allocs[i], __ATOMIC_RELAXED);
+		stats->bytes[i] = __atomic_load_n(&memoryStats.bytes[i], __ATOMIC_RELAXED);
+	}
+	stats->reallocs = __atomic_load_n(&memoryStats.reallocs, __ATOMIC_RELAXED);
+	stats->reallocMoved = __atomic_load_n(&memoryStats.reallocMoved, __ATOMIC_RELAXED);
+	stats->reallocCopied = __atomic_load_n(&memoryStats.reallocCopied, __ATOMIC_RELAXED);
+	stats->frees = __atomic_load_n(&memoryStats.frees, __ATOMIC_RELAXED);
+}
+
+const char* memory_category_name(MEMORY_CATEGORY category) {
+	switch (category) {
+		case MEMORY_OTHER:	return "other";
+		case MEMORY_LZ4:	return "lz4";
+		case MEMORY_VAR:	return "var";
+		case MEMORY_TFSTRING:	return "tfstring";
+		default:		break;
+	}
+	return "unknown";
+}
+
 
 
 
@@ -13,17 +13,50 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 
 uint32_t endian_swap(uint32_t val);
 uint16_t endian_swap_16(uint16_t val);
 
+// Allocation counters are kept per category, reported with --stats
+typedef enum {
+	MEMORY_OTHER = 0,
+	MEMORY_LZ4,		// frames, blocks and LZ4 states
+	MEMORY_VAR,		// noson nodes and their strings
+	MEMORY_TFSTRING,	// strings of savegame sections
+	MEMORY_CATEGORIES
+} MEMORY_CATEGORY;
+
+typedef struct _MEMORY_STATS MEMORY_STATS;
+struct _MEMORY_STATS {
+	size_t live;		// bytes as reserved by the allocator
+	size_t peak;
+	uint64_t allocs[MEMORY_CATEGORIES];
+	uint64_t bytes[MEMORY_CATEGORIES];	// requested over the whole run
+	uint64_t reallocs;
+	uint64_t reallocMoved;	// reallocs that had to move the block
+	uint64_t reallocCopied;	// bytes copied by them
+	uint64_t frees;
+};
+
 char* memory_strdup(const char* str);
+char* memory_strdup_category(const char* str, MEMORY_CATEGORY category);
 
 void* memory_alloc(size_t size);
+void* memory_alloc_category(size_t size, MEMORY_CATEGORY category);
 void* memory_realloc(void* ptr, size_t size);
+void* memory_realloc_category(void* ptr, size_t size, MEMORY_CATEGORY category);
+// Return NULL instead of ending the process, for buffers sized by the input.
+// A failed realloc leaves ptr as it was.
+void* memory_tryalloc_category(size_t size, MEMORY_CATEGORY category);
+void* memory_tryrealloc_category(void* ptr, size_t size, MEMORY_CATEGORY category);
+// Accepts NULL
 void memory_free(void* ptr);
 
+void memory_stats(MEMORY_STATS* stats);
+const char* memory_category_name(MEMORY_CATEGORY category);
+
 
 typedef struct _BUFFERIOHANDLE BUFFERIOHANDLE;
 struct _BUFFERIOHANDLE {
@@ -12,27 +12,88 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <strings.h>
+#include <string.h>
+#include <pthread.h>
 
-void print(unsigned int indent_level, const char* fmt, ...) {
-	va_list ap;
-	va_start(ap, fmt);
-	printf("%*s", (int)indent_level*2, "");
-	vprintf(fmt, ap);
-	va_end(ap);
+#include "misc.h"
+
+/*
+ * All messages go to one fully buffered sink. A message is formatted on
+ * the stack of the calling thread first and then appended as a whole, so
+ * workers logging at the same time only share the short copy into the
+ * buffer and lines never interleave. The sink is flushed on errors and
+ * at exit.
+ */
+
+#define LOG_BUFFERSIZE (64 << 10)
+#define LOG_LINESIZE 1024
+
+// Quiet for programs embedding the library, tfsavcodec sets its own default
+int verbose = LOG_WARN;
+
+static FILE* logfd = NULL;
+static pthread_once_t logOnce = PTHREAD_ONCE_INIT;
+
+static void log_init(void) {
+	if (logfd == NULL) {
+		logfd = stderr;
+	}
+	setvbuf(logfd, NULL, _IOFBF, LOG_BUFFERSIZE);
+	atexit(log_flush);
 }
 
-void print_err(unsigned int indent_level, const char* fmt, ...) {
-	va_list ap;
-	va_start(ap, fmt);
-	printf("%*s", (int)indent_level*2, "ERROR: ");
-	vprintf(fmt, ap);
-	va_end(ap);
+bool log_open(const char* filename) {
+	FILE* fd = fopen(filename, "a");
+	if (fd == NULL) {
+		print_err(0, "Opening log %s failed\n", filename);
+		return false;
+	}
+	logfd = fd;
+	pthread_once(&logOnce, log_init);
+	return true;
+}
+
+void log_flush() {
+	if (logfd != NULL) {
+		fflush(logfd);
+	}
 }
 
-void print_warn(unsigned int indent_level, const char* fmt, ...) {
+void log_write(int level, unsigned int indent_level, const char* fmt, ...) {
+	char line[LOG_LINESIZE];
+	char* buffer = line;
+	const char* prefix = "";
 	va_list ap;
+	
+	pthread_once(&logOnce, log_init);
+	if (level == LOG_ERROR) {
+		prefix = "ERROR: ";
+	} else if (level == LOG_WARN) {
+		prefix = "WARN: ";
+	}
+	// Prefixes are right aligned to the indent, like they always were
+	int len = snprintf(line, sizeof(line), "%*s", (int)indent_level*2, prefix);
 	va_start(ap, fmt);
-	printf("%*s", (int)indent_level*2, "WARN: ");
-	vprintf(fmt, ap);
+	int n = vsnprintf(line + len, sizeof(line) - len, fmt, ap);
 	va_end(ap);
+	if (n < 0) {
+		return;
+	}
+	if (len + n >= (int)sizeof(line)) {
+		buffer = malloc(len + n + 1);
+		if (buffer == NULL) {
+			return;
+		}
+		memcpy(buffer, line, len);
+		va_start(ap, fmt);
+		vsnprintf(buffer + len, n + 1, fmt, ap);
+		va_end(ap);
+	}
+	fwrite(buffer, 1, len + n, logfd);
+	if (level == LOG_ERROR) {
+		fflush(logfd);
+	}
+	if (buffer != line) {
+		free(buffer);
+	}
 }
@@ -11,9 +11,43 @@
 #ifndef MISC_H
 #define	MISC_H
 
-void print(unsigned int indent_level, const char* fmt, ...);
-void print_err(unsigned int indent_level, const char* fmt, ...);
-void print_warn(unsigned int indent_level, const char* fmt, ...);
+#include <stdbool.h>
 
-#endif	/* MISC_H */
+/*
+ * Log levels, a message is written when its level is <= verbose.
+ * Calls above LOG_COMPILE_LEVEL are removed at compile time, e.g.
+ * -DLOG_COMPILE_LEVEL=LOG_INFO drops struct dumps and debug output.
+ */
+#define LOG_REPORT -1	// output asked for, like --stats, is never filtered
+#define LOG_ERROR 0
+#define LOG_WARN 10
+#define LOG_INFO 20
+#define LOG_DUMP 25	// struct contents while reading and writing
+#define LOG_DEBUG 30
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+extern int verbose;
 
+#define log_enabled(level) ((level) <= LOG_COMPILE_LEVEL && (level) <= verbose)
+#define log_print(level, indent_level, ...) do { if (log_enabled(level)) log_write(level, indent_level, __VA_ARGS__); } while (0)
+
+#define print(indent_level, ...) log_print(LOG_INFO, indent_level, __VA_ARGS__)
+#define print_report(indent_level, ...) log_print(LOG_REPORT, indent_level, __VA_ARGS__)
+#define print_err(indent_level, ...) log_print(LOG_ERROR, indent_level, __VA_ARGS__)
+#define print_warn(indent_level, ...) log_print(LOG_WARN, indent_level, __VA_ARGS__)
+#define print_dump(indent_level, ...) log_print(LOG_DUMP, indent_level, __VA_ARGS__)
+#define print_debug(indent_level, ...) log_print(LOG_DEBUG, indent_level, __VA_ARGS__)
+
+#ifdef __GNUC__
+void log_write(int level, unsigned int indent_level, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+#else
+void log_write(int level, unsigned int indent_level, const char* fmt, ...);
+#endif
+// Sends all messages to filename instead of stderr
+bool log_open(const char* filename);
+void log_flush();
+
+#endif	/* MISC_H */
@@ -17,27 +17,50 @@
 #include <stdarg.h>
 #include <inttypes.h>
 #include <basetsd.h>
+#include <locale.h>
+#include <pthread.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "noson.h"
+#include "../misc.h"
 #include "../memfunc.h"
 
+// Everything noson allocates counts as VAR memory
+#define memory_alloc(size) memory_alloc_category(size, MEMORY_VAR)
+#define memory_realloc(ptr, size) memory_realloc_category(ptr, size, MEMORY_VAR)
+#define memory_strdup(str) memory_strdup_category(str, MEMORY_VAR)
+
 void var_free(VAR* v) {
 	VAR* ptr, *item;
 	if (v) {
 		if (v->name) {
-			free(v->name);
+			memory_free(v->name);
 		}
 		if (v->vstr) {
-			free(v->vstr);
+			memory_free(v->vstr);
 		}
 		if (v->comment) {
-			free(v->comment);
+			memory_free(v->comment);
 		}
 		ptr = v->children;
 		/* while (ptr != 0) {
 			item = ptr;
 			ptr = ptr->next;
-			free(item);
+			memory_free(item);
 		} */
 		
 		while (ptr != 0) {
@@ -45,13 +68,13 @@ void var_free(VAR* v) {
 			ptr = ptr->next;
 			var_free(item);
 		}
-		free(v);
+		memory_free(v);
 	}
 }
 
 VAR* var_create(char* name, int vtype) {
 	VAR* v;
-	v = calloc(1, sizeof (VAR));
+	v = memory_alloc(sizeof (VAR));
 	if (v) {
 		if (name) {
 			v->name = memory_strdup(name);
@@ -63,7 +86,7 @@ VAR* var_create(char* name, int vtype) {
 
 VAR* var_create_int(char* name, int value) {
 	VAR* v;
-	v = calloc(1, sizeof (VAR));
+	v = memory_alloc(sizeof (VAR));
 	if (v) {
 		if (name) {
 			v->name = memory_strdup(name);
@@ -77,7 +100,7 @@ VAR* var_create_int(char* name, int value) {
 
 VAR* var_create_int64(char* name, int64_t value) {
 	VAR* v;
-	v = calloc(1, sizeof (VAR));
+	v = memory_alloc(sizeof (VAR));
 	if (v) {
 		if (name) {
 			v->name = memory_strdup(name);
@@ -92,7 +115,7 @@ VAR* var_create_int64(char* name, int64_t value) {
 
 VAR* var_create_string(char* name, char* value) {
 	VAR* v;
-	v = calloc(1, sizeof (VAR));
+	v = memory_alloc(sizeof (VAR));
 	if (v) {
 		if (name) {
 			v->name = memory_strdup(name);
@@ -107,7 +130,7 @@ VAR* var_create_string(char* name, char* value) {
 
 VAR* var_create_string_n(char* name, char* value, size_t len) {
 	VAR* v;
-	v = calloc(1, sizeof (VAR));
+	v = memory_alloc(sizeof (VAR));
 	if (v) {
 		if (name) {
 			v->name = memory_strdup(name);
@@ -115,7 +138,7 @@ VAR* var_create_string_n(char* name, char* value, size_t len) {
 		v->vtype = VAR_TYPE_STR;
 		if (value) {
 			if (len > 0) {
-				v->vstr = calloc(len+1, 1);
+				v->vstr = memory_alloc(len+1);
 				memcpy(v->vstr, value, len);
 			}
 			
@@ -127,7 +150,7 @@ VAR* var_create_string_n(char* name, char* value, size_t len) {
 
 VAR* var_create_float(char* name, float value) {
 	VAR* v;
-	v = calloc(1, sizeof (VAR));
+	v = memory_alloc(sizeof (VAR));
 	if (v) {
 		if (name) {
 			v->name = memory_strdup(name);
@@ -154,7 +177,7 @@ VAR* var_set_int(VAR* v, int value) {
 		v->vint = value;
 		v->vfloat = 0;
 		if (v->vstr) {
-			free(v->vstr);
+			memory_free(v->vstr);
 			v->vstr = NULL;
 		}
 	}
@@ -167,7 +190,7 @@ VAR* var_set_int64(VAR* v, int64_t value) {
 		v->vint = value;
 		v->vfloat = 0;
 		if (v->vstr) {
-			free(v->vstr);
+			memory_free(v->vstr);
 			v->vstr = NULL;
 		}
 	}
@@ -181,7 +204,7 @@ VAR* var_set_string(VAR* v, char* value) {
 		v->vint = 0;
 		v->vfloat = 0;
 		if (v->vstr) {
-			free(v->vstr);
+			memory_free(v->vstr);
 			v->vstr = NULL;
 		}
 		if (value) {
@@ -199,7 +222,7 @@ VAR* var_set_float(VAR* v, int value) {
 		v->vint = 0;
 		v->vfloat = value;
 		if (v->vstr) {
-			free(v->vstr);
+			memory_free(v->vstr);
 			v->vstr = NULL;
 		}
 	}
@@ -212,7 +235,7 @@ VAR* var_set_raw(VAR* v, void* buffer, size_t buffersize) {
 		v->vint = buffersize;
 		v->vfloat = 0;
 		if (v->vstr) {
-			free(v->vstr);
+			memory_free(v->vstr);
 		}
 		v->vstr = buffer;
 	}
@@ -240,6 +263,15 @@ char* var_asstring(VAR* v) {
 	return 0;
 }
 
+// Like var_asstring, but the caller owns the string afterwards
+char* var_takestring(VAR* v) {
+	char* str = var_asstring(v);
+	if (str) {
+		v->vstr = NULL;
+	}
+	return str;
+}
+
 long var_aslong(VAR* v) {
 	if (v) {
 		if (v->vtype == VAR_TYPE_INT) {
@@ -461,25 +493,99 @@ VAR* var_comment(VAR* v, char* comment) {
 
 void _var_writestring(FILE* fd, char* str);
 
-void _var_export_export_hex(FILE* fd, char* buffer, size_t bufferlen) {
+#define VAR_HEX_CHUNK 4096
+
+static int _var_hex_digit(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'A' && c <= 'F') return c - ('A' - 10);
+	if (c >= 'a' && c <= 'f') return c - ('a' - 10);
+	return -1;
+}
+
+#if defined(__SSE2__)
+// nibbles 0..15 to '0'..'9', 'A'..'F'
+static inline __m128i _var_hex_sse2_nibbletochar(__m128i n) {
+	__m128i letter = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8('A' - '0' - 10));
+	return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), letter);
+}
+
+// chars to nibbles, invalid chars are flagged in *invalid
+static inline __m128i _var_hex_sse2_chartonibble(__m128i c, __m128i* invalid) {
+	__m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i letter = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	__m128i isdigit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+	__m128i isletter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+	*invalid = _mm_or_si128(*invalid, _mm_andnot_si128(_mm_or_si128(isdigit, isletter), _mm_set1_epi8(-1)));
+	letter = _mm_add_epi8(letter, _mm_set1_epi8(10));
+	return _mm_or_si128(_mm_and_si128(isdigit, digit), _mm_andnot_si128(isdigit, letter));
+}
+
+// two nibble chars per 16 bit lane, first char is the high nibble
+static inline __m128i _var_hex_sse2_pairs(__m128i n) {
+	__m128i hi = _mm_and_si128(_mm_slli_epi16(n, 4), _mm_set1_epi16(0x00F0));
+	return _mm_or_si128(hi, _mm_srli_epi16(n, 8));
+}
+#endif
+
+/* Writes 2*len uppercase hex chars to out */
+void var_hex_encode(char* out, const void* in, size_t len) {
 	const char* hex = "0123456789ABCDEF";
-	char* outbuffer;
-	char* pout;
-	char* pin;
-	 
-	outbuffer = malloc(bufferlen*3+1);
-	pin = buffer;
-	pout = outbuffer;
+	const unsigned char* pin = in;
+	size_t i = 0;
+#if defined(__SSE2__)
+	for (; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(pin + i));
+		__m128i hi = _var_hex_sse2_nibbletochar(_mm_and_si128(_mm_srli_epi16(x, 4), _mm_set1_epi8(0x0F)));
+		__m128i lo = _var_hex_sse2_nibbletochar(_mm_and_si128(x, _mm_set1_epi8(0x0F)));
+		_mm_storeu_si128((__m128i*)(out + i*2), _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i*)(out + i*2 + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+#endif
+	for (; i < len; ++i) {
+		out[i*2] = hex[(pin[i]>>4)&0xF];
+		out[i*2+1] = hex[pin[i]&0xF];
+	}
+}
+
+/* Decodes len hex chars, returns the number of chars consumed before the first invalid pair */
+size_t var_hex_decode(void* out, const char* in, size_t len) {
+	unsigned char* pout = out;
+	size_t i = 0;
+#if defined(__SSE2__)
+	for (; i + 32 <= len; i += 32) {
+		__m128i invalid = _mm_setzero_si128();
+		__m128i n0 = _var_hex_sse2_chartonibble(_mm_loadu_si128((const __m128i*)(in + i)), &invalid);
+		__m128i n1 = _var_hex_sse2_chartonibble(_mm_loadu_si128((const __m128i*)(in + i + 16)), &invalid);
+		if (_mm_movemask_epi8(invalid)) {
+			// let the scalar loop find the exact position
+			break;
+		}
+		_mm_storeu_si128((__m128i*)(pout + i/2), _mm_packus_epi16(_var_hex_sse2_pairs(n0), _var_hex_sse2_pairs(n1)));
+	}
+#endif
+	for (; i + 2 <= len; i += 2) {
+		int hi = _var_hex_digit(in[i]);
+		int lo = _var_hex_digit(in[i+1]);
+		if (hi < 0 || lo < 0) {
+			break;
+		}
+		pout[i/2] = (hi << 4) | lo;
+	}
+	return i;
+}
+
+// encodes in chunks, no copy of the whole buffer is made
+void _var_export_export_hex(FILE* fd, char* buffer, size_t bufferlen) {
+	char outbuffer[VAR_HEX_CHUNK*2];
+	size_t n;
 	
-	for(int i = 0; i < bufferlen; ++i){
-		*pout = hex[(*pin>>4)&0xF];
-		pout++;
-		*pout = hex[(*pin)&0xF];
-		pout++;
-		pin++;
+	while (bufferlen > 0) {
+		n = (bufferlen < VAR_HEX_CHUNK) ? bufferlen : VAR_HEX_CHUNK;
+		var_hex_encode(outbuffer, buffer, n);
+		fwrite(outbuffer, 1, n*2, fd);
+		buffer += n;
+		bufferlen -= n;
 	}
-	fwrite(outbuffer, 1, pout-outbuffer, fd);
-	free(outbuffer);
 }
 
 
@@ -554,53 +660,82 @@ void var_export(VAR *v, FILE* fd, int level) {
 	}
 }
 
-void var_export_file(VAR *v, char* filename) {
+// Closes a written file, 0 if anything failed on the way
+static int _var_close_written(FILE* fd, char* filename) {
+	int ok = !ferror(fd);
+	if (fclose(fd) != 0) {
+		ok = 0;
+	}
+	if (!ok) {
+		print_err(0, "Writing file %s, %s\n", filename, strerror(errno));
+	}
+	return ok;
+}
+
+// 0 if the file can't be written
+int var_export_file(VAR *v, char* filename) {
 	FILE* fd;
-	printf("Writing file %s\n", filename);
+	print(0, "Writing file %s\n", filename);
 	fd = fopen(filename, "wb");
 	if (fd == NULL) {
-		printf("Writing file %s, %s\n", filename, strerror(errno));
-		exit(-1);
+		print_err(0, "Writing file %s, %s\n", filename, strerror(errno));
+		return 0;
 	}
 	var_export(v, fd, 0);
-	fclose(fd);
+	return _var_close_written(fd, filename);
 }
 
 
 static int _var_parser(VAR* parent, char** s, int *line);
 
-VAR* var_import_file(char* filename) {
-	VAR* v = NULL;
+static char* _var_read_file(char* filename) {
 	FILE* fd;
 	size_t filesize;
-	int line;
 	char* buffer;
-	char* bufferptr;
 
-	printf("Reading file %s\n", filename);
+	print(0, "Reading file %s\n", filename);
 	fd = fopen(filename, "rb");
 	if (fd == NULL) {
-		printf("Reading file %s, %s\n", filename, strerror(errno));
-		exit(-1);
+		print_err(0, "Reading file %s, %s\n", filename, strerror(errno));
+		return NULL;
 	}
 	fseek(fd, 0, SEEK_END);
 	filesize = ftell(fd);
 	fseek(fd, 0, SEEK_SET);
 
 	buffer = memory_alloc(filesize + 1024);
-	bufferptr = buffer;
-	if (fread(buffer, 1, filesize, fd) == filesize) {
-		line = 1;
-		VAR* vx = var_create(0, VAR_TYPE_UNKNOWN);
-		if (_var_parser(vx, &bufferptr, &line)) {
-			exit(-1);
-		}
-		v = vx->children;
-		vx->children = NULL;
-		var_free(vx);
+	if (fread(buffer, 1, filesize, fd) != filesize) {
+		memory_free(buffer);
+		buffer = NULL;
 	}
-	memory_free(buffer);
 	fclose(fd);
+	return buffer;
+}
+
+static VAR* _var_import_buffer(char* buffer) {
+	VAR* v = NULL;
+	int line = 1;
+	char* bufferptr = buffer;
+	VAR* vx = var_create(0, VAR_TYPE_UNKNOWN);
+	if (_var_parser(vx, &bufferptr, &line)) {
+		var_free(vx);
+		return NULL;
+	}
+	v = vx->children;
+	vx->children = NULL;
+	var_free(vx);
+	return v;
+}
+
+VAR* var_import_file(char* filename) {
+	VAR* v = NULL;
+	char* buffer;
+
+	buffer = _var_read_file(filename);
+	if (buffer) {
+		v = _var_import_buffer(buffer);
+		memory_free(buffer);
+	}
 	return v;
 }
 
@@ -617,9 +752,9 @@ int _var_buffer_resize(char** bufferptr, size_t *size, size_t new_size) {
 	char* buffernew = NULL;
 	//size_t new_size = *size<<1;
 
-	buffernew = realloc(*bufferptr, new_size);
+	buffernew = memory_realloc(*bufferptr, new_size);
 	if (!buffernew) {
-		printf("Can't realloc buffer, oldsize: %u, newsize: %zu\n", *size, new_size);
+		print_err(0, "Can't realloc buffer, oldsize: %zu, newsize: %zu\n", *size, new_size);
 		return 1;
 	}
 	*size = new_size;
@@ -628,89 +763,225 @@ int _var_buffer_resize(char** bufferptr, size_t *size, size_t new_size) {
 }
 
 void _var_parser_printinfo(int line, char *s, const char* fmt, ...) {
+	char message[512];
 	va_list ap;
 	va_start(ap, fmt);
-	printf("Parser error at line %i: ", line);
-	vprintf(fmt, ap);
+	vsnprintf(message, sizeof(message), fmt, ap);
+	va_end(ap);
+	print_err(0, "Parser error at line %i: %s", line, message);
 	if (s) {
-		printf(">>>>%.*s<<<<\n\n", 100, s);
+		print_err(0, ">>>>%.*s<<<<\n\n", 100, s);
 	}
-	va_end(ap);
 }
 
 
+// exactly representable in a float
+static const float _var_pow10f[] = {
+	1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+};
+
+/*
+ * The slow path parses with the "C" locale, a program embedding noson may have
+ * set a locale with a different decimal point.
+ */
+#if defined(_WIN32)
+static _locale_t _var_clocale = NULL;
+#else
+static locale_t _var_clocale = (locale_t)0;
+#endif
+static pthread_once_t _var_clocaleOnce = PTHREAD_ONCE_INIT;
+
+static void _var_clocale_init(void) {
+#if defined(_WIN32)
+	_var_clocale = _create_locale(LC_NUMERIC, "C");
+#else
+	_var_clocale = newlocale(LC_NUMERIC_MASK, "C", (locale_t)0);
+#endif
+}
+
+static float _var_strtof(const char* s, char** end) {
+	pthread_once(&_var_clocaleOnce, _var_clocale_init);
+#if defined(_WIN32)
+	if (_var_clocale != NULL) {
+		return _strtof_l(s, end, _var_clocale);
+	}
+	return strtof(s, end);
+#else
+	float f;
+	locale_t old;
+	
+	if (_var_clocale == (locale_t)0) {
+		return strtof(s, end);
+	}
+	// Only switches the calling thread
+	old = uselocale(_var_clocale);
+	f = strtof(s, end);
+	uselocale(old);
+	return f;
+#endif
+}
+
+/*
+ * Float literals, the mantissa is collected in one pass. Small mantissas with
+ * small exponents are exact with a single float operation (Clinger's fast path),
+ * everything else goes through strtof in the "C" locale.
+ */
+static int _var_parse_float(VAR* v, char** s, const char** error) {
+	const char* p = *s;
+	char* end;
+	uint64_t w = 0;
+	int exp10 = 0;
+	int expvalue = 0;
+	int expneg = 0;
+	int digits = 0;
+	int significant = 0;
+	int truncated = 0;
+	int isneg = 0;
+	float f;
+	
+	if (*p == '-') {
+		isneg = 1;
+		p++;
+	}
+	for (int fraction = 0; ; p++) {
+		if (*p == '.' && !fraction) {
+			fraction = 1;
+			continue;
+		}
+		if (*p < '0' || *p > '9') {
+			break;
+		}
+		digits++;
+		if (w == 0 && *p == '0') {
+			exp10 -= fraction;
+			continue;
+		}
+		if (significant < 19) {
+			w = w * 10 + (*p - '0');
+			significant++;
+			exp10 -= fraction;
+		} else {
+			truncated |= (*p != '0');
+			exp10 += !fraction;
+		}
+	}
+	if (digits == 0) {
+		*error = "unexpected mixed value";
+		return 1;
+	}
+	if (*p == 'e' || *p == 'E') {
+		p++;
+		if (*p == '-' || *p == '+') {
+			expneg = (*p == '-');
+			p++;
+		}
+		if (*p < '0' || *p > '9') {
+			*error = "unexpected mixed value";
+			return 1;
+		}
+		while (*p >= '0' && *p <= '9') {
+			if (expvalue < 10000) {
+				expvalue = expvalue * 10 + (*p - '0');
+			}
+			p++;
+		}
+		exp10 += expneg ? -expvalue : expvalue;
+	}
+	
+	if (w == 0) {
+		f = 0;
+	} else if (!truncated && w <= (1 << 24) && exp10 >= -10 && exp10 <= 10) {
+		f = (float)w;
+		f = (exp10 < 0) ? f / _var_pow10f[-exp10] : f * _var_pow10f[exp10];
+	} else {
+		errno = 0;
+		f = _var_strtof(*s, &end);
+		if (end != p || errno != 0) {
+			*error = "unexpected mixed value";
+			return 1;
+		}
+		isneg = 0;
+	}
+	v->vtype = VAR_TYPE_FLOAT;
+	v->vfloat = isneg ? -f : f;
+	*s = (char*)p;
+	return 0;
+}
+
+/*
+ * Reads a numeric literal at *s into v, sets vtype to VAR_TYPE_FLOAT or VAR_TYPE_INT64.
+ * On failure *error describes the problem, reporting it is left to the caller.
+ * Integers and 0x hex values are converted in a single pass without libc,
+ * positive values may use the full unsigned 64 bit range.
+ */
+static int _var_parse_number(VAR* v, char** s, const char** error) {
+	const char* p = *s;
+	uint64_t value = 0;
+	int digits = 0;
+	int overflow = 0;
+	int isneg = 0;
+	int d;
+	
+	if (*p == '-') {
+		isneg = 1;
+		p++;
+	}
+	if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+		p += 2;
+		while ((d = _var_hex_digit(*p)) >= 0) {
+			overflow |= (value >> 60) != 0;
+			value = (value << 4) | d;
+			digits++;
+			p++;
+		}
+		if (*p == '.') {
+			*error = "unexpected mixed hex/float value";
+			return 1;
+		}
+	} else {
+		while (*p >= '0' && *p <= '9') {
+			d = *p - '0';
+			overflow |= value > (UINT64_MAX - d) / 10;
+			value = value * 10 + d;
+			digits++;
+			p++;
+		}
+		if (*p == '.' || *p == 'e' || *p == 'E') {
+			return _var_parse_float(v, s, error);
+		}
+	}
+	if (digits == 0) {
+		*error = "unexpected mixed value";
+		return 1;
+	}
+	if (overflow || (isneg && value > (uint64_t)INT64_MAX + 1)) {
+		*error = "number out of range";
+		return 1;
+	}
+	v->vtype = VAR_TYPE_INT64;
+	v->vint = isneg ? (int64_t)(0 - value) : (int64_t)value;
+	*s = (char*)p;
+	return 0;
+}
+
 static int _var_parser(VAR* parent, char** s, int *line) {
 	VAR *v = NULL;
 	char *varname = NULL;
 	char *varstring = NULL;
+	const char* error;
 	char type;
 	
 	while (**s != 0) {
 		spaceskip(s, line);	
 		// Is this numeric?
 		if (**s == '-' || (**s >= '0' && **s <= '9')) {
-			/* char* sold = *s;
-			errno = 0;
-			long value = strtoul(*s, s, 0);
-			if (sold == *s) {
-				// failing to convert, try skip
-				while (**s && ((**s >= '0' && **s <= '9') || **s == '.')) {
-					(*s)++;
-				}
-				return 1;
-			} else {
-				if (errno == 0) {
-					v = var_create_int(varname, value);
-					free(varname);
-					varname = NULL;
-					var_add_child(parent, v);
-					spaceskip(s, line);
-				}
-			}
-			*/
-			char* sold = *s;
-			int numfloat = 0;
-			int numhex = 0;
-			int isneg = (**s == '-');
-			errno = 0;
-			
-			// first char is 0..9 or -
-			(*s)++;
-			// could be hex
-			if (**s == 'x') {
-				numhex = 1;
-				(*s)++;
-			}
-			
-			while (**s && ((**s >= '0' && **s <= '9') || **s == '.')) {
-				if (**s == '.') {
-					numfloat = 1;
-				}
-				(*s)++;
-			}
-			
-			if (numfloat && numhex) {
-				//printf("Parser error at line %i, unexpected mixed hex/float value\n", *line);
-				_var_parser_printinfo(*line, *s, "unexpected mixed hex/float value\n");
-				return 1;
-			}
-			*s = sold;
-			
-			if (numfloat) {
-				v = var_create_float(varname, strtof(*s, s));
-			} else {
-				if (isneg) {
-					v = var_create_int64(varname, strtoll(*s, s, 0));
-				} else {
-					v = var_create_int64(varname, strtoull(*s, s, 0));
-				}
-			}
-			if ( (sold == *s) || (errno != 0) ) {
-				//printf("Parser error at line %i, unexpected mixed value\n", *line);
-				_var_parser_printinfo(*line, *s, "unexpected mixed value\n");
+			v = var_create(varname, VAR_TYPE_UNKNOWN);
+			if (_var_parse_number(v, s, &error)) {
+				_var_parser_printinfo(*line, *s, "%s\n", error);
+				var_free(v);
 				return 1;
 			}
-			free(varname);
+			memory_free(varname);
 			varname = NULL;
 			var_add_child(parent, v);
 			spaceskip(s, line);
@@ -752,7 +1023,7 @@ static int _var_parser(VAR* parent, char** s, int *line) {
 						}
 					} else {
 						v = var_create_string(varname, varstring);
-						free(varname);
+						memory_free(varname);
 						varname = NULL;
 						var_add_child(parent, v);
 					}
@@ -767,7 +1038,7 @@ static int _var_parser(VAR* parent, char** s, int *line) {
 				}
 				(*s)+= 4;
 				v = var_create_string(varname, 0);
-				free(varname);
+				memory_free(varname);
 				varname = NULL;
 				var_add_child(parent, v);
 				break;
@@ -787,13 +1058,17 @@ static int _var_parser(VAR* parent, char** s, int *line) {
 				}
 				
 				//printf("Creating Array/Map at line %i, expecting %c for closing, %.20s\n", *line, type, *s);
-				free(varname);
+				memory_free(varname);
 				varname = NULL;
-				_var_parser(v, s, line);
+				if (_var_parser(v, s, line)) {
+					var_free(v);
+					return 1;
+				}
 				if (**s == 0) {
 					//printf("EOF, missing %c\n", *line, type);
 					_var_parser_printinfo(*line, *s, "EOF, missing %c\n",type);
-					exit(-1);
+					var_free(v);
+					return 1;
 				} else if (type != **s) {
 					
 					_var_parser_printinfo(*line, *s, "missing %c\n",type);
@@ -801,7 +1076,7 @@ static int _var_parser(VAR* parent, char** s, int *line) {
 					//printf("Parser error at line %i, missing %c\n", *line, type);
 					//printf("Following bytes: ##>%.10s<##\n",*s);
 					
-					//exit(-1);
+					var_free(v);
 					return 1;
 				}
 				//printf("Closing Array/Map at line %i with type ##%c##\n", *line, type);
@@ -827,7 +1102,7 @@ static int _var_parser(VAR* parent, char** s, int *line) {
 							return 1;
 						}
 						var_set_name(v, varname);
-						free(varname);
+						memory_free(varname);
 						varname = NULL;
 						var_add_child(parent, v);
 						break;
@@ -845,60 +1120,46 @@ parseerror:
 	return 0;	
 }
 
-unsigned char _var_import_hex_digittoint(char *s, int *line, int len) {
-	unsigned char d = *s;
-	if (d >= '0' && d <= '9') {
-		return d-'0';	
-	}
-	if (d >= 'A' && d <= 'H') {
-		return d-('A'-10);
-	}
-	if (d >= 'a' && d <= 'h') {
-		return d-('a'-10);
-	}
-	// Unknown hex digit
-
-	//_var_parser_printinfo(*line, s, "Can't read hex data, unknown char 0x%02X\n", *s);
-	_var_parser_printinfo(*line, s, "Can't read hex data, unknown char 0x%02X\n", *s);
-	exit(-1);
-	
-	//return (d & 0x1f) + ((d >> 6) * 0x19) - '0';
-}
-
 VAR* _var_import_hex(char** s, int *line) {
 	VAR* v;
 	char* outbuffer = NULL;
-	size_t outbuffersize = 2048;
-	int len = 0;
+	char* end;
+	size_t hexlen;
+	size_t done;
 	if (**s != '"') {
 		_var_parser_printinfo(*line, *s, "Expected start of string\n");
 		return 0;
 	}
 	(*s)++;
-	outbuffer = malloc(outbuffersize);
-	while (**s && (**s != '"')) {
-		outbuffer[len] = (_var_import_hex_digittoint(*s, line, len) << 4) | (_var_import_hex_digittoint((*s)+1, line, len) );
-		(*s)+=2;
-		len++;
-		if (len >= outbuffersize) {
-			/* outbuffersize+=2048;
-			outbuffer = realloc(outbuffer, outbuffersize);
-			if (outbuffer == NULL) {
-				_var_parser_printinfo(*line, *s, "Can't import hex data, no enough memory to alloc\n");
-			} */
-			if (_var_buffer_resize(&outbuffer, &outbuffersize, outbuffersize+2048)) {
-				_var_parser_printinfo(*line, *s, "Can't import hex data, no enough memory to alloc\n");
-			}
-		}
-	}
-	if (**s != '"') {
-		free(outbuffer);
+	end = strchr(*s, '"');
+	if (end == NULL) {
 		_var_parser_printinfo(*line, *s, "Can't import hex data, closing string missing\n");
+		return 0;
 	}
-	(*s)++;
+	hexlen = end - *s;
+	if (hexlen & 1) {
+		_var_parser_printinfo(*line, *s, "Can't import hex data, odd number of digits\n");
+		return 0;
+	}
+	// sized once from the string length
+	outbuffer = memory_alloc(hexlen/2 + 1);
+	if (outbuffer == NULL) {
+		_var_parser_printinfo(*line, *s, "Can't import hex data, no enough memory to alloc\n");
+		exit(-1);
+	}
+	done = var_hex_decode(outbuffer, *s, hexlen);
+	if (done != hexlen) {
+		if (_var_hex_digit((*s)[done]) >= 0) {
+			done++;
+		}
+		_var_parser_printinfo(*line, *s + done, "Can't read hex data, unknown char 0x%02X\n", (unsigned char)(*s)[done]);
+		memory_free(outbuffer);
+		return 0;
+	}
+	*s = end + 1;
 	v = var_create(0, VAR_TYPE_RAW);
 	v->vstr = outbuffer;
-	v->vint = len;
+	v->vint = hexlen/2;
 	return v;
 }
 
@@ -927,7 +1188,7 @@ char* _var_readstring_old(char** s, int *line) {
 	}
 	len = (*s - start);
 	if (len > 1) {
-		ret = calloc(len + 1, 1);
+		ret = memory_alloc(len + 1);
 		memcpy(ret, start, len - 1);
 		return ret;
 	}
@@ -935,28 +1196,119 @@ char* _var_readstring_old(char** s, int *line) {
 }
 
 
+/*
+ * Returns the number of bytes before the next char that needs attention
+ * when reading or writing a string: the quote char, backslash, slash or any
+ * control char including the terminating zero.
+ * The vector versions only use aligned loads, so they never cross into a page
+ * the string doesn't touch.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+// The aligned loads read past both ends of the string, ASan and TSan would report it
+#define _VAR_NO_SANITIZE __attribute__((no_sanitize_address, no_sanitize_thread))
+#else
+#define _VAR_NO_SANITIZE
+#endif
+#if defined(__AVX2__)
+_VAR_NO_SANITIZE static size_t _var_string_plainlen(const char* s, char qchar) {
+	const __m256i vq = _mm256_set1_epi8(qchar);
+	const __m256i vbs = _mm256_set1_epi8('\\');
+	const __m256i vsl = _mm256_set1_epi8('/');
+	const __m256i vctl = _mm256_set1_epi8(0x1F);
+	size_t misalign = (uintptr_t)s & 31;
+	const __m256i* p = (const __m256i*)(s - misalign);
+	uint32_t mask;
+	
+	for (;;) {
+		__m256i x = _mm256_load_si256(p);
+		__m256i m = _mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(x, vq), _mm256_cmpeq_epi8(x, vbs)),
+				_mm256_or_si256(_mm256_cmpeq_epi8(x, vsl), _mm256_cmpeq_epi8(_mm256_max_epu8(x, vctl), vctl)));
+		mask = (uint32_t)_mm256_movemask_epi8(m);
+		if (misalign) {
+			mask = (mask >> misalign) << misalign;
+			misalign = 0;
+		}
+		if (mask) {
+			return ((const char*)p - s) + __builtin_ctz(mask);
+		}
+		p++;
+	}
+}
+#elif defined(__SSE2__)
+_VAR_NO_SANITIZE static size_t _var_string_plainlen(const char* s, char qchar) {
+	const __m128i vq = _mm_set1_epi8(qchar);
+	const __m128i vbs = _mm_set1_epi8('\\');
+	const __m128i vsl = _mm_set1_epi8('/');
+	const __m128i vctl = _mm_set1_epi8(0x1F);
+	size_t misalign = (uintptr_t)s & 15;
+	const __m128i* p = (const __m128i*)(s - misalign);
+	uint32_t mask;
+	
+	for (;;) {
+		__m128i x = _mm_load_si128(p);
+		__m128i m = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(x, vq), _mm_cmpeq_epi8(x, vbs)),
+				_mm_or_si128(_mm_cmpeq_epi8(x, vsl), _mm_cmpeq_epi8(_mm_max_epu8(x, vctl), vctl)));
+		mask = (uint32_t)_mm_movemask_epi8(m);
+		if (misalign) {
+			mask = (mask >> misalign) << misalign;
+			misalign = 0;
+		}
+		if (mask) {
+			return ((const char*)p - s) + __builtin_ctz(mask);
+		}
+		p++;
+	}
+}
+#else
+static size_t _var_string_plainlen(const char* s, char qchar) {
+	const unsigned char* p = (const unsigned char*)s;
+	while (*p >= 0x20 && *p != (unsigned char)qchar && *p != '\\' && *p != '/') {
+		p++;
+	}
+	return (const char*)p - s;
+}
+#endif
+
+
 char* _var_readstring(char** s, int *line) {
 	char* ret = NULL;
 	char c, qchar;
 	size_t len = 0;
+	size_t run;
 	size_t buffersize = 512;
 
 	qchar = **s;
 	if (qchar != '\"' && qchar != '\'') return NULL;
 	(*s)++;
 
-	ret = malloc(buffersize);
+	ret = memory_alloc(buffersize);
 	if (ret == 0) {
 		_var_parser_printinfo(*line, *s, "Can't read string, can't alloc memory\n");
 		exit(-1);
 	}
-	while ( (c = **s) ) {
-		if (len >= buffersize) {
-			if (_var_buffer_resize(&ret, &buffersize, buffersize<<1)) {
+	for (;;) {
+		// copy the plain run in one go, +2 leaves room for the char after it
+		run = _var_string_plainlen(*s, qchar);
+		if (len + run + 2 > buffersize) {
+			size_t new_size = buffersize<<1;
+			if (new_size < len + run + 2) {
+				new_size = len + run + 2;
+			}
+			if (_var_buffer_resize(&ret, &buffersize, new_size)) {
 				_var_parser_printinfo(*line, *s, "Can't read string, can't realloc memory\n");
 				exit(-1);
 			}
 		}
+		memcpy(ret + len, *s, run);
+		len += run;
+		(*s) += run;
+		
+		c = **s;
+		if (c == 0) {
+			break;
+		}
 		if (c == '\n') {
 			(*line)++;
 		} else if (c == qchar) {
@@ -966,6 +1318,8 @@ char* _var_readstring(char** s, int *line) {
 			(*s)++;
 			c = **s;
 			switch(c) {
+				case '\0':
+					continue;
 				case '"':
 				case '\\':
 				case '/':
@@ -986,9 +1340,11 @@ char* _var_readstring(char** s, int *line) {
 					c = '\t';
 					break;
 				case 'u':
+					// the parser stops at the backslash
 					_var_parser_printinfo(*line, *s, "Can't read string, unicode escapes not supported\n");
-					exit(-1);
-					break;
+					memory_free(ret);
+					(*s)--;
+					return NULL;
 			}
 		}
 		ret[len] = c;
@@ -1006,60 +1362,57 @@ char* _var_readstring(char** s, int *line) {
 	if (len > 0) {
 		return ret;
 	}
-	free(ret);
+	memory_free(ret);
 	return NULL;
 }
 
 
 void _var_writestring(FILE* fd, char* str) {
-	char* buffer;
 	char c;
-	size_t len = 0;
-	size_t buffersize = 512;
-	
-	buffer = malloc(buffersize);
+	size_t run;
 	
-	buffer[len++] = '"';
-	while ( (c = *str) ) {
-		if (len+8 > buffersize) {
-			if (_var_buffer_resize(&buffer, &buffersize, buffersize<<1)) {
-				exit(-1);
-			}
+	fputc('"', fd);
+	for (;;) {
+		run = _var_string_plainlen(str, '"');
+		if (run > 0) {
+			fwrite(str, 1, run, fd);
+			str += run;
+		}
+		c = *str;
+		if (c == 0) {
+			break;
 		}
 		switch(c) {
 			case '"':
 			case '\\':
 			case '/':
-				buffer[len++] = '\\';
+				fputc('\\', fd);
 				break;
 			case '\b':
-				buffer[len++] = '\\';
+				fputc('\\', fd);
 				c = 'b';
 				break;
 			case '\f':
-				buffer[len++] = '\\';
+				fputc('\\', fd);
 				c = 'f';
 				break;
 			case '\n':
-				buffer[len++] = '\\';
+				fputc('\\', fd);
 				c = 'n';
 				break;
 			case '\r':
-				buffer[len++] = '\\';
+				fputc('\\', fd);
 				c = 'r';
 				break;
 			case '\t':
-				buffer[len++] = '\\';
+				fputc('\\', fd);
 				c = 't';
 				break;
 		}
-		buffer[len] = c;
-		len++;
+		fputc(c, fd);
 		str++;
 	}
-	buffer[len++] = '"';
-	fwrite(buffer, len, 1, fd);
-	free(buffer);
+	fputc('"', fd);
 }
 
 
@@ -1109,3 +1462,1057 @@ static void spaceskip(char** s, int *line) {
 		break;
 	}
 }
+
+
+
+/* Streaming tokenizer */
+
+#define _VT_IDLE		0
+#define _VT_STRING		1
+#define _VT_STRING_ESC		2
+#define _VT_AFTER_STRING	3
+#define _VT_NUMBER		4
+#define _VT_WORD		5
+#define _VT_HEX_OPEN		6
+#define _VT_HEX			7
+#define _VT_HEX_CLOSE		8
+#define _VT_COMMENT_START	9
+#define _VT_COMMENT_LINE	10
+#define _VT_COMMENT_BLOCK	11
+#define _VT_COMMENT_BLOCK_END	12
+
+#define VAR_TOKEN_MAXDEPTH 256
+#define VAR_TOKEN_RAWCHUNK 4096
+#define VAR_TOKEN_READCHUNK (64*1024)
+
+struct _VARTOKENIZER {
+	VAR_TOKEN_FUNC callback;
+	void* userdata;
+	int state;
+	int resume;
+	int line;
+	int error;
+	char qchar;
+	
+	char stack[VAR_TOKEN_MAXDEPTH];
+	size_t depth;
+	
+	char* buffer;
+	size_t len;
+	size_t size;
+	
+	unsigned char raw[VAR_TOKEN_RAWCHUNK];
+	size_t rawlen;
+	int nibble;
+	
+	VAR value;
+};
+
+VARTOKENIZER* var_tokenizer_new(VAR_TOKEN_FUNC callback, void* userdata) {
+	VARTOKENIZER* t = memory_alloc(sizeof(VARTOKENIZER));
+	t->callback = callback;
+	t->userdata = userdata;
+	t->line = 1;
+	t->size = 512;
+	t->buffer = memory_alloc(t->size);
+	t->nibble = -1;
+	return t;
+}
+
+void var_tokenizer_free(VARTOKENIZER* t) {
+	if (t) {
+		memory_free(t->buffer);
+		memory_free(t);
+	}
+}
+
+static int _var_tokenizer_error(VARTOKENIZER* t, const char* fmt, ...) {
+	char message[512];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(message, sizeof(message), fmt, ap);
+	va_end(ap);
+	print_err(0, "Parser error at line %i: %s", t->line, message);
+	t->error = 1;
+	return 1;
+}
+
+static int _var_tokenizer_emit(VARTOKENIZER* t, int event, VAR* value) {
+	if (t->callback(t->userdata, event, value)) {
+		t->error = 1;
+		return 1;
+	}
+	return 0;
+}
+
+static void _var_tokenizer_append(VARTOKENIZER* t, char c) {
+	if (t->len + 1 >= t->size) {
+		t->size <<= 1;
+		t->buffer = memory_realloc(t->buffer, t->size);
+	}
+	t->buffer[t->len++] = c;
+	t->buffer[t->len] = '\0';
+}
+
+static void _var_tokenizer_append_run(VARTOKENIZER* t, const char* data, size_t len) {
+	if (t->len + len >= t->size) {
+		while (t->len + len >= t->size) {
+			t->size <<= 1;
+		}
+		t->buffer = memory_realloc(t->buffer, t->size);
+	}
+	memcpy(t->buffer + t->len, data, len);
+	t->len += len;
+	t->buffer[t->len] = '\0';
+}
+
+static int _var_tokenizer_emit_string(VARTOKENIZER* t, int event) {
+	memset(&t->value, 0, sizeof(VAR));
+	t->value.vtype = VAR_TYPE_STR;
+	t->value.vstr = t->buffer;
+	t->state = _VT_IDLE;
+	return _var_tokenizer_emit(t, event, &t->value);
+}
+
+static int _var_tokenizer_flush_raw(VARTOKENIZER* t) {
+	if (t->rawlen == 0) {
+		return 0;
+	}
+	memset(&t->value, 0, sizeof(VAR));
+	t->value.vtype = VAR_TYPE_RAW;
+	t->value.vstr = (char*)t->raw;
+	t->value.vint = t->rawlen;
+	t->rawlen = 0;
+	return _var_tokenizer_emit(t, VAR_EVENT_RAW, &t->value);
+}
+
+static int _var_tokenizer_idle(VARTOKENIZER* t, char c) {
+	if (c == '\n') {
+		t->line++;
+		return 0;
+	}
+	if (isspace((unsigned char)c) || c == ',') {
+		return 0;
+	}
+	t->len = 0;
+	switch (c) {
+		case '{':
+		case '[':
+			if (t->depth >= VAR_TOKEN_MAXDEPTH) {
+				return _var_tokenizer_error(t, "nesting too deep at %c\n", c);
+			}
+			t->stack[t->depth++] = (c == '{') ? '}' : ']';
+			return _var_tokenizer_emit(t, (c == '{') ? VAR_EVENT_MAP_START : VAR_EVENT_ARRAY_START, NULL);
+		case '}':
+		case ']':
+			if (t->depth == 0 || t->stack[t->depth - 1] != c) {
+				return _var_tokenizer_error(t, "unexpected %c\n", c);
+			}
+			t->depth--;
+			return _var_tokenizer_emit(t, (c == '}') ? VAR_EVENT_MAP_END : VAR_EVENT_ARRAY_END, NULL);
+		case '"':
+		case '\'':
+			t->qchar = c;
+			t->buffer[0] = '\0';
+			t->state = _VT_STRING;
+			return 0;
+		case '/':
+			t->resume = _VT_IDLE;
+			t->state = _VT_COMMENT_START;
+			return 0;
+		case 'n':
+		case 'h':
+			_var_tokenizer_append(t, c);
+			t->state = _VT_WORD;
+			return 0;
+	}
+	if (c == '-' || (c >= '0' && c <= '9')) {
+		_var_tokenizer_append(t, c);
+		t->state = _VT_NUMBER;
+		return 0;
+	}
+	return _var_tokenizer_error(t, "unexpected 0x%02X\n", (unsigned char)c);
+}
+
+static int _var_tokenizer_char(VARTOKENIZER* t, char c) {
+	char* end;
+	const char* error;
+	int digit;
+	
+	switch (t->state) {
+		case _VT_IDLE:
+			return _var_tokenizer_idle(t, c);
+		case _VT_STRING:
+			if (c == t->qchar) {
+				t->state = _VT_AFTER_STRING;
+				return 0;
+			}
+			if (c == '\\') {
+				t->state = _VT_STRING_ESC;
+				return 0;
+			}
+			if (c == '\n') {
+				t->line++;
+			}
+			_var_tokenizer_append(t, c);
+			return 0;
+		case _VT_STRING_ESC:
+			switch (c) {
+				case 'b':
+					c = '\b';
+					break;
+				case 'f':
+					c = '\f';
+					break;
+				case 'n':
+					c = '\n';
+					break;
+				case 'r':
+					c = '\r';
+					break;
+				case 't':
+					c = '\t';
+					break;
+				case 'u':
+					return _var_tokenizer_error(t, "Can't read string, unicode escapes not supported\n");
+			}
+			_var_tokenizer_append(t, c);
+			t->state = _VT_STRING;
+			return 0;
+		case _VT_AFTER_STRING:
+			if (c == '\n') {
+				t->line++;
+				return 0;
+			}
+			if (isspace((unsigned char)c)) {
+				return 0;
+			}
+			if (c == '/') {
+				t->resume = _VT_AFTER_STRING;
+				t->state = _VT_COMMENT_START;
+				return 0;
+			}
+			if (c == ':') {
+				if (t->depth > 0 && t->stack[t->depth - 1] != '}') {
+					return _var_tokenizer_error(t, "unexpected key definition, unexpected %c\n", c);
+				}
+				return _var_tokenizer_emit_string(t, VAR_EVENT_KEY);
+			}
+			if (_var_tokenizer_emit_string(t, VAR_EVENT_VALUE)) {
+				return 1;
+			}
+			return _var_tokenizer_idle(t, c);
+		case _VT_NUMBER:
+			if (isalnum((unsigned char)c) || c == '.' || c == '+' || c == '-') {
+				_var_tokenizer_append(t, c);
+				return 0;
+			}
+			memset(&t->value, 0, sizeof(VAR));
+			end = t->buffer;
+			if (_var_parse_number(&t->value, &end, &error)) {
+				return _var_tokenizer_error(t, "%s\n", error);
+			}
+			if (*end != '\0') {
+				return _var_tokenizer_error(t, "unexpected mixed value\n");
+			}
+			t->state = _VT_IDLE;
+			if (_var_tokenizer_emit(t, VAR_EVENT_VALUE, &t->value)) {
+				return 1;
+			}
+			return _var_tokenizer_idle(t, c);
+		case _VT_WORD:
+			if (isalpha((unsigned char)c) || c == '(') {
+				if (t->len >= 4) {
+					return _var_tokenizer_error(t, "unexpected 0x%02X\n", (unsigned char)c);
+				}
+				_var_tokenizer_append(t, c);
+				if (strcmp(t->buffer, "hex(") == 0) {
+					t->state = _VT_HEX_OPEN;
+				}
+				return 0;
+			}
+			if (strcmp(t->buffer, "null") != 0) {
+				return _var_tokenizer_error(t, "unexpected 0x%02X\n", (unsigned char)c);
+			}
+			memset(&t->value, 0, sizeof(VAR));
+			t->value.vtype = VAR_TYPE_STR;
+			t->state = _VT_IDLE;
+			if (_var_tokenizer_emit(t, VAR_EVENT_VALUE, &t->value)) {
+				return 1;
+			}
+			return _var_tokenizer_idle(t, c);
+		case _VT_HEX_OPEN:
+			if (c != '"') {
+				return _var_tokenizer_error(t, "Expected start of string\n");
+			}
+			t->rawlen = 0;
+			t->nibble = -1;
+			t->state = _VT_HEX;
+			return _var_tokenizer_emit(t, VAR_EVENT_RAW_START, NULL);
+		case _VT_HEX:
+			if (c == '"') {
+				if (t->nibble >= 0) {
+					return _var_tokenizer_error(t, "Can't read hex data, odd number of digits\n");
+				}
+				t->state = _VT_HEX_CLOSE;
+				if (_var_tokenizer_flush_raw(t)) {
+					return 1;
+				}
+				return _var_tokenizer_emit(t, VAR_EVENT_RAW_END, NULL);
+			}
+			digit = _var_hex_digit(c);
+			if (digit < 0) {
+				return _var_tokenizer_error(t, "Can't read hex data, unknown char 0x%02X\n", (unsigned char)c);
+			}
+			if (t->nibble < 0) {
+				t->nibble = digit;
+				return 0;
+			}
+			t->raw[t->rawlen++] = (t->nibble << 4) | digit;
+			t->nibble = -1;
+			if (t->rawlen == VAR_TOKEN_RAWCHUNK) {
+				return _var_tokenizer_flush_raw(t);
+			}
+			return 0;
+		case _VT_HEX_CLOSE:
+			if (c != ')') {
+				return _var_tokenizer_error(t, "expected closing bracket ) for opening hex(\n");
+			}
+			t->state = _VT_IDLE;
+			return 0;
+		case _VT_COMMENT_START:
+			if (c == '/') {
+				t->state = _VT_COMMENT_LINE;
+				return 0;
+			}
+			if (c == '*') {
+				t->state = _VT_COMMENT_BLOCK;
+				return 0;
+			}
+			return _var_tokenizer_error(t, "unexpected 0x%02X\n", '/');
+		case _VT_COMMENT_LINE:
+			if (c == '\n') {
+				t->line++;
+				t->state = t->resume;
+			}
+			return 0;
+		case _VT_COMMENT_BLOCK:
+		case _VT_COMMENT_BLOCK_END:
+			if (c == '\n') {
+				t->line++;
+			}
+			if (t->state == _VT_COMMENT_BLOCK_END && c == '/') {
+				t->state = t->resume;
+				return 0;
+			}
+			t->state = (c == '*') ? _VT_COMMENT_BLOCK_END : _VT_COMMENT_BLOCK;
+			return 0;
+	}
+	return _var_tokenizer_error(t, "invalid tokenizer state %i\n", t->state);
+}
+
+int var_tokenizer_feed(VARTOKENIZER* t, const char* data, size_t len) {
+	if (t->error) {
+		return 1;
+	}
+	for (size_t i = 0; i < len; ++i) {
+		// plain runs inside a string are copied at once
+		if (t->state == _VT_STRING) {
+			size_t run = i;
+			while (run < len && data[run] != t->qchar && data[run] != '\\' && data[run] != '\n') {
+				run++;
+			}
+			_var_tokenizer_append_run(t, data + i, run - i);
+			i = run;
+			if (i == len) {
+				break;
+			}
+		} else if (t->state == _VT_IDLE || t->state == _VT_AFTER_STRING) {
+			// and so is indentation
+			while (i < len && (data[i] == ' ' || data[i] == '\t' || data[i] == '\r' || data[i] == '\n')) {
+				if (data[i] == '\n') {
+					t->line++;
+				}
+				i++;
+			}
+			if (i == len) {
+				break;
+			}
+		}
+		if (_var_tokenizer_char(t, data[i])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int var_tokenizer_finish(VARTOKENIZER* t) {
+	if (t->error) {
+		return 1;
+	}
+	if (t->state == _VT_COMMENT_LINE) {
+		t->state = t->resume;
+	}
+	// terminates a pending number or null
+	if (t->state == _VT_NUMBER || t->state == _VT_WORD) {
+		if (_var_tokenizer_char(t, ' ')) {
+			return 1;
+		}
+	}
+	if (t->state == _VT_AFTER_STRING) {
+		if (_var_tokenizer_emit_string(t, VAR_EVENT_VALUE)) {
+			return 1;
+		}
+	}
+	if (t->state != _VT_IDLE) {
+		return _var_tokenizer_error(t, "EOF, unterminated value\n");
+	}
+	if (t->depth > 0) {
+		return _var_tokenizer_error(t, "EOF, missing %c\n", t->stack[t->depth - 1]);
+	}
+	return 0;
+}
+
+int var_tokenize_file(FILE* fd, VAR_TOKEN_FUNC callback, void* userdata) {
+	char* chunk;
+	size_t n;
+	int ret = 0;
+	VARTOKENIZER* t = var_tokenizer_new(callback, userdata);
+	
+	chunk = memory_alloc(VAR_TOKEN_READCHUNK);
+	while ((n = fread(chunk, 1, VAR_TOKEN_READCHUNK, fd)) > 0) {
+		if (var_tokenizer_feed(t, chunk, n)) {
+			ret = 1;
+			break;
+		}
+	}
+	if (ret == 0) {
+		ret = var_tokenizer_finish(t);
+	}
+	memory_free(chunk);
+	var_tokenizer_free(t);
+	return ret;
+}
+
+
+struct _var_stream_builder {
+	VAR* root;
+	VAR* stack[VAR_TOKEN_MAXDEPTH];
+	int depth;
+	char* name;
+	VAR* raw;
+};
+
+static void _var_stream_add(struct _var_stream_builder* b, VAR* v) {
+	var_add_child(b->depth > 0 ? b->stack[b->depth - 1] : b->root, v);
+	memory_free(b->name);
+	b->name = NULL;
+}
+
+static int _var_stream_event(void* userdata, int event, VAR* value) {
+	struct _var_stream_builder* b = userdata;
+	VAR* v;
+	
+	switch (event) {
+		case VAR_EVENT_KEY:
+			memory_free(b->name);
+			b->name = memory_strdup(value->vstr);
+			break;
+		case VAR_EVENT_MAP_START:
+		case VAR_EVENT_ARRAY_START:
+			v = var_create(b->name, event == VAR_EVENT_MAP_START ? VAR_TYPE_MAP : VAR_TYPE_ARRAY);
+			_var_stream_add(b, v);
+			b->stack[b->depth++] = v;
+			break;
+		case VAR_EVENT_MAP_END:
+		case VAR_EVENT_ARRAY_END:
+			b->depth--;
+			break;
+		case VAR_EVENT_VALUE:
+			v = var_create(b->name, value->vtype);
+			v->vint = value->vint;
+			v->vfloat = value->vfloat;
+			if (value->vstr) {
+				v->vstr = memory_strdup(value->vstr);
+			}
+			_var_stream_add(b, v);
+			break;
+		case VAR_EVENT_RAW_START:
+			b->raw = var_create(b->name, VAR_TYPE_RAW);
+			_var_stream_add(b, b->raw);
+			break;
+		case VAR_EVENT_RAW:
+			b->raw->vstr = memory_realloc(b->raw->vstr, b->raw->vint + value->vint);
+			memcpy(b->raw->vstr + b->raw->vint, value->vstr, value->vint);
+			b->raw->vint += value->vint;
+			break;
+	}
+	return 0;
+}
+
+VAR* var_import_stream(FILE* fd) {
+	VAR* v = NULL;
+	struct _var_stream_builder b;
+	
+	memset(&b, 0, sizeof(b));
+	b.root = var_create(0, VAR_TYPE_UNKNOWN);
+	if (var_tokenize_file(fd, _var_stream_event, &b) == 0) {
+		v = b.root->children;
+		b.root->children = NULL;
+	}
+	memory_free(b.name);
+	var_free(b.root);
+	return v;
+}
+
+
+
+/* Pull parsing
+ *
+ * Reads values in document order on top of the tokenizer. The file is fed
+ * in chunks and the events of a chunk are queued until they are pulled,
+ * so memory only depends on the chunk size and the longest string.
+ */
+
+typedef struct _VARPULL_EVENT VARPULL_EVENT;
+struct _VARPULL_EVENT {
+	int event;
+	VAR value;	// VALUE, the queue owns vstr
+	size_t key;	// KEY, offset into keys
+};
+
+struct _VARPULL {
+	FILE* fd;
+	VARTOKENIZER* t;
+	char* chunk;
+	int eof;
+	VARPULL_EVENT* events;
+	size_t head;
+	size_t count;
+	size_t size;
+	VAR* raw;	// hex() value being collected
+	char* keys;	// names of the queued KEY events
+	size_t keyslen;
+	size_t keyssize;
+	VAR scratch;
+};
+
+static VARPULL_EVENT* _var_pull_push(VARPULL* p, int event) {
+	if (p->head + p->count == p->size) {
+		if (p->head > 0) {
+			memmove(p->events, p->events + p->head, p->count * sizeof(VARPULL_EVENT));
+			p->head = 0;
+		} else {
+			p->size = p->size ? p->size << 1 : 64;
+			p->events = memory_realloc(p->events, p->size * sizeof(VARPULL_EVENT));
+		}
+	}
+	VARPULL_EVENT* e = &p->events[p->head + p->count++];
+	memset(e, 0, sizeof(VARPULL_EVENT));
+	e->event = event;
+	return e;
+}
+
+static int _var_pull_event(void* userdata, int event, VAR* value) {
+	VARPULL* p = userdata;
+	VARPULL_EVENT* e;
+	
+	switch (event) {
+		case VAR_EVENT_RAW_START:
+			p->raw = var_create(0, VAR_TYPE_RAW);
+			break;
+		case VAR_EVENT_RAW:
+			p->raw->vstr = memory_realloc(p->raw->vstr, p->raw->vint + value->vint);
+			memcpy(p->raw->vstr + p->raw->vint, value->vstr, value->vint);
+			p->raw->vint += value->vint;
+			break;
+		case VAR_EVENT_RAW_END:
+			e = _var_pull_push(p, VAR_EVENT_VALUE);
+			e->value.vtype = VAR_TYPE_RAW;
+			e->value.vstr = p->raw->vstr;
+			e->value.vint = p->raw->vint;
+			p->raw->vstr = NULL;
+			var_free(p->raw);
+			p->raw = NULL;
+			break;
+		case VAR_EVENT_KEY: {
+			// names are only compared, they share one buffer
+			size_t len = strlen(value->vstr) + 1;
+			e = _var_pull_push(p, event);
+			if (p->keyslen + len > p->keyssize) {
+				while (p->keyslen + len > p->keyssize) {
+					p->keyssize = p->keyssize ? p->keyssize << 1 : 4096;
+				}
+				p->keys = memory_realloc(p->keys, p->keyssize);
+			}
+			memcpy(p->keys + p->keyslen, value->vstr, len);
+			e->key = p->keyslen;
+			p->keyslen += len;
+			break;
+		}
+		case VAR_EVENT_VALUE:
+			e = _var_pull_push(p, event);
+			e->value = *value;
+			if (value->vstr) {
+				e->value.vstr = memory_strdup(value->vstr);
+			}
+			break;
+		default:
+			_var_pull_push(p, event);
+	}
+	return 0;
+}
+
+static void _var_pull_clear(VARPULL* p) {
+	for (size_t i = 0; i < p->count; i++) {
+		memory_free(p->events[p->head + i].value.vstr);
+	}
+	p->head = 0;
+	p->count = 0;
+	p->keyslen = 0;
+	var_free(p->raw);
+	p->raw = NULL;
+	memory_free(p->scratch.vstr);
+	memset(&p->scratch, 0, sizeof(p->scratch));
+}
+
+// Event at the head of the queue, reads more of the file if it is empty, 0 at the end or on errors
+static int _var_pull_peek(VARPULL* p) {
+	if (p->count == 0) {
+		p->keyslen = 0;
+	}
+	while (p->count == 0 && !p->eof) {
+		size_t n = fread(p->chunk, 1, VAR_TOKEN_READCHUNK, p->fd);
+		if (n > 0) {
+			var_tokenizer_feed(p->t, p->chunk, n);
+		} else {
+			var_tokenizer_finish(p->t);
+			p->eof = 1;
+		}
+		if (p->t->error) {
+			p->eof = 1;
+		}
+	}
+	return p->count ? p->events[p->head].event : 0;
+}
+
+static void _var_pull_pop(VARPULL* p) {
+	p->head++;
+	p->count--;
+}
+
+static int _var_pull_expect(VARPULL* p, int event) {
+	if (_var_pull_peek(p) != event) {
+		return 0;
+	}
+	_var_pull_pop(p);
+	return 1;
+}
+
+VARPULL* var_pull_open_file(char* filename) {
+	VARPULL* p;
+	
+	print(0, "Reading file %s\n", filename);
+	FILE* fd = fopen(filename, "rb");
+	if (fd == NULL) {
+		print_err(0, "Reading file %s, %s\n", filename, strerror(errno));
+		return NULL;
+	}
+	p = memory_alloc(sizeof(VARPULL));
+	memset(p, 0, sizeof(VARPULL));
+	p->fd = fd;
+	p->chunk = memory_alloc(VAR_TOKEN_READCHUNK);
+	var_pull_rewind(p);
+	return p;
+}
+
+void var_pull_free(VARPULL* p) {
+	if (p) {
+		_var_pull_clear(p);
+		var_tokenizer_free(p->t);
+		fclose(p->fd);
+		memory_free(p->events);
+		memory_free(p->keys);
+		memory_free(p->chunk);
+		memory_free(p);
+	}
+}
+
+void var_pull_rewind(VARPULL* p) {
+	_var_pull_clear(p);
+	var_tokenizer_free(p->t);
+	p->t = var_tokenizer_new(_var_pull_event, p);
+	p->eof = 0;
+	fseek(p->fd, 0, SEEK_SET);
+}
+
+int var_pull_error(VARPULL* p) {
+	return p->t->error;
+}
+
+VAR* var_pull_tree(VARPULL* p) {
+	var_pull_rewind(p);
+	return var_import_stream(p->fd);
+}
+
+int var_pull_begin_map(VARPULL* p) {
+	return _var_pull_expect(p, VAR_EVENT_MAP_START);
+}
+
+int var_pull_end_map(VARPULL* p) {
+	return _var_pull_expect(p, VAR_EVENT_MAP_END);
+}
+
+int var_pull_begin_array(VARPULL* p) {
+	return _var_pull_expect(p, VAR_EVENT_ARRAY_START);
+}
+
+int var_pull_next(VARPULL* p) {
+	switch (_var_pull_peek(p)) {
+		case VAR_EVENT_ARRAY_END:
+			_var_pull_pop(p);
+			return 0;
+		case VAR_EVENT_MAP_END:
+		case 0:
+			return -1;
+	}
+	return 1;
+}
+
+int var_pull_key(VARPULL* p, char* name) {
+	if (_var_pull_peek(p) != VAR_EVENT_KEY || strcmp(p->keys + p->events[p->head].key, name) != 0) {
+		return 0;
+	}
+	_var_pull_pop(p);
+	return 1;
+}
+
+VAR* var_pull_value(VARPULL* p) {
+	// a string nobody took from the previous value
+	memory_free(p->scratch.vstr);
+	memset(&p->scratch, 0, sizeof(VAR));
+	if (_var_pull_peek(p) != VAR_EVENT_VALUE) {
+		return NULL;
+	}
+	p->scratch = p->events[p->head].value;
+	_var_pull_pop(p);
+	return &p->scratch;
+}
+
+
+
+/* Binary format
+ *
+ * "NSB1", varint count of top level values, then per value:
+ * tag byte (type index in the low nibble, flags for name/style/comment above),
+ * optional name/style/comment, then the payload:
+ * zigzag varint for ints, 4 byte float, varint len+1 prefixed strings (0 = null),
+ * varint len prefixed raw data and varint child count for arrays and maps.
+ * All lengths come before the data, so a mapped file is decoded in one pass.
+ */
+
+#define VAR_BINARY_MAGIC "NSB1"
+#define _VB_NAMED	0x80
+#define _VB_STYLED	0x40
+#define _VB_COMMENTED	0x20
+#define _VB_TYPEMASK	0x0F
+
+typedef struct _var_binary_reader {
+	const unsigned char* p;
+	const unsigned char* end;
+	int error;
+} _var_binary_reader;
+
+static void _var_binary_write_varint(FILE* fd, uint64_t value) {
+	unsigned char buffer[10];
+	int len = 0;
+	do {
+		buffer[len] = value & 0x7F;
+		value >>= 7;
+		if (value) {
+			buffer[len] |= 0x80;
+		}
+		len++;
+	} while (value);
+	fwrite(buffer, 1, len, fd);
+}
+
+static void _var_binary_write_string(FILE* fd, const char* str) {
+	if (str == NULL) {
+		_var_binary_write_varint(fd, 0);
+		return;
+	}
+	size_t len = strlen(str);
+	_var_binary_write_varint(fd, len + 1);
+	fwrite(str, 1, len, fd);
+}
+
+static int _var_binary_typeindex(int vtype) {
+	return vtype ? __builtin_ctz(vtype) + 1 : 0;
+}
+
+static void _var_binary_write(VAR* v, FILE* fd) {
+	unsigned char tag;
+	uint32_t fbits;
+	
+	tag = _var_binary_typeindex(v->vtype);
+	if (v->name) tag |= _VB_NAMED;
+	if (v->style) tag |= _VB_STYLED;
+	if (v->comment) tag |= _VB_COMMENTED;
+	fputc(tag, fd);
+	if (v->name) _var_binary_write_string(fd, v->name);
+	if (v->style) _var_binary_write_varint(fd, v->style);
+	if (v->comment) _var_binary_write_string(fd, v->comment);
+	
+	switch (v->vtype) {
+		case VAR_TYPE_INT:
+		case VAR_TYPE_INT64:
+			_var_binary_write_varint(fd, ((uint64_t)v->vint << 1) ^ (uint64_t)(v->vint >> 63));
+			break;
+		case VAR_TYPE_FLOAT:
+			memcpy(&fbits, &v->vfloat, 4);
+			for (int i = 0; i < 4; ++i) {
+				fputc((fbits >> (i*8)) & 0xFF, fd);
+			}
+			break;
+		case VAR_TYPE_STR:
+			_var_binary_write_string(fd, v->vstr);
+			break;
+		case VAR_TYPE_RAW:
+			_var_binary_write_varint(fd, v->vint);
+			fwrite(v->vstr, 1, v->vint, fd);
+			break;
+		case VAR_TYPE_ARRAY:
+		case VAR_TYPE_MAP:
+			_var_binary_write_varint(fd, var_get_children_count(v));
+			for (VAR* child = v->children; child; child = child->next) {
+				_var_binary_write(child, fd);
+			}
+			break;
+	}
+}
+
+void var_export_binary(VAR* v, FILE* fd) {
+	size_t count = 0;
+	for (VAR* ptr = v; ptr; ptr = ptr->next) {
+		count++;
+	}
+	fwrite(VAR_BINARY_MAGIC, 1, 4, fd);
+	_var_binary_write_varint(fd, count);
+	for (; v; v = v->next) {
+		_var_binary_write(v, fd);
+	}
+}
+
+int var_export_binary_file(VAR *v, char* filename) {
+	FILE* fd;
+	print(0, "Writing file %s\n", filename);
+	fd = fopen(filename, "wb");
+	if (fd == NULL) {
+		print_err(0, "Writing file %s, %s\n", filename, strerror(errno));
+		return 0;
+	}
+	var_export_binary(v, fd);
+	return _var_close_written(fd, filename);
+}
+
+
+static uint64_t _var_binary_read_varint(_var_binary_reader* r) {
+	uint64_t value = 0;
+	int shift = 0;
+	while (r->p < r->end && shift < 64) {
+		unsigned char b = *r->p++;
+		value |= (uint64_t)(b & 0x7F) << shift;
+		if ((b & 0x80) == 0) {
+			return value;
+		}
+		shift += 7;
+	}
+	r->error = 1;
+	return 0;
+}
+
+static const unsigned char* _var_binary_read_bytes(_var_binary_reader* r, uint64_t len) {
+	const unsigned char* p = r->p;
+	if (r->error || len > (uint64_t)(r->end - r->p)) {
+		r->error = 1;
+		return NULL;
+	}
+	r->p += len;
+	return p;
+}
+
+static char* _var_binary_read_string(_var_binary_reader* r) {
+	uint64_t len = _var_binary_read_varint(r);
+	const unsigned char* p;
+	char* str;
+	if (len == 0) {
+		return NULL;
+	}
+	p = _var_binary_read_bytes(r, len - 1);
+	if (p == NULL) {
+		return NULL;
+	}
+	str = memory_alloc(len);
+	memcpy(str, p, len - 1);
+	return str;
+}
+
+static VAR* _var_binary_read(_var_binary_reader* r, int depth) {
+	VAR* v;
+	const unsigned char* p;
+	unsigned char tag;
+	uint64_t count;
+	uint64_t zigzag;
+	uint32_t fbits;
+	
+	if (r->p >= r->end || depth > 256) {
+		r->error = 1;
+		return NULL;
+	}
+	tag = *r->p++;
+	if ((tag & _VB_TYPEMASK) > _var_binary_typeindex(VAR_TYPE_RAW)) {
+		r->error = 1;
+		return NULL;
+	}
+	v = var_create(0, (tag & _VB_TYPEMASK) ? 1 << ((tag & _VB_TYPEMASK) - 1) : VAR_TYPE_UNKNOWN);
+	if (tag & _VB_NAMED) v->name = _var_binary_read_string(r);
+	if (tag & _VB_STYLED) v->style = _var_binary_read_varint(r);
+	if (tag & _VB_COMMENTED) v->comment = _var_binary_read_string(r);
+	
+	switch (v->vtype) {
+		case VAR_TYPE_INT:
+		case VAR_TYPE_INT64:
+			zigzag = _var_binary_read_varint(r);
+			v->vint = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+			break;
+		case VAR_TYPE_FLOAT:
+			p = _var_binary_read_bytes(r, 4);
+			if (p) {
+				fbits = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+				memcpy(&v->vfloat, &fbits, 4);
+			}
+			break;
+		case VAR_TYPE_STR:
+			v->vstr = _var_binary_read_string(r);
+			break;
+		case VAR_TYPE_RAW:
+			count = _var_binary_read_varint(r);
+			p = _var_binary_read_bytes(r, count);
+			if (p) {
+				v->vstr = memory_alloc(count + 1);
+				memcpy(v->vstr, p, count);
+				v->vint = count;
+			}
+			break;
+		case VAR_TYPE_ARRAY:
+		case VAR_TYPE_MAP:
+			count = _var_binary_read_varint(r);
+			while (count-- > 0 && !r->error) {
+				VAR* child = _var_binary_read(r, depth + 1);
+				if (child) {
+					var_add_child(v, child);
+				}
+			}
+			break;
+	}
+	if (r->error) {
+		var_free(v);
+		return NULL;
+	}
+	return v;
+}
+
+VAR* var_import_binary(const void* buffer, size_t len) {
+	_var_binary_reader r;
+	VAR* vx;
+	VAR* v;
+	uint64_t count;
+	
+	if (len < 4 || memcmp(buffer, VAR_BINARY_MAGIC, 4) != 0) {
+		return NULL;
+	}
+	r.p = (const unsigned char*)buffer + 4;
+	r.end = (const unsigned char*)buffer + len;
+	r.error = 0;
+	
+	vx = var_create(0, VAR_TYPE_UNKNOWN);
+	count = _var_binary_read_varint(&r);
+	while (count-- > 0 && !r.error) {
+		v = _var_binary_read(&r, 0);
+		if (v) {
+			var_add_child(vx, v);
+		}
+	}
+	v = NULL;
+	if (!r.error) {
+		v = vx->children;
+		vx->children = NULL;
+	}
+	var_free(vx);
+	return v;
+}
+
+static void* _var_map_file(char* filename, size_t* size) {
+	void* p = NULL;
+#if defined(_WIN32)
+	HANDLE file, mapping;
+	LARGE_INTEGER filesize;
+	
+	file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return NULL;
+	}
+	if (GetFileSizeEx(file, &filesize) && filesize.QuadPart > 0) {
+		*size = filesize.QuadPart;
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping) {
+			p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+		}
+	}
+	CloseHandle(file);
+#else
+	struct stat st;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		*size = st.st_size;
+		p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			p = NULL;
+		}
+	}
+	close(fd);
+#endif
+	return p;
+}
+
+static void _var_unmap_file(void* p, size_t size) {
+#if defined(_WIN32)
+	UnmapViewOfFile(p);
+#else
+	munmap(p, size);
+#endif
+}
+
+VAR* var_import_binary_file(char* filename) {
+	VAR* v;
+	void* buffer;
+	size_t filesize = 0;
+	
+	print(0, "Reading file %s\n", filename);
+	buffer = _var_map_file(filename, &filesize);
+	if (buffer == NULL) {
+		print_err(0, "Reading file %s, %s\n", filename, strerror(errno));
+		return NULL;
+	}
+	v = var_import_binary(buffer, filesize);
+	_var_unmap_file(buffer, filesize);
+	if (v == NULL) {
+		print_err(0, "Reading file %s, not a valid binary file or truncated\n", filename);
+	}
+	return v;
+}
@@ -61,6 +61,7 @@ VAR* var_comment(VAR* v, char* comment);
 VAR* var_get(VAR* v, char* name);
 
 char* var_asstring(VAR* v);
+char* var_takestring(VAR* v);
 long var_aslong(VAR* v);
 
 int64_t var_asint64(VAR* v);
@@ -83,8 +84,59 @@ VAR* var_get_map_children(VAR* v);
 VAR* var_get_array_children(VAR* v);
 
 void var_export(VAR *v, FILE* fd, int level);
-void var_export_file(VAR *v, char* filename);
+int var_export_file(VAR *v, char* filename);
 
 VAR* var_import_file(char* filename);
+
+void var_export_binary(VAR* v, FILE* fd);
+int var_export_binary_file(VAR *v, char* filename);
+VAR* var_import_binary(const void* buffer, size_t len);
+VAR* var_import_binary_file(char* filename);
+
+void var_hex_encode(char* out, const void* in, size_t len);
+size_t var_hex_decode(void* out, const char* in, size_t len);
+
+
+/* Pull parser, reads values in document order without building a tree */
+typedef struct _VARPULL VARPULL;
+
+VARPULL* var_pull_open_file(char* filename);
+void var_pull_free(VARPULL* p);
+void var_pull_rewind(VARPULL* p);
+VAR* var_pull_tree(VARPULL* p);
+// Non zero if the document isn't valid, not just in a different order
+int var_pull_error(VARPULL* p);
+
+int var_pull_begin_map(VARPULL* p);
+int var_pull_end_map(VARPULL* p);
+int var_pull_begin_array(VARPULL* p);
+int var_pull_next(VARPULL* p);
+int var_pull_key(VARPULL* p, char* name);
+VAR* var_pull_value(VARPULL* p);
+
+
+/* Streaming tokenizer, fed in chunks, reports events to a callback */
+#define VAR_EVENT_MAP_START	1
+#define VAR_EVENT_MAP_END	2
+#define VAR_EVENT_ARRAY_START	3
+#define VAR_EVENT_ARRAY_END	4
+#define VAR_EVENT_KEY		5
+#define VAR_EVENT_VALUE		6
+#define VAR_EVENT_RAW_START	7
+#define VAR_EVENT_RAW		8
+#define VAR_EVENT_RAW_END	9
+
+// value is NULL for start/end events and only valid during the call, return non zero to abort
+typedef int (*VAR_TOKEN_FUNC)(void* userdata, int event, VAR* value);
+
+typedef struct _VARTOKENIZER VARTOKENIZER;
+
+VARTOKENIZER* var_tokenizer_new(VAR_TOKEN_FUNC callback, void* userdata);
+void var_tokenizer_free(VARTOKENIZER* t);
+int var_tokenizer_feed(VARTOKENIZER* t, const char* data, size_t len);
+int var_tokenizer_finish(VARTOKENIZER* t);
+
+int var_tokenize_file(FILE* fd, VAR_TOKEN_FUNC callback, void* userdata);
+VAR* var_import_stream(FILE* fd);
 #endif	/* NOSON_H */
 
@@ -0,0 +1,84 @@
+/*
+ * This file is part of tfsavcodec.
+ * 
+ * Copyright (c) 2016, Oskar Eisemuth
+ * 
+ * For the full copyright and license information,
+ * please view the LICENSE file that was distributed with this source code.
+ * 
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "memfunc.h"
+#include "spscqueue.h"
+
+#define SPSCQUEUE_CACHELINE 64
+
+/*
+ * head is only written by the consumer, tail only by the producer. Both
+ * sit on their own cache line so the two threads don't share one.
+ */
+struct _SPSCQUEUE {
+	size_t head;
+	char pad1[SPSCQUEUE_CACHELINE - sizeof(size_t)];
+	size_t tail;
+	char pad2[SPSCQUEUE_CACHELINE - sizeof(size_t)];
+	size_t mask;
+	size_t itemsize;
+	char* items;
+};
+
+SPSCQUEUE* spscqueue_create(size_t capacity, size_t itemsize) {
+	size_t size = 2;
+	while (size < capacity) {
+		size <<= 1;
+	}
+	SPSCQUEUE* queue = memory_alloc(sizeof(SPSCQUEUE));
+	memset(queue, 0, sizeof(SPSCQUEUE));
+	queue->mask = size - 1;
+	queue->itemsize = itemsize;
+	queue->items = memory_alloc(size * itemsize);
+	return queue;
+}
+
+void spscqueue_free(SPSCQUEUE* queue) {
+	memory_free(queue->items);
+	memory_free(queue);
+}
+
+bool spscqueue_trypush(SPSCQUEUE* queue, const void* item) {
+	size_t tail = queue->tail;
+	size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	if (tail - head > queue->mask) {
+		return false;
+	}
+	memcpy(queue->items + (tail & queue->mask) * queue->itemsize, item, queue->itemsize);
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+bool spscqueue_trypop(SPSCQUEUE* queue, void* item) {
+	size_t head = queue->head;
+	size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+	if (head == tail) {
+		return false;
+	}
+	memcpy(item, queue->items + (head & queue->mask) * queue->itemsize, queue->itemsize);
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+void spscqueue_push(SPSCQUEUE* queue, const void* item) {
+	while (!spscqueue_trypush(queue, item)) {
+		sched_yield();
+	}
+}
+
+void spscqueue_pop(SPSCQUEUE* queue, void* item) {
+	while (!spscqueue_trypop(queue, item)) {
+		sched_yield();
+	}
+}
@@ -0,0 +1,40 @@
+/*
+ * This file is part of tfsavcodec.
+ * 
+ * Copyright (c) 2016, Oskar Eisemuth
+ * 
+ * For the full copyright and license information,
+ * please view the LICENSE file that was distributed with this source code.
+ * 
+ */
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Lock-free ring buffer for exactly one producer and one consumer thread
+typedef struct _SPSCQUEUE SPSCQUEUE;
+
+// capacity is rounded up to a power of two
+SPSCQUEUE* spscqueue_create(size_t capacity, size_t itemsize);
+void spscqueue_free(SPSCQUEUE* queue);
+
+// Non blocking, false if the queue is full / empty
+bool spscqueue_trypush(SPSCQUEUE* queue, const void* item);
+bool spscqueue_trypop(SPSCQUEUE* queue, void* item);
+
+// Yield until there is room / an item
+void spscqueue_push(SPSCQUEUE* queue, const void* item);
+void spscqueue_pop(SPSCQUEUE* queue, void* item);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPSCQUEUE_H */
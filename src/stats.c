@@ -0,0 +1,288 @@
+/*
+ * This file is part of tfsavcodec.
+ * 
+ * Copyright (c) 2016, Oskar Eisemuth
+ * 
+ * For the full copyright and license information,
+ * please view the LICENSE file that was distributed with this source code.
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "misc.h"
+#include "memfunc.h"
+#include "stats.h"
+
+/*
+ * Wall and cpu time, bytes in and out of every phase. A phase that runs
+ * more than once, e.g. for every file of a batch, is summed up. The cpu
+ * time is the one of the thread that started the phase, block tasks
+ * other workers steal from it are not included.
+ *
+ * With --trace every phase and span is also kept as Chrome trace event
+ * and written when the trace is closed, chrome://tracing or Perfetto show
+ * them as timeline per thread.
+ */
+
+#define STATS_MAXPHASES 64
+
+typedef struct _STATS_PHASE STATS_PHASE;
+struct _STATS_PHASE {
+	const char* name;
+	unsigned int count;
+	double wall;
+	double cpu;
+	uint64_t in;
+	uint64_t out;
+};
+
+int stats = 0;
+
+static STATS_PHASE phases[STATS_MAXPHASES];
+static int numphases = 0;
+static pthread_mutex_t phasesLock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct _STATS_EVENT STATS_EVENT;
+struct _STATS_EVENT {
+	const char* name;
+	int tid;
+	double start;	// seconds since the trace was opened
+	double duration;
+	uint64_t bytes;
+};
+
+static char* tracefile = NULL;
+static double traceStart;
+static STATS_EVENT* events = NULL;
+static size_t numevents = 0;
+static size_t maxevents = 0;
+static int numthreads = 0;
+static pthread_mutex_t eventsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t threadKey;
+static pthread_once_t threadOnce = PTHREAD_ONCE_INIT;
+
+static void stats_thread_key_create(void) {
+	pthread_key_create(&threadKey, NULL);
+}
+
+static double stats_clock(clockid_t clock) {
+	struct timespec now;
+	clock_gettime(clock, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void stats_start(STATS_TIMER* timer) {
+	if (!stats) {
+		return;
+	}
+	timer->wall = stats_clock(CLOCK_MONOTONIC);
+	timer->cpu = stats_clock(CLOCK_THREAD_CPUTIME_ID);
+}
+
+// Small number per thread in the order threads first trace something
+static int stats_thread_id() {
+	pthread_once(&threadOnce, stats_thread_key_create);
+	intptr_t id = (intptr_t)pthread_getspecific(threadKey);
+	if (id == 0) {
+		pthread_mutex_lock(&eventsLock);
+		id = ++numthreads;
+		pthread_mutex_unlock(&eventsLock);
+		pthread_setspecific(threadKey, (void*)id);
+	}
+	return id;
+}
+
+static void stats_trace_event(STATS_TIMER* timer, const char* name, double wall, uint64_t bytes) {
+	int tid = stats_thread_id();
+	pthread_mutex_lock(&eventsLock);
+	if (numevents == maxevents) {
+		maxevents = maxevents ? maxevents * 2 : 4096;
+		events = memory_realloc(events, sizeof(STATS_EVENT) * maxevents);
+	}
+	STATS_EVENT* event = &events[numevents++];
+	event->name = name;
+	event->tid = tid;
+	event->start = timer->wall - traceStart;
+	event->duration = wall;
+	event->bytes = bytes;
+	pthread_mutex_unlock(&eventsLock);
+}
+
+void stats_span(STATS_TIMER* timer, const char* name, uint64_t bytes) {
+	if (!(stats & STATS_TRACE)) {
+		return;
+	}
+	double wall = stats_clock(CLOCK_MONOTONIC) - timer->wall;
+	stats_trace_event(timer, name, wall, bytes);
+	timer->wall += wall;
+}
+
+void stats_stop(STATS_TIMER* timer, const char* phase, uint64_t in, uint64_t out) {
+	if (!stats) {
+		return;
+	}
+	double wall = stats_clock(CLOCK_MONOTONIC) - timer->wall;
+	double cpu = stats_clock(CLOCK_THREAD_CPUTIME_ID) - timer->cpu;
+	
+	if (stats & STATS_TRACE) {
+		stats_trace_event(timer, phase, wall, in > out ? in : out);
+	}
+	if (!(stats & STATS_SUMMARY)) {
+		timer->wall += wall;
+		timer->cpu += cpu;
+		return;
+	}
+	
+	pthread_mutex_lock(&phasesLock);
+	int i;
+	for (i = 0; i < numphases; i++) {
+		if (strcmp(phases[i].name, phase) == 0) {
+			break;
+		}
+	}
+	if (i == numphases && numphases < STATS_MAXPHASES) {
+		memset(&phases[i], 0, sizeof(STATS_PHASE));
+		phases[i].name = phase;
+		numphases++;
+	}
+	if (i < numphases) {
+		phases[i].count++;
+		phases[i].wall += wall;
+		phases[i].cpu += cpu;
+		phases[i].in += in;
+		phases[i].out += out;
+	}
+	pthread_mutex_unlock(&phasesLock);
+	
+	// Next phase can reuse the timer
+	timer->wall += wall;
+	timer->cpu += cpu;
+}
+
+// Throughput of the bigger side, decoding is measured by what it produces
+static double stats_mbs(STATS_PHASE* phase) {
+	uint64_t bytes = phase->in > phase->out ? phase->in : phase->out;
+	if (phase->wall <= 0) {
+		return 0;
+	}
+	return bytes / phase->wall / (1 << 20);
+}
+
+void stats_print() {
+	double wall = 0;
+	double cpu = 0;
+	
+	pthread_mutex_lock(&phasesLock);
+	print_report(0, "%-22s %5s %10s %10s %12s %12s %9s\n", "phase", "runs", "wall ms", "cpu ms", "bytes in", "bytes out", "MB/s");
+	for (int i = 0; i < numphases; i++) {
+		STATS_PHASE* phase = &phases[i];
+		print_report(0, "%-22s %5u %10.1f %10.1f %12" PRIu64 " %12" PRIu64 " %9.1f\n", phase->name, phase->count,
+			phase->wall * 1000, phase->cpu * 1000, phase->in, phase->out, stats_mbs(phase));
+		wall += phase->wall;
+		cpu += phase->cpu;
+	}
+	print_report(0, "%-22s %5s %10.1f %10.1f\n", "sum", "", wall * 1000, cpu * 1000);
+	pthread_mutex_unlock(&phasesLock);
+	
+	MEMORY_STATS memory;
+	memory_stats(&memory);
+	print_report(0, "\n");
+	print_report(0, "memory peak %zu bytes, live %zu bytes at the end\n", memory.peak, memory.live);
+	print_report(0, "%-22s %12s %14s\n", "allocations", "count", "bytes");
+	for (int i = 0; i < MEMORY_CATEGORIES; i++) {
+		print_report(0, "%-22s %12" PRIu64 " %14" PRIu64 "\n", memory_category_name(i), memory.allocs[i], memory.bytes[i]);
+	}
+	print_report(0, "%-22s %12" PRIu64 "\n", "frees", memory.frees);
+	print_report(0, "%-22s %12" PRIu64 " %14" PRIu64 "\n", "reallocs, copied", memory.reallocs, memory.reallocCopied);
+	print_report(0, "%-22s %12" PRIu64 "\n", "reallocs moved", memory.reallocMoved);
+}
+
+bool stats_write_json(const char* filename) {
+	FILE* fd = fopen(filename, "w");
+	if (fd == NULL) {
+		print_err(0, "Writing stats %s failed\n", filename);
+		return false;
+	}
+	pthread_mutex_lock(&phasesLock);
+	fprintf(fd, "{\n\t\"phases\": [\n");
+	for (int i = 0; i < numphases; i++) {
+		STATS_PHASE* phase = &phases[i];
+		fprintf(fd, "\t\t{\"name\": \"%s\", \"runs\": %u, \"wall_ms\": %.3f, \"cpu_ms\": %.3f, "
+			"\"bytes_in\": %" PRIu64 ", \"bytes_out\": %" PRIu64 ", \"mb_s\": %.3f}%s\n",
+			phase->name, phase->count, phase->wall * 1000, phase->cpu * 1000,
+			phase->in, phase->out, stats_mbs(phase), (i + 1 < numphases) ? "," : "");
+	}
+	fprintf(fd, "\t],\n");
+	pthread_mutex_unlock(&phasesLock);
+	
+	MEMORY_STATS memory;
+	memory_stats(&memory);
+	fprintf(fd, "\t\"memory\": {\"peak\": %zu, \"live\": %zu, \"frees\": %" PRIu64 ", \"reallocs\": %" PRIu64 
+		", \"reallocs_moved\": %" PRIu64 ", \"realloc_copied\": %" PRIu64 ", \"categories\": {\n",
+		memory.peak, memory.live, memory.frees, memory.reallocs, memory.reallocMoved, memory.reallocCopied);
+	for (int i = 0; i < MEMORY_CATEGORIES; i++) {
+		fprintf(fd, "\t\t\"%s\": {\"allocs\": %" PRIu64 ", \"bytes\": %" PRIu64 "}%s\n", memory_category_name(i),
+			memory.allocs[i], memory.bytes[i], (i + 1 < MEMORY_CATEGORIES) ? "," : "");
+	}
+	fprintf(fd, "\t}}\n}\n");
+	if (fclose(fd) != 0) {
+		print_err(0, "Writing stats %s failed\n", filename);
+		return false;
+	}
+	return true;
+}
+
+bool stats_trace_open(const char* filename) {
+	// Checked up front, a failing trace shouldn't show up after the whole run
+	FILE* fd = fopen(filename, "w");
+	if (fd == NULL) {
+		print_err(0, "Writing trace %s failed\n", filename);
+		return false;
+	}
+	fclose(fd);
+	tracefile = memory_strdup(filename);
+	traceStart = stats_clock(CLOCK_MONOTONIC);
+	stats |= STATS_TRACE;
+	return true;
+}
+
+bool stats_trace_close() {
+	if (!(stats & STATS_TRACE)) {
+		return true;
+	}
+	stats &= ~STATS_TRACE;
+	FILE* fd = fopen(tracefile, "w");
+	if (fd == NULL) {
+		print_err(0, "Writing trace %s failed\n", tracefile);
+		return false;
+	}
+	pthread_mutex_lock(&eventsLock);
+	fprintf(fd, "{\"traceEvents\": [\n");
+	for (int tid = 1; tid <= numthreads; tid++) {
+		fprintf(fd, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"thread %d\"}},\n",
+			tid, tid);
+	}
+	for (size_t i = 0; i < numevents; i++) {
+		STATS_EVENT* event = &events[i];
+		fprintf(fd, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"bytes\": %" PRIu64 "}}%s\n",
+			event->name, event->tid, event->start * 1e6, event->duration * 1e6, event->bytes, (i + 1 < numevents) ? "," : "");
+	}
+	fprintf(fd, "],\n\"displayTimeUnit\": \"ms\"}\n");
+	memory_free(events);
+	events = NULL;
+	numevents = maxevents = 0;
+	pthread_mutex_unlock(&eventsLock);
+	if (fclose(fd) != 0) {
+		print_err(0, "Writing trace %s failed\n", tracefile);
+		return false;
+	}
+	print_report(0, "Trace written to %s\n", tracefile);
+	return true;
+}
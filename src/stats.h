@@ -0,0 +1,49 @@
+/*
+ * This file is part of tfsavcodec.
+ * 
+ * Copyright (c) 2016, Oskar Eisemuth
+ * 
+ * For the full copyright and license information,
+ * please view the LICENSE file that was distributed with this source code.
+ * 
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct _STATS_TIMER STATS_TIMER;
+
+struct _STATS_TIMER {
+	double wall;	// seconds
+	double cpu;	// seconds of the calling thread
+};
+
+#define STATS_SUMMARY 1	// --stats, sums up phases
+#define STATS_TRACE 2	// --trace, records every span
+
+// All other calls do nothing while it is 0
+extern int stats;
+
+void stats_start(STATS_TIMER* timer);
+// Adds the time since stats_start and the bytes to phase, phase has to be a literal
+void stats_stop(STATS_TIMER* timer, const char* phase, uint64_t in, uint64_t out);
+// Like stats_stop, but only traced, for spans too small to be a phase
+void stats_span(STATS_TIMER* timer, const char* name, uint64_t bytes);
+
+void stats_print();
+bool stats_write_json(const char* filename);
+
+bool stats_trace_open(const char* filename);
+bool stats_trace_close();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STATS_H */
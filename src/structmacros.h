@@ -68,11 +68,12 @@ struct name {                  \
 } __attribute__((packed));     \
 typedef struct name name;
 
-#define _STRUCT_DUMP_IDENT printf("%*s", ident_level*2, "");
+// Struct dumps are logged at LOG_DUMP, indented by their nesting
+#define _STRUCT_DUMP_PRINT(...) print_dump(ident_level, __VA_ARGS__)
 
-//#define STRUCT_DUMP_field(type, member) _STRUCT_DUMP_IDENT printf(#member ": " FORMAT_(type) "\n", obj->member);
+//#define STRUCT_DUMP_field(type, member) _STRUCT_DUMP_PRINT(#member ": " FORMAT_(type) "\n", obj->member);
 
-#define STRUCT_DUMP_field_default(type, member) _STRUCT_DUMP_IDENT printf(#member ": " FORMAT_(type) "\n", obj->member);
+#define STRUCT_DUMP_field_default(type, member) _STRUCT_DUMP_PRINT(#member ": " FORMAT_(type) "\n", obj->member);
 
 
 #define STRUCT_DUMP_field_u8(type, member) STRUCT_DUMP_field_default(type, member)
@@ -88,24 +89,24 @@ typedef struct name name;
 #define STRUCT_DUMP_field_string(type, member) STRUCT_DUMP_field_default(type, member)
 
 #define STRUCT_DUMP_field_tfstring(type, member)  \
-	_STRUCT_DUMP_IDENT printf(#member ": (tfstr: %d) %s\n", obj->member.len, obj->member.str);
+	_STRUCT_DUMP_PRINT(#member ": (tfstr: %d) %s\n", obj->member.len, obj->member.str);
 
 #define STRUCT_DUMP_field(type, member) STRUCT_DUMP_field_##type(type, member)
 
 
 
 
-#define STRUCT_DUMP_filepos(type, member) _STRUCT_DUMP_IDENT printf(#member ": 0x%08X\n", obj->member);
+#define STRUCT_DUMP_filepos(type, member) _STRUCT_DUMP_PRINT(#member ": 0x%08X\n", obj->member);
 #define STRUCT_DUMP_array(type, member, size) \
 for (size_t member##_i = 0; member##_i < size; ++member##_i) { \
-	_STRUCT_DUMP_IDENT printf(#member "%i: " FORMAT_(type) "\n", member##_i,obj->member[member##_i]); \
+	_STRUCT_DUMP_PRINT(#member "%zu: " FORMAT_(type) "\n", member##_i,obj->member[member##_i]); \
 }
 
 
 
 #define STRUCT_DUMP_vector(numtype, numname, type, name) \
 	STRUCT_DUMP_field(numtype, numname) \
-	_STRUCT_DUMP_IDENT printf(#name ": \n"); \
+	_STRUCT_DUMP_PRINT(#name ": \n"); \
 	for (size_t member##_i = 0; member##_i < obj->numname; ++member##_i) { \
 		type##_dump(&obj->name[member##_i], ident_level+1);	\
 	}
@@ -113,7 +114,7 @@ for (size_t member##_i = 0; member##_i < size; ++member##_i) { \
 
 #define STRUCT_DUMP_dynarray(type, member, sizevar) \
 for (size_t member##_i = 0; member##_i < obj->sizevar; ++member##_i) { \
-	_STRUCT_DUMP_IDENT printf(#member "%i: " FORMAT_(type) "\n", member##_i, obj->member[member##_i]); \
+	_STRUCT_DUMP_PRINT(#member "%zu: " FORMAT_(type) "\n", member##_i, obj->member[member##_i]); \
 }
 
 
@@ -189,8 +190,9 @@ var_add_child(v, member##_vector);
 #define FORMAT_IMP_NONSON_s64(objvar, var)	objvar = (int64_t)var_asint64(var)
 
 
-#define FORMAT_IMP_NONSON_string(objvar, var)   objvar = var_asstring(var)
-#define FORMAT_IMP_NONSON_tfstring(objvar, var)   objvar.str = var_asstring(var); objvar.len = strlen(objvar.str);
+// Strings are taken over from the VAR, so the tree or pull value can be freed
+#define FORMAT_IMP_NONSON_string(objvar, var)   objvar = var_takestring(var)
+#define FORMAT_IMP_NONSON_tfstring(objvar, var)   objvar.str = var_takestring(var); objvar.len = objvar.str ? strlen(objvar.str) : 0;
 
 #define STRUCT_IMP_NONSON_field(type, member) FORMAT_IMP_NONSON(type, obj->member, var_get_child(variable, #member));
 #define STRUCT_IMP_NONSON_array(type, member, size) \
@@ -227,6 +229,56 @@ for (size_t member##_i = 0; member##_i < size; ++member##_i) {				\
 	struct_##body(STRUCT_IMP_NONSON_MEMBER)
 
 
+// Noson pull import, members are expected in declaration order.
+// On a mismatch the members read so far are released at pull_fail.
+
+#define STRUCT_PULL_NONSON_field(type, member)						\
+	{										\
+	VAR* value;									\
+	if (!var_pull_key(p, #member)) goto pull_fail;					\
+	if ((value = var_pull_value(p)) == NULL) goto pull_fail;				\
+	FORMAT_IMP_NONSON(type, obj->member, value);					\
+	}
+
+#define STRUCT_PULL_NONSON_array(type, member, size)					\
+	if (!var_pull_key(p, #member) || !var_pull_begin_array(p)) goto pull_fail;		\
+	for (size_t member##_i = 0; ; ++member##_i) {					\
+		int more = var_pull_next(p);						\
+		if (more < 0) goto pull_fail;						\
+		if (more == 0) break;							\
+		VAR* value = var_pull_value(p);						\
+		if (value == NULL) goto pull_fail;						\
+		if (member##_i < size) {						\
+			FORMAT_IMP_NONSON(type, obj->member[member##_i], value);	\
+		}									\
+	}
+
+#define STRUCT_PULL_NONSON_vector(numtyp, numname, type, name)				\
+	if (!var_pull_key(p, #name) || !var_pull_begin_array(p)) goto pull_fail;		\
+	obj->numname = 0;								\
+	for (size_t name##_size = 0; ; ) {						\
+		int more = var_pull_next(p);						\
+		if (more < 0) goto pull_fail;						\
+		if (more == 0) break;							\
+		if (obj->numname >= name##_size) {					\
+			name##_size = name##_size ? name##_size << 1 : 16;		\
+			obj->name = memory_realloc(obj->name, sizeof(type)*name##_size);	\
+		}									\
+		memset(&(obj->name[obj->numname]), 0, sizeof(type));			\
+		if (type##_noson_pull(&(obj->name[obj->numname]), p) == NULL) goto pull_fail;	\
+		obj->numname++;								\
+	}
+
+
+#define STRUCT_PULL_NONSON_filepos(...) 
+#define STRUCT_PULL_NONSON_hidden(...)
+#define STRUCT_PULL_NONSON_MEMBER(x) STRUCT_PULL_NONSON_##x
+
+
+#define STRUCT_PULL_NONSON(body) \
+	struct_##body(STRUCT_PULL_NONSON_MEMBER)
+
+
 // Unserialize
 
 #define _UNSERIALIZE_MEMBER_FD_field(typ, name) \
@@ -238,11 +290,20 @@ for (size_t member##_i = 0; member##_i < size; ++member##_i) {				\
 	obj->name = memory_realloc(obj->name, sizeof(typ)*obj->sizevar); \
 	file_readinto_##typ(fd, obj->name, obj->sizevar);
 
+// Grows with the elements read, a broken count can't allocate more than the file holds
 #define _UNSERIALIZE_MEMBER_FD_vector(numtyp, numname, type, name) \
 	_UNSERIALIZE_MEMBER_FD_field(numtyp, numname) \
-	obj->name = memory_realloc(obj->name, sizeof(type)*(obj->numname)); \
-	for (size_t name##_i = 0; name##_i < obj->numname; ++name##_i) { \
-		type##_unserialize(fd, &(obj->name[name##_i]));	\
+	for (size_t name##_i = 0, name##_size = 0; name##_i < obj->numname; ++name##_i) { \
+		if (name##_i == name##_size) {	\
+			name##_size = name##_size ? name##_size * 2 : 16;	\
+			if (name##_size > obj->numname) name##_size = obj->numname;	\
+			obj->name = memory_realloc(obj->name, sizeof(type)*name##_size);	\
+		}	\
+		memset(&(obj->name[name##_i]), 0, sizeof(type));	\
+		if (!type##_unserialize(fd, &(obj->name[name##_i]))) {	\
+			obj->numname = name##_i + 1;	\
+			return false;	\
+		}	\
 	}
 
 
@@ -254,10 +315,12 @@ for (size_t member##_i = 0; member##_i < size; ++member##_i) {				\
 	
 
 
+// False if the file ended early, obj can be released but not used
 #define OBJSTRUCT_UNSERIALIZE_FUNC(body)		\
-void body##_unserialize(FILE* fd, body* obj) {		\
-	if (obj == NULL) { print_err(0, "Trying to read into unalloced struct"); } \
+bool body##_unserialize(FILE* fd, body* obj) {		\
+	if (obj == NULL) { print_err(0, "Trying to read into unalloced struct"); return false; } \
 	struct_##body(_UNSERIALIZE_MEMBER_FD)		\
+	return !feof(fd);				\
 }
 
 
@@ -297,6 +360,159 @@ void body##_serialize(FILE* fd, body* obj) {		\
 
 
 
+// Serialized size, matches what _serialize writes
+
+#define _SIZE_OF_u8(value)		sizeof(DEFINE_u8)
+#define _SIZE_OF_u16(value)		sizeof(DEFINE_u16)
+#define _SIZE_OF_u32(value)		sizeof(DEFINE_u32)
+#define _SIZE_OF_u64(value)		sizeof(DEFINE_u64)
+#define _SIZE_OF_s8(value)		sizeof(DEFINE_s8)
+#define _SIZE_OF_s16(value)		sizeof(DEFINE_s16)
+#define _SIZE_OF_s32(value)		sizeof(DEFINE_s32)
+#define _SIZE_OF_s64(value)		sizeof(DEFINE_s64)
+#define _SIZE_OF_string(value)		((value) ? strlen(value) + 1 : 0)
+#define _SIZE_OF_tfstring(value)	(sizeof(uint32_t) + (value).len)
+
+#define _SIZE_MEMBER_field(typ, name) \
+	size += _SIZE_OF_##typ(obj->name);
+
+#define _SIZE_MEMBER_array(typ, name, count) \
+	for (size_t name##_i = 0; name##_i < count; ++name##_i) { \
+		size += _SIZE_OF_##typ(obj->name[name##_i]);	\
+	}
+
+#define _SIZE_MEMBER_vector(numtyp, numname, type, name) \
+	size += _SIZE_OF_##numtyp(obj->numname); \
+	for (size_t name##_i = 0; name##_i < obj->numname; ++name##_i) { \
+		size += type##_size(&(obj->name[name##_i]));	\
+	}
+
+#define _SIZE_MEMBER_filepos(...)
+#define _SIZE_MEMBER_hidden(...)
+
+#define _SIZE_MEMBER(x) _SIZE_MEMBER_##x
+
+
+#define OBJSTRUCT_SIZE_FUNC(body)			\
+size_t body##_size(body* obj) {				\
+	size_t size = 0;				\
+	struct_##body(_SIZE_MEMBER)			\
+	return size;					\
+}
+
+
+
+// Field location, offset of a scalar member as long as only fixed size members precede it
+
+#define _FIELD_SIGNED_u8	0
+#define _FIELD_SIGNED_u16	0
+#define _FIELD_SIGNED_u32	0
+#define _FIELD_SIGNED_u64	0
+#define _FIELD_SIGNED_s8	1
+#define _FIELD_SIGNED_s16	1
+#define _FIELD_SIGNED_s32	1
+#define _FIELD_SIGNED_s64	1
+#define _FIELD_SIGNED_string	0
+#define _FIELD_SIGNED_tfstring	0
+
+#define _FIELD_FIXED_string	0
+#define _FIELD_FIXED_tfstring	0
+#define _FIELD_FIXED_u8		1
+#define _FIELD_FIXED_u16	1
+#define _FIELD_FIXED_u32	1
+#define _FIELD_FIXED_u64	1
+#define _FIELD_FIXED_s8		1
+#define _FIELD_FIXED_s16	1
+#define _FIELD_FIXED_s32	1
+#define _FIELD_FIXED_s64	1
+
+#define _LOCATE_MEMBER_field(typ, name)					\
+	if (strcmp(member, #name) == 0) {				\
+		if (!fixed || !_FIELD_FIXED_##typ) return false;	\
+		*offset = size;						\
+		*width = sizeof(DEFINE_##typ);				\
+		*issigned = _FIELD_SIGNED_##typ;			\
+		return true;						\
+	}								\
+	if (_FIELD_FIXED_##typ) size += sizeof(DEFINE_##typ); else fixed = false;
+
+#define _LOCATE_MEMBER_array(typ, name, count) \
+	if (_FIELD_FIXED_##typ) size += sizeof(DEFINE_##typ) * (count); else fixed = false;
+
+// The count of a vector can't be set, it has to match the elements
+#define _LOCATE_MEMBER_vector(numtyp, numname, type, name) \
+	if (strcmp(member, #numname) == 0) return false; \
+	fixed = false;
+
+#define _LOCATE_MEMBER_filepos(...)
+#define _LOCATE_MEMBER_hidden(...)
+
+#define _LOCATE_MEMBER(x) _LOCATE_MEMBER_##x
+
+#define OBJSTRUCT_LOCATE_FUNC(body)							\
+bool body##_locate(const char* member, size_t* offset, size_t* width, bool* issigned) {	\
+	size_t size = 0;								\
+	bool fixed = true;								\
+	struct_##body(_LOCATE_MEMBER)							\
+	return false;									\
+}
+
+
+// Skip, walks over a serialized struct inside a buffer without allocating anything
+
+#define _SKIP_READ(typ, var)						\
+	if (len - *pos < sizeof(DEFINE_##typ)) return false;		\
+	memcpy(&(var), data + *pos, sizeof(DEFINE_##typ));		\
+	*pos += sizeof(DEFINE_##typ);
+
+#define _SKIP_FIXED(size)						\
+	if (len - *pos < (size)) return false;				\
+	*pos += (size);
+
+#define _SKIP_u8	_SKIP_FIXED(sizeof(DEFINE_u8))
+#define _SKIP_u16	_SKIP_FIXED(sizeof(DEFINE_u16))
+#define _SKIP_u32	_SKIP_FIXED(sizeof(DEFINE_u32))
+#define _SKIP_u64	_SKIP_FIXED(sizeof(DEFINE_u64))
+#define _SKIP_s8	_SKIP_FIXED(sizeof(DEFINE_s8))
+#define _SKIP_s16	_SKIP_FIXED(sizeof(DEFINE_s16))
+#define _SKIP_s32	_SKIP_FIXED(sizeof(DEFINE_s32))
+#define _SKIP_s64	_SKIP_FIXED(sizeof(DEFINE_s64))
+#define _SKIP_string {							\
+	const uint8_t* end = memchr(data + *pos, 0, len - *pos);	\
+	if (end == NULL) return false;					\
+	*pos = end - data + 1;						\
+}
+#define _SKIP_tfstring {						\
+	uint32_t strlen_;						\
+	_SKIP_READ(u32, strlen_)					\
+	_SKIP_FIXED(strlen_)						\
+}
+
+#define _SKIP_MEMBER_field(typ, name) _SKIP_##typ
+
+#define _SKIP_MEMBER_array(typ, name, count) \
+	for (size_t name##_i = 0; name##_i < count; ++name##_i) { _SKIP_##typ }
+
+#define _SKIP_MEMBER_vector(numtyp, numname, type, name) {		\
+	DEFINE_##numtyp numname;					\
+	_SKIP_READ(numtyp, numname)					\
+	for (size_t name##_i = 0; name##_i < (size_t)numname; ++name##_i) {	\
+		if (!type##_skip(data, len, pos)) return false;		\
+	}								\
+}
+
+#define _SKIP_MEMBER_filepos(...)
+#define _SKIP_MEMBER_hidden(...)
+
+#define _SKIP_MEMBER(x) _SKIP_MEMBER_##x
+
+#define OBJSTRUCT_SKIP_FUNC(body)					\
+bool body##_skip(const uint8_t* data, size_t len, size_t* pos) {	\
+	struct_##body(_SKIP_MEMBER)					\
+	return true;							\
+}
+
+
 #define OBJSTRUCT_CONSTRUCT(body) \
 	body* body##_new() { return memory_alloc(sizeof(body)); }
 
@@ -304,6 +520,50 @@ void body##_serialize(FILE* fd, body* obj) {		\
 	if (obj == 0) { obj = (body*)memory_alloc(sizeof(body)); }
 
 
+// Release, frees everything a struct owns but not the struct itself
+
+#define _RELEASE_u8(value)
+#define _RELEASE_u16(value)
+#define _RELEASE_u32(value)
+#define _RELEASE_u64(value)
+#define _RELEASE_s8(value)
+#define _RELEASE_s16(value)
+#define _RELEASE_s32(value)
+#define _RELEASE_s64(value)
+#define _RELEASE_string(value)		memory_free(value); value = NULL;
+#define _RELEASE_tfstring(value)	memory_free((value).str); (value).str = NULL; (value).len = 0;
+
+#define _RELEASE_MEMBER_field(typ, name) _RELEASE_##typ(obj->name)
+#define _RELEASE_MEMBER_array(typ, name, count)				\
+	for (size_t name##_i = 0; name##_i < (count); ++name##_i) {	\
+		_RELEASE_##typ(obj->name[name##_i])			\
+	}
+#define _RELEASE_MEMBER_dynarray(typ, name, sizevar)			\
+	memory_free(obj->name);						\
+	obj->name = NULL;
+#define _RELEASE_MEMBER_vector(numtyp, numname, type, name)		\
+	for (size_t name##_i = 0; name##_i < obj->numname; ++name##_i) {	\
+		type##_release(&(obj->name[name##_i]));			\
+	}								\
+	memory_free(obj->name);						\
+	obj->name = NULL;						\
+	obj->numname = 0;
+#define _RELEASE_MEMBER_filepos(...)
+#define _RELEASE_MEMBER_hidden(...)
+
+#define _RELEASE_MEMBER(x) _RELEASE_MEMBER_##x
+
+#define OBJSTRUCT_RELEASE_FUNC(body)		\
+void body##_release(body* obj) {		\
+	if (obj == NULL) return;		\
+	struct_##body(_RELEASE_MEMBER)		\
+}						\
+void body##_free(body* obj) {			\
+	body##_release(obj);			\
+	memory_free(obj);			\
+}
+
+
 #define OBJSTRUCT_DUMP_FUNC(body)	\
 void body##_dump(body* obj, size_t ident_level) { \
 	if (obj == NULL) return;	\
@@ -327,6 +587,41 @@ body* body##_noson_import(body* obj, VAR* variable) {	\
 	return obj;					\
 }
 
+// Returns NULL as soon as the document doesn't match the member order,
+// a partly read obj is released, one it created freed
+#define OBJSTRUCT_NSON_PULL_FUNC(body)				\
+body* body##_noson_pull(body* obj, VARPULL* p) {		\
+	body* created = NULL;					\
+	if (!var_pull_begin_map(p)) return NULL;		\
+	if (obj == NULL) obj = created = body##_new();		\
+	STRUCT_PULL_NONSON(body)				\
+	if (!var_pull_end_map(p)) goto pull_fail;		\
+	return obj;						\
+pull_fail:							\
+	body##_release(obj);					\
+	memory_free(created);					\
+	return NULL;						\
+}
+
+// Only falls back to the tree for a different order, not for syntax errors
+#define OBJSTRUCT_NSON_IMPORT_FILE_FUNC(body)				\
+body* body##_noson_import_file(char* filename) {			\
+	VARPULL* p = var_pull_open_file(filename);			\
+	if (p == NULL) return NULL;					\
+	body* obj = body##_noson_pull(NULL, p);				\
+	if (obj == NULL && !var_pull_error(p)) {			\
+		print(1, "Unexpected key order, using tree import\n");	\
+		VAR* tree = var_pull_tree(p);				\
+		obj = body##_noson_import(NULL, tree);			\
+		var_free(tree);						\
+	}								\
+	if (obj == NULL) {						\
+		print_err(0, "Can't import %s\n", filename);		\
+	}								\
+	var_pull_free(p);						\
+	return obj;							\
+}
+
 
 #endif	/* STRUCTMACROS_H */
 
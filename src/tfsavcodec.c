@@ -24,19 +24,37 @@
 #include "filefunc.h"
 
 #include <direct.h>
+#if defined(_WIN32)
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
 
 #include "noson/noson.h"
 #include "lz4helper.h"
+#include "threadpool.h"
+#include "stats.h"
+#include "tfsavserve.h"
 
 
 #include "tfsavegamestruct.h"
 #include "tfsavegame.h"
+#include "tfsavcodec.h"
 
-int verbose = 25;
 int dumpoffsets = 0;
 int forcedir = 0;
 int onlyassets = 0;
 int depends = 0;
+extern int sectionformat;
+char* referencefile = NULL;
+extern int hashthread;
+char** setfields = NULL;
+int numsetfields = 0;
+int workers = 1;
+char* statsfile = NULL;
+char* tracefile = NULL;
+FILE* streamout = NULL;
 
 char* sep = "----------------------------------\n";
 
@@ -62,13 +80,15 @@ char* createoutputdirectory(char* filename) {
 			if (!fileordir_present(altdirectory)) {
 				print(0, "Creating directory %s\n", altdirectory);	
 				mkdir(altdirectory);
-				free(directory);
+				memory_free(directory);
 				return altdirectory;
 			}
 			i++;
 		}
 		print_err(0, "Output directory (%s) already exists , max tries reached", altdirectory);
-		exit(-1);
+		memory_free(altdirectory);
+		memory_free(directory);
+		return NULL;
 	}
 	print(0, "Creating directory %s\n", directory);	
 	mkdir(directory);
@@ -83,48 +103,60 @@ bool tfsavegame_decompress(FILE* fd, char* filename) {
 	size_t outbuffer1_len = 0;
 	void* outbuffer2 = NULL;
 	size_t outbuffer2_len = 0;
+	STATS_TIMER timer;
+	bool ok = false;
 	
-	
-	
+	stats_start(&timer);
 	fseek(fd, 0, SEEK_END);
 	inbuffer_len = ftell(fd);
 	fseek(fd, 0, SEEK_SET);
-	inbuffer = memory_alloc(inbuffer_len);
-	print(0, "Reading in %d Bytes\n", inbuffer_len);
+	inbuffer = memory_tryalloc_category(inbuffer_len, MEMORY_OTHER);
+	print(0, "Reading in %zu Bytes\n", inbuffer_len);
+	if (inbuffer == NULL) {
+		print_err(0, "Can't alloc memory for reading\n");
+		goto cleanup;
+	}
 	if (fread(inbuffer, inbuffer_len, 1, fd) != 1) {
 		print_err(0, "Reading failed\n");
-		goto cleanup_fail;
+		goto cleanup;
 	}
-	
+	stats_stop(&timer, "read input", inbuffer_len, inbuffer_len);
 
 	if (!decompressBuffer(inbuffer, inbuffer_len, &outbuffer1, &outbuffer1_len)) {
-		print_err(0, "decompressing Stage 1 failed\n", filename);
-		goto cleanup_fail;
+		print_err(0, "decompressing Stage 1 failed\n");
+		goto cleanup;
 	}
+	stats_stop(&timer, "stage 1 decode", inbuffer_len, outbuffer1_len);
+	memory_free(inbuffer);
+	inbuffer = NULL;
 	
 	if (!decompressBuffer(outbuffer1, outbuffer1_len, &outbuffer2, &outbuffer2_len)) {
-		print_err(0, "decompressing Stage 2 failed\n", filename);
-		goto cleanup_fail;
+		print_err(0, "decompressing Stage 2 failed\n");
+		goto cleanup;
 	}
+	stats_stop(&timer, "stage 2 decode", outbuffer1_len, outbuffer2_len);
+	memory_free(outbuffer1);
+	outbuffer1 = NULL;
 	
 	FILE* fdout = fopen(filename, "wb");
 	if (fdout == NULL) {
 		print_err(0, "Writing file %s, %s", filename, strerror(errno));
-		goto cleanup_fail;
+		goto cleanup;
 	}
 	fwrite(outbuffer2, outbuffer2_len, 1, fdout);
 	fclose(fdout);
+	stats_stop(&timer, "write uncompressed", outbuffer2_len, outbuffer2_len);
+	ok = true;
 	
-	return true;
-cleanup_fail:
-	free(inbuffer);
-	free(outbuffer1);
-	free(outbuffer2);
-	return false;
+cleanup:
+	memory_free(inbuffer);
+	memory_free(outbuffer1);
+	memory_free(outbuffer2);
+	return ok;
 }
 
 
-bool tfsavegame_compress(FILE* fd, char* filename) {
+bool tfsavegame_compress(FILE* fd, char* filename, char* reffilename) {
 
 	void* inbuffer = NULL;
 	size_t inbuffer_len = 0;
@@ -132,49 +164,99 @@ bool tfsavegame_compress(FILE* fd, char* filename) {
 	size_t outbuffer1_len = 0;
 	void* outbuffer2 = NULL;
 	size_t outbuffer2_len = 0;
-	
-	
+	void* refbuffer2 = NULL;
+	size_t refbuffer2_len = 0;
+	void* refbuffer1 = NULL;
+	size_t refbuffer1_len = 0;
+	STATS_TIMER timer;
+	bool ok = false;
+	
+	stats_start(&timer);
+	if (reffilename != NULL) {
+		FILE* fdref = file_open_read(reffilename);
+		if (fdref == NULL) {
+			goto cleanup;
+		}
+		fseek(fdref, 0, SEEK_END);
+		refbuffer2_len = ftell(fdref);
+		fseek(fdref, 0, SEEK_SET);
+		refbuffer2 = memory_tryalloc_category(refbuffer2_len, MEMORY_OTHER);
+		print(0, "Reading in %zu Bytes of reference %s\n", refbuffer2_len, reffilename);
+		if (refbuffer2 == NULL || fread(refbuffer2, refbuffer2_len, 1, fdref) != 1) {
+			print_err(0, "Reading failed\n");
+			fclose(fdref);
+			goto cleanup;
+		}
+		fclose(fdref);
+		if (!decompressBuffer(refbuffer2, refbuffer2_len, &refbuffer1, &refbuffer1_len)) {
+			print_err(0, "decompressing reference failed\n");
+			goto cleanup;
+		}
+		stats_stop(&timer, "read reference", refbuffer2_len, refbuffer1_len);
+	}
 	
 	fseek(fd, 0, SEEK_END);
 	inbuffer_len = ftell(fd);
 	fseek(fd, 0, SEEK_SET);
-	inbuffer = memory_alloc(inbuffer_len);
-	print(0, "Reading in %d Bytes for compressing\n", inbuffer_len);
+	inbuffer = memory_tryalloc_category(inbuffer_len, MEMORY_OTHER);
+	print(0, "Reading in %zu Bytes for compressing\n", inbuffer_len);
+	if (inbuffer == NULL) {
+		print_err(0, "Can't alloc memory for reading\n");
+		goto cleanup;
+	}
 	if (fread(inbuffer, inbuffer_len, 1, fd) != 1) {
 		print_err(0, "Reading failed\n");
-		goto cleanup_fail;
+		goto cleanup;
 	}
+	stats_stop(&timer, "read uncompressed", inbuffer_len, inbuffer_len);
 	
-	print(0, "Compressing Stage 1:\n", filename);
-	if (!compressBuffer(inbuffer, inbuffer_len, &outbuffer1, &outbuffer1_len)) {
-		print_err(0, "compressing Stage 1 failed\n", filename);
-		goto cleanup_fail;
+	print(0, "Compressing Stage 1:\n");
+	if (refbuffer1 != NULL) {
+		if (!compressBufferReference(inbuffer, inbuffer_len, refbuffer1, refbuffer1_len, &outbuffer1, &outbuffer1_len, false)) {
+			print_err(0, "compressing Stage 1 failed\n");
+			goto cleanup;
+		}
+		memory_free(refbuffer1);
+		refbuffer1 = NULL;
+	} else if (!compressBuffer(inbuffer, inbuffer_len, &outbuffer1, &outbuffer1_len)) {
+		print_err(0, "compressing Stage 1 failed\n");
+		goto cleanup;
 	}
-	free(inbuffer);
+	stats_stop(&timer, "stage 1 encode", inbuffer_len, outbuffer1_len);
+	memory_free(inbuffer);
 	inbuffer = NULL;
 	print(1, "OK\n");
 	
+	// Stage 2 mostly sees compressed data, probe blocks before compressing them
 	print(0, "Compressing Stage 2:\n");
-	if (!compressBuffer(outbuffer1, outbuffer1_len, &outbuffer2, &outbuffer2_len)) {
-		print_err(0, "compressing Stage 2 failed\n", filename);
-		goto cleanup_fail;
+	if (!compressBufferReference(outbuffer1, outbuffer1_len, refbuffer2, refbuffer2_len, &outbuffer2, &outbuffer2_len, true)) {
+		print_err(0, "compressing Stage 2 failed\n");
+		goto cleanup;
 	}
+	stats_stop(&timer, "stage 2 encode", outbuffer1_len, outbuffer2_len);
+	memory_free(refbuffer2);
+	refbuffer2 = NULL;
+	memory_free(outbuffer1);
+	outbuffer1 = NULL;
 	print(1, "OK\n");
 	
 	FILE* fdout = fopen(filename, "wb");
 	if (fdout == NULL) {
 		print_err(0, "Writing compressed file %s, %s", filename, strerror(errno));
-		goto cleanup_fail;
+		goto cleanup;
 	}
 	fwrite(outbuffer2, outbuffer2_len, 1, fdout);
 	fclose(fdout);
+	stats_stop(&timer, "write output", outbuffer2_len, outbuffer2_len);
+	ok = true;
 	
-	return true;
-cleanup_fail:
-	free(inbuffer);
-	free(outbuffer1);
-	free(outbuffer2);
-	return false;
+cleanup:
+	memory_free(inbuffer);
+	memory_free(outbuffer1);
+	memory_free(outbuffer2);
+	memory_free(refbuffer1);
+	memory_free(refbuffer2);
+	return ok;
 }
 
 
@@ -189,68 +271,86 @@ uint32_t tfsavegame_getMagic(FILE* fd, char *filename) {
 		}
 	}
 	print_err(0,"Can't determine type of file %s\n", filename);
-	fclose(fd);
-	exit(-1);
+	return 0;
 }
 
-void tfsavegame_readCompressed(char *filename) {
+bool tfsavegame_readCompressed(char *filename) {
 	uint32_t signature;	
-	size_t filesize;
-	
-	FILE* fd = file_open_read(filename);
+	bool ok = false;
 	
+	FILE* fd = fopen(filename, "rb");
+	if (fd == NULL) {
+		print_err(0, "Opening file %s, %s\n", filename, strerror(errno));
+		return false;
+	}
 	
 	signature = tfsavegame_getMagic(fd, filename);
+	if (signature == 0) {
+		fclose(fd);
+		return false;
+	}
 	char* directory = createoutputdirectory(filename);
+	if (directory == NULL) {
+		fclose(fd);
+		return false;
+	}
+	filename = memory_strdup(filename);
 	if (signature == MAGICNUMBER_COMPRESSED) {
 		print(0, "Compressed file found\n");
 		FILEPATH *ff = filepath_new();
 		filepath_basepath(ff, directory);
 		filepath_filename(ff, "uncompressed.data");
+		memory_free(filename);
 		filename = memory_strdup(ff->filepath);
 		filepath_free(ff);
 			
 		if (!tfsavegame_decompress(fd, filename)) {
-			fclose(fd);
-			exit(-1);
+			goto cleanup;
 		}
 		
 		
 		fclose(fd);
 		fd = file_open_read(filename);
-		signature = tfsavegame_getMagic(fd, filename);
+		if (fd == NULL || tfsavegame_getMagic(fd, filename) == 0) {
+			goto cleanup;
+		}
 	}
 	print(0, "Processing file %s to %s\n", filename, directory);
 	
 	
 	fseek(fd, 0xFF, SEEK_SET);
 	uint32_t a = file_read_u32(fd);
-	print(0, "0xFF = %d", a);
+	print_debug(0, "0xFF = %d\n", a);
 	fseek(fd, 0, SEEK_SET);
 	
 	
-	tfsavegame_read(fd, filename, directory);
+	ok = tfsavegame_read(fd, filename, directory);
 	
-	
-	free(directory);
-	free(filename);
-	fclose(fd);
+cleanup:
+	memory_free(directory);
+	memory_free(filename);
+	if (fd != NULL) {
+		fclose(fd);
+	}
+	return ok;
 }
 
 
 
-void tfsavegame_writeCompressed(char* directory) {
+bool tfsavegame_writeCompressed(char* directory) {
 	char *outfilename;
+	bool ok = false;
+	
+	if (is_dir(directory) != 1) {
+		print_err(0, "%s doesn't seem to be a directory\n", directory);
+		return false;
+	}
+	
 	outfilename = memory_alloc(strlen(directory)+20);
 	strcpy(outfilename, directory);
 	strcat(outfilename, "_new.sav");
 
-	printf("\nCreating new savegame %s from %s\n%s", outfilename, directory, sep);
-	
-	if (is_dir(directory) != 1) {
-		print_err(0, "%s doesn't seem to be a directory", directory);
-		exit(-1);
-	}
+	print(0, "\nCreating new savegame %s from %s\n%s", outfilename, directory, sep);
 	
 	FILEPATH* ff = filepath_new();
 	filepath_basepath(ff, directory);
@@ -271,76 +371,459 @@ void tfsavegame_writeCompressed(char* directory) {
 	fclose(fdold);
 	*/
 	filepath_filename(ff, "uncompressed.tmp");
-	FILE* fd = file_open_write(ff->filepath);
+	if (tfsavegame_write(ff->filepath, directory)) {
+		FILE* fd = file_open_read(ff->filepath);
+		if (fd != NULL) {
+			ok = tfsavegame_compress(fd, outfilename, referencefile);
+			fclose(fd);
+		}
+	}
+	
+	filepath_free(ff);
+	memory_free(outfilename);
+	return ok;
+}
+
+char* tfsavegame_indexfilename(char* filename) {
+	char* indexfilename = memory_alloc(strlen(filename) + 10);
+	strcpy(indexfilename, filename);
+	strcat(indexfilename, ".tfidx");
+	return indexfilename;
+}
 
-	tfsavegame_write(fd, directory);
-	fflush(fd);
+/*
+ * Sets header fields directly inside a compressed savegame, only the
+ * blocks containing the fields are compressed again. The block index
+ * of the inner frame is cached next to the savegame as .tfidx, so the
+ * content checksum doesn't have to be hashed from the start again.
+ */
+bool tfsavegame_patchCompressed(char *filename) {
+	void* inbuffer = NULL;
+	size_t inbuffer_len = 0;
+	void* stage1 = NULL;
+	size_t stage1_len = 0;
+	void* outbuffer = NULL;
+	size_t outbuffer_len = 0;
+	uint8_t header[8];
+	LZ4HELPER_BLOCKINDEX* index = NULL;
+	char* path = NULL;
+	char* outfilename = NULL;
+	STATS_TIMER timer;
+	bool ok = false;
+	
+	stats_start(&timer);
+	FILE* fd = file_open_read(filename);
+	if (fd == NULL) {
+		return false;
+	}
+	uint32_t signature = tfsavegame_getMagic(fd, filename);
+	if (signature == 0) {
+		fclose(fd);
+		return false;
+	}
+	if (signature != MAGICNUMBER_COMPRESSED) {
+		print_err(0, "%s is not a compressed savegame\n", filename);
+		fclose(fd);
+		return false;
+	}
+	fseek(fd, 0, SEEK_END);
+	inbuffer_len = ftell(fd);
+	fseek(fd, 0, SEEK_SET);
+	inbuffer = memory_tryalloc_category(inbuffer_len, MEMORY_OTHER);
+	if (inbuffer == NULL || fread(inbuffer, inbuffer_len, 1, fd) != 1) {
+		print_err(0, "Reading failed\n");
+		fclose(fd);
+		goto cleanup;
+	}
 	fclose(fd);
+	stats_stop(&timer, "read input", inbuffer_len, inbuffer_len);
+	
+	if (!decompressBuffer(inbuffer, inbuffer_len, &stage1, &stage1_len)) {
+		print_err(0, "Decompressing Stage 1 failed\n");
+		goto cleanup;
+	}
+	
+	char* indexfilename = tfsavegame_indexfilename(filename);
+	index = lz4helper_blockindex_load(stage1, stage1_len, indexfilename);
+	memory_free(indexfilename);
+	if (index == NULL) {
+		print_err(0, "Stage 1 is not a valid LZ4 frame\n");
+		goto cleanup;
+	}
 	
-	fd = file_open_read(ff->filepath);
-	tfsavegame_compress(fd, outfilename);
+	if (!readBufferRange(stage1, stage1_len, 0, header, sizeof(header)) || memcmp(header, "tf**", 4) != 0) {
+		print_err(0, "TF signature not found, are you sure the file is a valid savegame?\n");
+		goto cleanup;
+	}
+	if ((header[4] | (header[5] << 8) | (header[6] << 16) | ((uint32_t)header[7] << 24)) != TFSAVEGAMEVERSION) {
+		print_err(0, "Expected savegame version %u\n", TFSAVEGAMEVERSION);
+		goto cleanup;
+	}
+	
+	for (int i = 0; i < numsetfields; i++) {
+		path = memory_strdup(setfields[i]);
+		char* value = strchr(path, '=');
+		size_t offset, width;
+		bool issigned;
+		uint8_t data[8];
 		
-	fclose(fd);
+		if (value == NULL) {
+			print_err(0, "Expected field=value, got %s\n", setfields[i]);
+			goto cleanup;
+		}
+		*value++ = 0;
+		if (!tfsavegame_locate(path, &offset, &width, &issigned)) {
+			print_err(0, "Field %s can't be set\n", path);
+			goto cleanup;
+		}
+		if (!tfsavegame_parsefield(value, width, issigned, data)) {
+			print_err(0, "Value %s doesn't fit into %s\n", value, path);
+			goto cleanup;
+		}
+		print(0, "Setting %s (offset %zu, %zu bytes) to %s\n", path, offset, width, value);
+		
+		if (!patchBuffer(stage1, stage1_len, index, offset, data, width, &outbuffer, &outbuffer_len)) {
+			print_err(0, "Patching Stage 1 failed\n");
+			goto cleanup;
+		}
+		memory_free(stage1);
+		stage1 = outbuffer;
+		stage1_len = outbuffer_len;
+		outbuffer = NULL;
+		memory_free(path);
+		path = NULL;
+	}
+	
+	print(0, "Compressing Stage 2:\n");
+	if (!compressBufferReference(stage1, stage1_len, inbuffer, inbuffer_len, &outbuffer, &outbuffer_len, true)) {
+		print_err(0, "Compressing Stage 2 failed\n");
+		goto cleanup;
+	}
+	
+	outfilename = filename_noext(filename);
+	outfilename = memory_realloc(outfilename, strlen(outfilename) + 20);
+	strcat(outfilename, "_new.sav");
+	stats_start(&timer);
+	FILE* fdout = fopen(outfilename, "wb");
+	if (fdout == NULL) {
+		print_err(0, "Writing compressed file %s, %s", outfilename, strerror(errno));
+		goto cleanup;
+	}
+	fwrite(outbuffer, outbuffer_len, 1, fdout);
+	if (fclose(fdout) != 0) {
+		print_err(0, "Writing compressed file %s, %s", outfilename, strerror(errno));
+		goto cleanup;
+	}
+	stats_stop(&timer, "write output", outbuffer_len, outbuffer_len);
+	print(0, "Written %s\n", outfilename);
+	
+	indexfilename = tfsavegame_indexfilename(outfilename);
+	lz4helper_blockindex_save(index, stage1, indexfilename);
+	memory_free(indexfilename);
+	ok = true;
 	
 cleanup:
-	filepath_free(ff);
+	lz4helper_blockindex_free(index);
+	memory_free(path);
+	memory_free(outfilename);
+	memory_free(outbuffer);
+	memory_free(stage1);
+	memory_free(inbuffer);
+	return ok;
+}
+
+/*
+ * Batch runs: every input file or directory is a job of its own and the
+ * jobs run on a pool of -j workers. A job only fails itself, the exit
+ * code reports if any of them failed.
+ */
+#define JOB_EXTRACT 1
+#define JOB_COMPRESS 2
+
+typedef struct tfsavcodec_job tfsavcodec_job;
+struct tfsavcodec_job {
+	char* input;
+	int mode;	// JOB_EXTRACT, JOB_COMPRESS or 0 if not given yet
+	bool ok;
+};
+
+tfsavcodec_job* jobs = NULL;
+int numjobs = 0;
+
+/*
+ * A filename of - streams stdin to stdout: -x decodes a savegame to its
+ * uncompressed data, -c encodes uncompressed data into a savegame. Both
+ * frames are handled chunk by chunk, nothing is seeked or written to disk.
+ */
+void tfsavcodec_stdio() {
+	// Data keeps the real stdout, all messages go to stderr from now on
+	fflush(stdout);
+	int fd = dup(fileno(stdout));
+	dup2(fileno(stderr), fileno(stdout));
+#if defined(_WIN32)
+	_setmode(fileno(stdin), _O_BINARY);
+	_setmode(fd, _O_BINARY);
+#endif
+	streamout = fdopen(fd, "wb");
+}
+
+bool tfsavegame_stream(int mode) {
+	bool ok;
+	if (streamout == NULL) {
+		print_err(0, "Can't open stdout\n");
+		return false;
+	}
+	if (mode == JOB_EXTRACT) {
+		print(0, "Decompressing stdin to stdout\n");
+		ok = decompressStream(stdin, streamout, 2);
+	} else {
+		print(0, "Compressing stdin to stdout\n");
+		ok = compressStream(stdin, streamout, 2);
+	}
+	if (fflush(streamout) != 0) {
+		print_err(0, "Writing stdout, %s\n", strerror(errno));
+		ok = false;
+	}
+	if (ok) {
+		print(1, "OK\n");
+	}
+	return ok;
+}
+
+void tfsavcodec_addjob(char* input, int mode) {
+	jobs = memory_realloc(jobs, sizeof(tfsavcodec_job) * (numjobs+1));
+	jobs[numjobs].input = input;
+	jobs[numjobs].mode = mode;
+	jobs[numjobs].ok = false;
+	numjobs++;
+}
+
+/*
+ * Adds every line of listfile as input, empty lines and lines starting
+ * with # are skipped
+ */
+bool tfsavcodec_addlistfile(const char* listfile, int mode) {
+	char line[4096];
+	FILE* fd = fopen(listfile, "r");
+	if (fd == NULL) {
+		print_err(0, "Opening list %s, %s\n", listfile, strerror(errno));
+		return false;
+	}
+	while (fgets(line, sizeof(line), fd) != NULL) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0] == 0 || line[0] == '#') {
+			continue;
+		}
+		tfsavcodec_addjob(memory_strdup(line), mode);
+	}
+	fclose(fd);
+	return true;
+}
+
+/*
+ * Directories given for extraction are replaced by the savegames inside
+ */
+void tfsavcodec_expandjobs() {
+	tfsavcodec_job* input = jobs;
+	int numinput = numjobs;
+	jobs = NULL;
+	numjobs = 0;
+	for (int i = 0; i < numinput; i++) {
+		if (input[i].mode != JOB_EXTRACT || !is_dir(input[i].input)) {
+			tfsavcodec_addjob(input[i].input, input[i].mode);
+			continue;
+		}
+		size_t count;
+		char** files = dir_list(input[i].input, ".sav", &count);
+		if (files == NULL) {
+			print_err(0, "Reading directory %s failed\n", input[i].input);
+			tfsavcodec_addjob(input[i].input, input[i].mode);
+			continue;
+		}
+		for (size_t n = 0; n < count; n++) {
+			tfsavcodec_addjob(files[n], JOB_EXTRACT);
+		}
+		memory_free(files);
+		memory_free(input[i].input);
+	}
+	memory_free(input);
+}
+
+static void tfsavcodec_job_task(void* arg) {
+	tfsavcodec_job* job = arg;
+	if (strcmp(job->input, "-") == 0) {
+		job->ok = tfsavegame_stream(job->mode);
+	} else if (job->mode == JOB_EXTRACT) {
+		job->ok = tfsavegame_readCompressed(job->input);
+	} else {
+		job->ok = tfsavegame_writeCompressed(job->input);
+	}
+}
+
+/*
+ * Runs all jobs and returns the number of failed ones
+ */
+int tfsavcodec_runjobs() {
+	int failed = 0;
+	int threads = workers < 1 ? threadpool_cpucount() : workers;
+	
+	// Jobs are whole files, big files split themselves into block tasks
+	// on the same pool, so more workers than files still help
+	if (threads <= 1) {
+		for (int i = 0; i < numjobs; i++) {
+			tfsavcodec_job_task(&jobs[i]);
+		}
+	} else {
+		THREADPOOL* pool = threadpool_create(threads);
+		for (int i = 0; i < numjobs; i++) {
+			threadpool_submit(pool, tfsavcodec_job_task, &jobs[i]);
+		}
+		threadpool_wait(pool);
+		threadpool_free(pool);
+	}
+	
+	for (int i = 0; i < numjobs; i++) {
+		if (!jobs[i].ok) {
+			failed++;
+		}
+	}
+	if (numjobs > 1) {
+		print(0, "\n%s", sep);
+		print(0, "%d of %d files done, %d failed\n", numjobs - failed, numjobs, failed);
+		for (int i = 0; i < numjobs; i++) {
+			if (!jobs[i].ok) {
+				print(1, "failed: %s\n", jobs[i].input);
+			}
+		}
+	}
+	return failed;
 }
 
 void usage(char *name) {
 	printf("Usage: %s <options> file\n"
-	" -x            extract file\n"
+	" -x file       extract file\n"
 	" -c directory  compress directory\n"
+	"               more files or directories may follow -x or -c, a directory\n"
+	"               following -x is scanned for .sav files\n"
+	" @listfile     read inputs from listfile, one per line\n"
+	" -x -          decompress a savegame from stdin to stdout\n"
+	" -c -          compress uncompressed data from stdin to a savegame on stdout\n"
+	" -j N          use N worker threads, 0 uses one per cpu; big inputs are\n"
+	"               split into block tasks shared between the workers\n"
 	" -v            verbose\n"
 	" -vv           extra verbose\n"
+	" -q            only warnings and errors\n"
+	" --log=file    append messages to file instead of stderr\n"
 //	" -o            dump offsets\n"
 	" --forcedir    force reusage of dir\n"	
+	" --format=bin  write/read sections as binary .bin files instead of .json\n"
+	" --ref=file    reuse compressed blocks of the original savegame with -c\n"
+	" --hashthread  verify content checksums on a separate thread\n"
+	" --stats       print time, bytes and MB/s of every phase\n"
+	" --stats=file  write them as JSON to file instead\n"
+	" --trace=file  write a Chrome trace of all phases and LZ4 blocks to file\n"
+	" --serve=socket serve jobs on a unix socket, see README\n"
+	" --set header.field=value\n"
+	"               set a header field in a compressed savegame without extracting\n"
 	" \n", name);
 }
+// Opened once the arguments are checked, so a usage error leaves no empty trace behind
+static bool tfsavcodec_start() {
+	return tracefile == NULL || stats_trace_open(tracefile);
+}
+
+// Shared end of every run, writes the trace and prints or writes the stats of all jobs
+static int tfsavcodec_finish(int result) {
+	stats_trace_close();
+	if (stats & STATS_SUMMARY) {
+		if (statsfile != NULL) {
+			if (stats_write_json(statsfile)) {
+				print_report(0, "Stats written to %s\n", statsfile);
+			}
+		} else {
+			print_report(0, "\n%s", sep);
+			stats_print();
+		}
+	}
+	return result;
+}
+
 int main(int argc, char** argv) {
 	int i;
 	int extract = 0;
 	int import = 0;
-	char* filename = NULL;
-	char* directory = NULL;
-	
-	printf(TOOLINFO "\n");
-	printf("Copyright (c) 2013-2016 Oskar Eisemuth\n");
-	printf(sep);
-	printf("LZ4 Library, Copyright (c) 2011-2015, Yann Collet\n"
-"All rights reserved.\n"
-	);
-	printf(sep);
-	printf("\n");
+	int mode = 0;
+	char* servepath = NULL;
+	bool stdio = false;
+	
+	verbose = LOG_DUMP;
+	for (i=1; i<argc; i++) {
+		if (strcmp(argv[i], "-") == 0) {
+			stdio = true;
+			tfsavcodec_stdio();
+			break;
+		}
+	}
 	for(i=1; i<argc; i++) {
 		char *arg = argv[i];
 		if(arg[0] == '-') {
 			switch(arg[1]) {
+				case 0:
+					tfsavcodec_addjob(memory_strdup(arg), mode);
+					break;
 				case 'h':
 					usage(argv[0]);
 				case 'x': 
 					extract = 1;
-					if (i<argc) {
+					mode = JOB_EXTRACT;
+					if (i+1<argc) {
 						i++;
-						filename = memory_strdup(argv[i]);
+						if (argv[i][0] == '@') {
+							if (!tfsavcodec_addlistfile(argv[i] + 1, mode)) {
+								return EXIT_FAILURE;
+							}
+						} else {
+							tfsavcodec_addjob(memory_strdup(argv[i]), mode);
+						}
 					} else {
 						usage(argv[0]);
 					}
 					break;
 				case 'c':
 					import = 2;
-					if (i<argc) {
+					mode = JOB_COMPRESS;
+					if (i+1<argc) {
 						i++;
-						directory = memory_strdup(argv[i]);
+						if (argv[i][0] == '@') {
+							if (!tfsavcodec_addlistfile(argv[i] + 1, mode)) {
+								return EXIT_FAILURE;
+							}
+						} else {
+							tfsavcodec_addjob(memory_strdup(argv[i]), mode);
+						}
+					} else {
+						usage(argv[0]);
+					}
+					break;
+				case 'j':
+					if (arg[2] != 0) {
+						workers = atoi(arg + 2);
+					} else if (i+1<argc) {
+						workers = atoi(argv[++i]);
 					} else {
 						usage(argv[0]);
+						return EXIT_FAILURE;
 					}
 					break;
 				case 'v':
-					verbose = 20;
+					verbose = LOG_INFO;
 					if (arg[2] == 'v') {
-						verbose += 10;
+						verbose = LOG_DEBUG;
 					}
 					break;
+				case 'q':
+					verbose = LOG_WARN;
+					break;
 				case 'o':
 					dumpoffsets = 1;
 					break;
@@ -349,34 +832,133 @@ int main(int argc, char** argv) {
 						forcedir = 1;
 						break;
 					}
+					if (strcmp(arg, "--format=bin") == 0) {
+						sectionformat = TFSECTION_FORMAT_BIN;
+						break;
+					}
+					if (strcmp(arg, "--format=json") == 0) {
+						sectionformat = TFSECTION_FORMAT_JSON;
+						break;
+					}
+					if (strncmp(arg, "--ref=", 6) == 0) {
+						referencefile = memory_strdup(arg + 6);
+						break;
+					}
+					if (strncmp(arg, "--set", 5) == 0 && (arg[5] == '=' || arg[5] == 0)) {
+						char* field = arg + 6;
+						if (arg[5] == 0) {
+							if (i+1 >= argc) {
+								usage(argv[0]);
+								return EXIT_FAILURE;
+							}
+							field = argv[++i];
+						}
+						setfields = memory_realloc(setfields, sizeof(char*) * (numsetfields+1));
+						setfields[numsetfields++] = field;
+						break;
+					}
+					if (strncmp(arg, "--serve=", 8) == 0) {
+						servepath = arg + 8;
+						break;
+					}
+					if (strcmp(arg, "--stats") == 0) {
+						stats |= STATS_SUMMARY;
+						break;
+					}
+					if (strncmp(arg, "--stats=", 8) == 0) {
+						stats |= STATS_SUMMARY;
+						statsfile = arg + 8;
+						break;
+					}
+					if (strncmp(arg, "--trace=", 8) == 0) {
+						tracefile = arg + 8;
+						break;
+					}
+					if (strncmp(arg, "--log=", 6) == 0) {
+						if (!log_open(arg + 6)) {
+							return EXIT_FAILURE;
+						}
+						break;
+					}
+					if (strcmp(arg, "--hashthread") == 0) {
+						hashthread = 1;
+						break;
+					}
 					if (strcmp(arg, "--depends") == 0) {
 						depends = 1;
 						break;
 					}
 				default:
-					printf("Unknown option %s \n", argv[i]);
+					print_err(0, "Unknown option %s \n", argv[i]);
 					return EXIT_FAILURE;
 			}
+		} else if (arg[0] == '@') {
+			if (!tfsavcodec_addlistfile(arg + 1, mode)) {
+				return EXIT_FAILURE;
+			}
 		} else {
-			filename = memory_strdup(argv[i]);
+			tfsavcodec_addjob(memory_strdup(arg), mode);
 		}
 	}
 
-	if (extract == 1) {
-		if (filename == NULL) {
-			printf("Missing filename \n");
+	// After the options, so -q and --log apply to it
+	print(0, TOOLINFO "\n");
+	print(0, "Copyright (c) 2013-2016 Oskar Eisemuth\n");
+	print(0, "%s", sep);
+	print(0, "LZ4 Library, Copyright (c) 2011-2015, Yann Collet\n"
+"All rights reserved.\n"
+	);
+	print(0, "%s", sep);
+	print(0, "\n");
+	
+	if (servepath != NULL) {
+		if (!tfsavcodec_start()) {
+			return EXIT_FAILURE;
+		}
+		return tfsavcodec_finish(tfsavserve_run(servepath, workers));
+	}
+	if (numsetfields > 0) {
+		if (numjobs != 1 || extract == 1 || import != 0) {
+			print_err(0, "--set needs a savegame filename and can't be combined with -x or -c\n");
+			return EXIT_FAILURE;
+		}
+		if (!tfsavcodec_start()) {
 			return EXIT_FAILURE;
 		}
-		tfsavegame_readCompressed(filename);
+		return tfsavcodec_finish(tfsavegame_patchCompressed(jobs[0].input) ? EXIT_SUCCESS : EXIT_FAILURE);
 	}
-	if(import == 2) {
-		tfsavegame_writeCompressed(directory);
-	} 
 	
 	if (extract == 0 && import == 0) {
 		usage(argv[0]);
+		return EXIT_SUCCESS;
 	}
-
-	return EXIT_SUCCESS;
+	int numcompress = 0;
+	for (i = 0; i < numjobs; i++) {
+		if (jobs[i].mode == 0) {
+			jobs[i].mode = extract ? JOB_EXTRACT : JOB_COMPRESS;
+		}
+		if (jobs[i].mode == JOB_COMPRESS) {
+			numcompress++;
+		}
+	}
+	if (numjobs == 0) {
+		print_err(0, "Missing filename \n");
+		return EXIT_FAILURE;
+	}
+	if (stdio && (numjobs != 1 || referencefile != NULL)) {
+		print_err(0, "- can't be combined with other files or --ref\n");
+		return EXIT_FAILURE;
+	}
+	if (referencefile != NULL && numcompress > 1) {
+		print_err(0, "--ref can only be used with a single directory\n");
+		return EXIT_FAILURE;
+	}
+	tfsavcodec_expandjobs();
+	if (!tfsavcodec_start()) {
+		return EXIT_FAILURE;
+	}
+	
+	int failed = tfsavcodec_runjobs();
+	return tfsavcodec_finish(failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
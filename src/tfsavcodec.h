@@ -0,0 +1,26 @@
+/*
+ * This file is part of tfsavcodec.
+ * 
+ * Copyright (c) 2016, Oskar Eisemuth
+ * 
+ * For the full copyright and license information,
+ * please view the LICENSE file that was distributed with this source code.
+ * 
+ */
+
+#ifndef TFSAVCODEC_H
+#define TFSAVCODEC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdbool.h>
+
+bool tfsavegame_readCompressed(char *filename);
+bool tfsavegame_writeCompressed(char* directory);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TFSAVCODEC_H */
@@ -15,6 +15,7 @@
 #include <stdarg.h>
 #include <strings.h>
 #include <string.h>
+#include <errno.h>
 
 #include <stdbool.h>
 
@@ -23,18 +24,25 @@
 #include "filefunc.h"
 
 #include "tfsavegamestruct.h"
+#include "tfsavegame.h"
+#include "threadpool.h"
+#include "stats.h"
 
-extern int verbose;
+int sectionformat = TFSECTION_FORMAT_JSON;
 
 
 #define OBJSTRUCT_READER(type)						\
 type* type##_read(FILE* fd) {						\
-	if(verbose > 20) print(0, "Reading " #type ":\n");		\
+	print_dump(0, "Reading " #type ":\n");				\
 	type* obj = type##_new();					\
 									\
-	type##_unserialize(fd, obj);					\
+	if (!type##_unserialize(fd, obj)) {				\
+		print_err(0, "Can't read " #type "\n");		\
+		type##_free(obj);					\
+		return NULL;						\
+	}								\
 									\
-	if (verbose > 20) {						\
+	if (log_enabled(LOG_DUMP)) {					\
 		type##_dump(obj, 1);					\
 	}								\
 	return obj;							\
@@ -43,8 +51,8 @@ type* type##_read(FILE* fd) {						\
 
 #define OBJSTRUCT_WRITER(type)						\
 void type##_write(FILE* fd, type* obj) {				\
-	if(verbose > 20) print(0, "Writing " #type ":\n");		\
-	if (verbose > 20) {						\
+	print_dump(0, "Writing " #type ":\n");				\
+	if (log_enabled(LOG_DUMP)) {					\
 		type##_dump(obj, 1);					\
 	}								\
 	type##_serialize(fd, obj);					\
@@ -53,40 +61,56 @@ void type##_write(FILE* fd, type* obj) {				\
 
 
 OBJSTRUCT_CONSTRUCT(TFModDisplayString)
+OBJSTRUCT_RELEASE_FUNC(TFModDisplayString)
 OBJSTRUCT_DUMP_FUNC(TFModDisplayString)
 OBJSTRUCT_UNSERIALIZE_FUNC(TFModDisplayString)
 OBJSTRUCT_SERIALIZE_FUNC(TFModDisplayString)
+OBJSTRUCT_SIZE_FUNC(TFModDisplayString)
 OBJSTRUCT_NSON_EXPORT_FUNC(TFModDisplayString)
 OBJSTRUCT_NSON_IMPORT_FUNC(TFModDisplayString)
+OBJSTRUCT_NSON_PULL_FUNC(TFModDisplayString)
+OBJSTRUCT_SKIP_FUNC(TFModDisplayString)
 
 
 
 OBJSTRUCT_CONSTRUCT(TFHeader)
+OBJSTRUCT_RELEASE_FUNC(TFHeader)
 OBJSTRUCT_DUMP_FUNC(TFHeader)
 OBJSTRUCT_UNSERIALIZE_FUNC(TFHeader)
 OBJSTRUCT_SERIALIZE_FUNC(TFHeader)
+OBJSTRUCT_SIZE_FUNC(TFHeader)
 OBJSTRUCT_NSON_EXPORT_FUNC(TFHeader)
 OBJSTRUCT_NSON_IMPORT_FUNC(TFHeader)
+OBJSTRUCT_NSON_PULL_FUNC(TFHeader)
+OBJSTRUCT_SKIP_FUNC(TFHeader)
+OBJSTRUCT_NSON_IMPORT_FILE_FUNC(TFHeader)
+OBJSTRUCT_LOCATE_FUNC(TFHeader)
 
 
 OBJSTRUCT_WRITER(TFHeader)
 
 TFHeader* TFHeader_read(FILE* fd) {
-	if(verbose > 20) print(0, "Reading TFHeader:\n");
+	print_dump(0, "Reading TFHeader:\n");
 	TFHeader* obj = NULL;
 	obj = TFHeader_new();
 	
-	TFHeader_unserialize(fd, obj);
+	if (!TFHeader_unserialize(fd, obj)) {
+		print_err(0, "Can't read TFHeader\n");
+		TFHeader_free(obj);
+		return NULL;
+	}
 	
 	if (memcmp(obj->signature, "tf**", 4) != 0) {
 		print_err(1, "TF signature not found, are you sure the file is a valid savegame?");
+		TFHeader_free(obj);
 		return NULL;
 	}
 	if (obj->savegameversion != TFSAVEGAMEVERSION) {
 		print_warn(1, "Expected savegame version %u, forund %u", TFSAVEGAMEVERSION, obj->savegameversion);
+		TFHeader_free(obj);
 		return NULL;
 	}
-	if (verbose > 20) {
+	if (log_enabled(LOG_DUMP)) {
 		TFHeader_dump(obj, 1);
 	}
 	return obj;
@@ -95,18 +119,27 @@ TFHeader* TFHeader_read(FILE* fd) {
 
 
 OBJSTRUCT_CONSTRUCT(TFModEntry)
+OBJSTRUCT_RELEASE_FUNC(TFModEntry)
 OBJSTRUCT_DUMP_FUNC(TFModEntry)
 OBJSTRUCT_UNSERIALIZE_FUNC(TFModEntry)
 OBJSTRUCT_SERIALIZE_FUNC(TFModEntry)
+OBJSTRUCT_SIZE_FUNC(TFModEntry)
 OBJSTRUCT_NSON_EXPORT_FUNC(TFModEntry)
 OBJSTRUCT_NSON_IMPORT_FUNC(TFModEntry)
+OBJSTRUCT_NSON_PULL_FUNC(TFModEntry)
+OBJSTRUCT_SKIP_FUNC(TFModEntry)
 
 OBJSTRUCT_CONSTRUCT(TFMods)
+OBJSTRUCT_RELEASE_FUNC(TFMods)
 OBJSTRUCT_DUMP_FUNC(TFMods)
 OBJSTRUCT_UNSERIALIZE_FUNC(TFMods)
 OBJSTRUCT_SERIALIZE_FUNC(TFMods)
+OBJSTRUCT_SIZE_FUNC(TFMods)
 OBJSTRUCT_NSON_EXPORT_FUNC(TFMods)
 OBJSTRUCT_NSON_IMPORT_FUNC(TFMods)
+OBJSTRUCT_NSON_PULL_FUNC(TFMods)
+OBJSTRUCT_SKIP_FUNC(TFMods)
+OBJSTRUCT_NSON_IMPORT_FILE_FUNC(TFMods)
 
 
 OBJSTRUCT_READER(TFMods)
@@ -117,29 +150,43 @@ OBJSTRUCT_WRITER(TFMods)
 
 
 OBJSTRUCT_CONSTRUCT(TFKeyValueString)
+OBJSTRUCT_RELEASE_FUNC(TFKeyValueString)
 OBJSTRUCT_DUMP_FUNC(TFKeyValueString)
 OBJSTRUCT_UNSERIALIZE_FUNC(TFKeyValueString)
 OBJSTRUCT_SERIALIZE_FUNC(TFKeyValueString)
+OBJSTRUCT_SIZE_FUNC(TFKeyValueString)
 OBJSTRUCT_NSON_EXPORT_FUNC(TFKeyValueString)
 OBJSTRUCT_NSON_IMPORT_FUNC(TFKeyValueString)
+OBJSTRUCT_NSON_PULL_FUNC(TFKeyValueString)
+OBJSTRUCT_SKIP_FUNC(TFKeyValueString)
 
 OBJSTRUCT_CONSTRUCT(TFSettingsConfig)
+OBJSTRUCT_RELEASE_FUNC(TFSettingsConfig)
 OBJSTRUCT_DUMP_FUNC(TFSettingsConfig)
 OBJSTRUCT_UNSERIALIZE_FUNC(TFSettingsConfig)
 OBJSTRUCT_SERIALIZE_FUNC(TFSettingsConfig)
+OBJSTRUCT_SIZE_FUNC(TFSettingsConfig)
 OBJSTRUCT_NSON_EXPORT_FUNC(TFSettingsConfig)
 OBJSTRUCT_NSON_IMPORT_FUNC(TFSettingsConfig)
+OBJSTRUCT_NSON_PULL_FUNC(TFSettingsConfig)
+OBJSTRUCT_SKIP_FUNC(TFSettingsConfig)
+OBJSTRUCT_NSON_IMPORT_FILE_FUNC(TFSettingsConfig)
 
 OBJSTRUCT_READER(TFSettingsConfig)
 OBJSTRUCT_WRITER(TFSettingsConfig)
 
 
 OBJSTRUCT_CONSTRUCT(TFAfterSettings)
+OBJSTRUCT_RELEASE_FUNC(TFAfterSettings)
 OBJSTRUCT_DUMP_FUNC(TFAfterSettings)
 OBJSTRUCT_UNSERIALIZE_FUNC(TFAfterSettings)
 OBJSTRUCT_SERIALIZE_FUNC(TFAfterSettings)
+OBJSTRUCT_SIZE_FUNC(TFAfterSettings)
 OBJSTRUCT_NSON_EXPORT_FUNC(TFAfterSettings)
 OBJSTRUCT_NSON_IMPORT_FUNC(TFAfterSettings)
+OBJSTRUCT_NSON_PULL_FUNC(TFAfterSettings)
+OBJSTRUCT_SKIP_FUNC(TFAfterSettings)
+OBJSTRUCT_NSON_IMPORT_FILE_FUNC(TFAfterSettings)
 
 OBJSTRUCT_READER(TFAfterSettings)
 OBJSTRUCT_WRITER(TFAfterSettings)
@@ -150,19 +197,28 @@ OBJSTRUCT_WRITER(TFAfterSettings)
 
 
 OBJSTRUCT_CONSTRUCT(TFModelRepEntry)
+OBJSTRUCT_RELEASE_FUNC(TFModelRepEntry)
 OBJSTRUCT_DUMP_FUNC(TFModelRepEntry)
 OBJSTRUCT_UNSERIALIZE_FUNC(TFModelRepEntry)
 OBJSTRUCT_SERIALIZE_FUNC(TFModelRepEntry)
+OBJSTRUCT_SIZE_FUNC(TFModelRepEntry)
 OBJSTRUCT_NSON_EXPORT_FUNC(TFModelRepEntry)
 OBJSTRUCT_NSON_IMPORT_FUNC(TFModelRepEntry)
+OBJSTRUCT_NSON_PULL_FUNC(TFModelRepEntry)
+OBJSTRUCT_SKIP_FUNC(TFModelRepEntry)
 
 
 OBJSTRUCT_CONSTRUCT(TFModelRep)
+OBJSTRUCT_RELEASE_FUNC(TFModelRep)
 OBJSTRUCT_DUMP_FUNC(TFModelRep)
 OBJSTRUCT_UNSERIALIZE_FUNC(TFModelRep)
 OBJSTRUCT_SERIALIZE_FUNC(TFModelRep)
+OBJSTRUCT_SIZE_FUNC(TFModelRep)
 OBJSTRUCT_NSON_EXPORT_FUNC(TFModelRep)
 OBJSTRUCT_NSON_IMPORT_FUNC(TFModelRep)
+OBJSTRUCT_NSON_PULL_FUNC(TFModelRep)
+OBJSTRUCT_SKIP_FUNC(TFModelRep)
+OBJSTRUCT_NSON_IMPORT_FILE_FUNC(TFModelRep)
 
 OBJSTRUCT_READER(TFModelRep)
 OBJSTRUCT_WRITER(TFModelRep)
@@ -180,86 +236,397 @@ TFHeader* TFHeader_VARImport(TFHeader* obj, VAR* variable) {
 
 
 
-void tfsavegame_read(FILE *fd, char* filename, char *outputdir) {
+// Size of a written section file, only needed for --stats
+static size_t tfsavegame_filesize(const char* filename) {
+	if (!stats) {
+		return 0;
+	}
+	FILE* fd = fopen(filename, "rb");
+	if (fd == NULL) {
+		return 0;
+	}
+	size_t size = file_size(fd);
+	fclose(fd);
+	return size;
+}
+
+// written gets the size of the file with --stats, 0 otherwise
+bool tfsavegame_export_section(VAR* v, FILEPATH* ff, char* name, size_t* written) {
+	int ok;
+	if (sectionformat == TFSECTION_FORMAT_BIN) {
+		filepath_filename_printf(ff, "%s.bin", name);
+		ok = var_export_binary_file(v, ff->filepath);
+	} else {
+		filepath_filename_printf(ff, "%s.json", name);
+		ok = var_export_file(v, ff->filepath);
+	}
+	var_free(v);
+	*written = tfsavegame_filesize(ff->filepath);
+	return ok;
+}
+
+
+typedef struct tfsavegame_task tfsavegame_task;
+struct tfsavegame_task {
+	void* obj;
+	FILEPATH* ff;
+	char* name;
+	const char* phase;	// for --stats
+	FILE* fd;
+	size_t len;
+	bool ok;
+};
+
+#define OBJSTRUCT_EXPORT_TASK(type)						\
+void type##_export_task(void* arg) {						\
+	tfsavegame_task* task = arg;						\
+	STATS_TIMER timer;							\
+	stats_start(&timer);							\
+	size_t written;								\
+	task->ok = tfsavegame_export_section(type##_noson_export(task->obj), task->ff, task->name, &written);	\
+	stats_stop(&timer, task->phase, type##_size(task->obj), written);	\
+	filepath_free(task->ff);						\
+}
+
+OBJSTRUCT_EXPORT_TASK(TFHeader)
+OBJSTRUCT_EXPORT_TASK(TFMods)
+OBJSTRUCT_EXPORT_TASK(TFSettingsConfig)
+OBJSTRUCT_EXPORT_TASK(TFAfterSettings)
+OBJSTRUCT_EXPORT_TASK(TFModelRep)
+
+void tfsavegame_remaining_task(void* arg) {
+	tfsavegame_task* task = arg;
+	STATS_TIMER timer;
+	stats_start(&timer);
+	FILE* fdremaining = file_open_write(task->ff->filepath);
+	if (fdremaining != NULL) {
+		task->ok = file_copy_bytes(task->fd, fdremaining, task->len);
+		if (fclose(fdremaining) != 0) {
+			task->ok = false;
+		}
+	}
+	stats_stop(&timer, "copy remaining", task->len, task->len);
+	filepath_free(task->ff);
+}
+
+/*
+ * Sections run as tasks on the pool of the calling worker, so batch jobs
+ * and their block tasks share one pool. Only a caller outside of any pool
+ * gets a private one with at most threads workers, freed through ownpool.
+ */
+static THREADPOOL* tfsavegame_pool(int threads, THREADPOOL** ownpool) {
+	THREADPOOL* pool = threadpool_current();
+	*ownpool = NULL;
+	if (pool == NULL) {
+		pool = *ownpool = threadpool_create(threadpool_cpucount() < threads ? threadpool_cpucount() : threads);
+	}
+	return pool;
+}
+
+#define tfsavegame_submit_export(pool, group, task, type, object, ff, section)	\
+	task.obj = object;							\
+	task.ff = filepath_clone(ff);						\
+	task.name = section;							\
+	task.phase = "export " section;						\
+	threadpool_group_submit(pool, group, type##_export_task, &task);
+
+
+/*
+ * Writes the sections of the uncompressed savegame in fd to outputdir,
+ * false if it can't be parsed or any output fails. fd stays open.
+ */
+bool tfsavegame_read(FILE *fd, char* filename, char *outputdir) {
+	tfsavegame_task tasks[6];
+	STATS_TIMER timer;
 	TFHeader* tf_header = NULL;
+	TFMods* tf_mods = NULL;
+	TFSettingsConfig* tf_sconfig = NULL;
+	TFAfterSettings* tf_aftersettings = NULL;
+	TFModelRep* tf_modelrep = NULL;
+	bool ok = false;
+	
+	stats_start(&timer);
 	tf_header = TFHeader_read(fd);
 	if (!tf_header) {
 		print_err(0, "Can't read header\n");
-		fclose(fd);
-		exit(-1);
+		return false;
 	}
+	size_t pos = ftell(fd);
+	stats_stop(&timer, "parse header", pos, 0);
 	
-	TFMods* tf_mods = TFMods_read(fd);
-	TFSettingsConfig* tf_sconfig = TFSettingsConfig_read(fd);
-	TFAfterSettings* tf_aftersettings = TFAfterSettings_read(fd);
-	TFModelRep* tf_modelrep = TFModelRep_read(fd);
-	
+	tf_mods = TFMods_read(fd);
+	stats_stop(&timer, "parse mods", ftell(fd) - pos, 0);
+	pos = ftell(fd);
+	if (tf_mods) {
+		tf_sconfig = TFSettingsConfig_read(fd);
+		stats_stop(&timer, "parse settings", ftell(fd) - pos, 0);
+		pos = ftell(fd);
+	}
+	if (tf_sconfig) {
+		tf_aftersettings = TFAfterSettings_read(fd);
+		stats_stop(&timer, "parse aftersettings", ftell(fd) - pos, 0);
+		pos = ftell(fd);
+	}
+	if (tf_aftersettings) {
+		tf_modelrep = TFModelRep_read(fd);
+		stats_stop(&timer, "parse modelrep", ftell(fd) - pos, 0);
+	}
+	if (!tf_modelrep) {
+		print_err(0, "Can't parse %s\n", filename);
+		goto cleanup;
+	}
 	
 	FILEPATH *ff = filepath_new();
 	filepath_relpath(ff, outputdir);
-	filepath_filename(ff, "header.json");
-	VAR* var_header = TFHeader_noson_export(tf_header);
-	var_export_file(var_header, ff->filepath);
-	
-	filepath_filename(ff, "mods.json");
-	VAR* var_tf_mods = TFMods_noson_export(tf_mods);
-	var_export_file(var_tf_mods, ff->filepath);
-	
-	filepath_filename(ff, "settings.json");
-	VAR* var_tf_sconfig = TFSettingsConfig_noson_export(tf_sconfig);
-	var_export_file(var_tf_sconfig, ff->filepath);
-	
-	
-	filepath_filename(ff, "aftersettings.json");
-	VAR* var_tf_aftersettings = TFAfterSettings_noson_export(tf_aftersettings);
-	var_export_file(var_tf_aftersettings, ff->filepath);
-	
-	filepath_filename(ff, "modelrep.json");
-	VAR* var_tf_modelrep = TFModelRep_noson_export(tf_modelrep);
-	var_export_file(var_tf_modelrep, ff->filepath);
-	
-	
-	
-	filepath_filename(ff, "remaining.data");
-	FILE* fdremaining = file_open_write(ff->filepath);
 	
 	size_t currentPos = ftell(fd);
 	fseek(fd, 0, SEEK_END);
 	size_t remaininglen = ftell(fd) - currentPos;
 	fseek(fd, currentPos, SEEK_SET);
 	
-	file_copy_bytes(fd, fdremaining, remaininglen);
-	fclose(fdremaining);
+	// parsing is done, every output only depends on its own struct
+	THREADPOOL* ownpool = NULL;
+	THREADPOOL* pool = tfsavegame_pool(6, &ownpool);
+	THREADPOOL_GROUP group = {0};
+	memset(tasks, 0, sizeof(tasks));
+	
+	filepath_filename(ff, "remaining.data");
+	tasks[0].ff = filepath_clone(ff);
+	tasks[0].fd = fd;
+	tasks[0].len = remaininglen;
+	threadpool_group_submit(pool, &group, tfsavegame_remaining_task, &tasks[0]);
+	
+	tfsavegame_submit_export(pool, &group, tasks[1], TFModelRep, tf_modelrep, ff, "modelrep")
+	tfsavegame_submit_export(pool, &group, tasks[2], TFHeader, tf_header, ff, "header")
+	tfsavegame_submit_export(pool, &group, tasks[3], TFMods, tf_mods, ff, "mods")
+	tfsavegame_submit_export(pool, &group, tasks[4], TFSettingsConfig, tf_sconfig, ff, "settings")
+	tfsavegame_submit_export(pool, &group, tasks[5], TFAfterSettings, tf_aftersettings, ff, "aftersettings")
+	
+	threadpool_group_wait(pool, &group);
+	threadpool_free(ownpool);
 	
 	filepath_free(ff);
+	ok = true;
+	for (int i = 0; i < 6; i++) {
+		ok = ok && tasks[i].ok;
+	}
+	
+cleanup:
+	TFModelRep_free(tf_modelrep);
+	TFHeader_free(tf_header);
+	TFMods_free(tf_mods);
+	TFSettingsConfig_free(tf_sconfig);
+	TFAfterSettings_free(tf_aftersettings);
+	return ok;
 }
 
 
 
 
 
-#define tfsavegame_write_type(type, ff, filename)			\
-	filepath_filename(ff, filename);				\
-	VAR *var_##type = var_import_file(ff->filepath);		\
-	type* tf_##type = type##_noson_import(NULL, var_##type);	\
-	type##_write(fd, tf_##type);				 
+#define OBJSTRUCT_IMPORT_TASK(type)						\
+type* type##_import_section(FILEPATH* ff, char* name) {				\
+	if (sectionformat == TFSECTION_FORMAT_BIN) {				\
+		filepath_filename_printf(ff, "%s.bin", name);			\
+		VAR* v = var_import_binary_file(ff->filepath);			\
+		type* obj = type##_noson_import(NULL, v);			\
+		var_free(v);							\
+		return obj;							\
+	}									\
+	filepath_filename_printf(ff, "%s.json", name);				\
+	return type##_noson_import_file(ff->filepath);				\
+}										\
+void type##_import_task(void* arg) {						\
+	tfsavegame_task* task = arg;						\
+	STATS_TIMER timer;							\
+	stats_start(&timer);							\
+	task->obj = type##_import_section(task->ff, task->name);		\
+	stats_stop(&timer, task->phase, tfsavegame_filesize(task->ff->filepath),	\
+		task->obj ? type##_size(task->obj) : 0);			\
+	filepath_free(task->ff);						\
+}
+
+OBJSTRUCT_IMPORT_TASK(TFHeader)
+OBJSTRUCT_IMPORT_TASK(TFMods)
+OBJSTRUCT_IMPORT_TASK(TFSettingsConfig)
+OBJSTRUCT_IMPORT_TASK(TFAfterSettings)
+OBJSTRUCT_IMPORT_TASK(TFModelRep)
+
+// copies remaining.data behind the sections through a second handle
+void tfsavegame_remaining_write_task(void* arg) {
+	tfsavegame_task* task = arg;
+	STATS_TIMER timer;
+	size_t len = 0;
+	stats_start(&timer);
+	FILE* fdout = fopen(task->name, "r+b");
+	if (fdout == NULL) {
+		print_err(0, "Opening file %s, %s\n", task->name, strerror(errno));
+		filepath_free(task->ff);
+		return;
+	}
+	fseek(fdout, task->len, SEEK_SET);
+	FILE* fdremaining = file_open_read(task->ff->filepath);
+	if (fdremaining != NULL) {
+		len = file_size(fdremaining);
+		task->ok = file_copy_bytes(fdremaining, fdout, len);
+		fclose(fdremaining);
+	}
+	if (fclose(fdout) != 0) {
+		task->ok = false;
+	}
+	stats_stop(&timer, "copy remaining", len, len);
+	filepath_free(task->ff);
+}
+
+#define tfsavegame_submit_import(pool, group, task, type, ff, section)	\
+	task.ff = filepath_clone(ff);						\
+	task.name = section;							\
+	task.phase = "import " section;						\
+	threadpool_group_submit(pool, group, type##_import_task, &task);
 
 
-void tfsavegame_write(FILE *fd, char *sourcedir) {
+/*
+ * Writes an uncompressed savegame from the sections in sourcedir,
+ * false if any section can't be imported or the file can't be written
+ */
+bool tfsavegame_write(char* outfilename, char *sourcedir) {
+	tfsavegame_task tasks[6];
+	bool ok = false;
 	FILEPATH *ff = filepath_new();
 	filepath_relpath(ff, sourcedir);
 	
+	THREADPOOL* ownpool = NULL;
+	THREADPOOL* pool = tfsavegame_pool(5, &ownpool);
+	THREADPOOL_GROUP group = {0};
+	memset(tasks, 0, sizeof(tasks));
+	
+	tfsavegame_submit_import(pool, &group, tasks[0], TFModelRep, ff, "modelrep")
+	tfsavegame_submit_import(pool, &group, tasks[1], TFHeader, ff, "header")
+	tfsavegame_submit_import(pool, &group, tasks[2], TFMods, ff, "mods")
+	tfsavegame_submit_import(pool, &group, tasks[3], TFSettingsConfig, ff, "settings")
+	tfsavegame_submit_import(pool, &group, tasks[4], TFAfterSettings, ff, "aftersettings")
+	threadpool_group_wait(pool, &group);
+	
+	TFModelRep* tf_modelrep = tasks[0].obj;
+	TFHeader* tf_header = tasks[1].obj;
+	TFMods* tf_mods = tasks[2].obj;
+	TFSettingsConfig* tf_sconfig = tasks[3].obj;
+	TFAfterSettings* tf_aftersettings = tasks[4].obj;
+	
+	if (!tf_header || !tf_mods || !tf_sconfig || !tf_aftersettings || !tf_modelrep) {
+		print_err(0, "Can't import sections from %s\n", sourcedir);
+		goto cleanup;
+	}
+	
+	size_t offset = TFHeader_size(tf_header) + TFMods_size(tf_mods) + TFSettingsConfig_size(tf_sconfig) 
+			+ TFAfterSettings_size(tf_aftersettings) + TFModelRep_size(tf_modelrep);
 	
-	tfsavegame_write_type(TFHeader, ff, "header.json")
-	tfsavegame_write_type(TFMods, ff, "mods.json")
-	tfsavegame_write_type(TFSettingsConfig, ff, "settings.json")
-	tfsavegame_write_type(TFAfterSettings, ff, "aftersettings.json")
-	tfsavegame_write_type(TFModelRep, ff, "modelrep.json")
+	FILE* fd = file_open_write(outfilename);
+	if (fd == NULL) {
+		goto cleanup;
+	}
+	STATS_TIMER timer;
+	stats_start(&timer);
 	
-		
 	filepath_filename(ff, "remaining.data");
-	FILE* fdremaining = file_open_read(ff->filepath);
-	size_t remaininglen = file_size(fdremaining);
-	file_copy_bytes(fdremaining, fd, remaininglen);
+	tasks[5].ff = filepath_clone(ff);
+	tasks[5].name = outfilename;
+	tasks[5].len = offset;
+	threadpool_group_submit(pool, &group, tfsavegame_remaining_write_task, &tasks[5]);
+	
+	TFHeader_write(fd, tf_header);
+	TFMods_write(fd, tf_mods);
+	TFSettingsConfig_write(fd, tf_sconfig);
+	TFAfterSettings_write(fd, tf_aftersettings);
+	TFModelRep_write(fd, tf_modelrep);
+	fflush(fd);
+	ok = true;
+	if (ftell(fd) != offset) {
+		print_err(0, "Sections written with %ld bytes, expected %zu\n", ftell(fd), offset);
+		ok = false;
+	}
+	stats_stop(&timer, "write sections", offset, offset);
+	
+	threadpool_group_wait(pool, &group);
+	if (fclose(fd) != 0 || !tasks[5].ok) {
+		ok = false;
+	}
+	
+cleanup:
+	threadpool_free(ownpool);
 	filepath_free(ff);
-}
\ No newline at end of file
+	TFModelRep_free(tf_modelrep);
+	TFHeader_free(tf_header);
+	TFMods_free(tf_mods);
+	TFSettingsConfig_free(tf_sconfig);
+	TFAfterSettings_free(tf_aftersettings);
+	return ok;
+}
+
+
+/*
+ * Resolves "section.member" to the position of the member inside the
+ * uncompressed savegame. Only the header starts at a fixed offset, so only
+ * header members in front of the mod list can be located.
+ */
+bool tfsavegame_locate(const char* path, size_t* offset, size_t* width, bool* issigned) {
+	if (strncmp(path, "header.", 7) == 0) {
+		return TFHeader_locate(path + 7, offset, width, issigned);
+	}
+	return false;
+}
+
+/*
+ * Parses value for a field of the given width and stores it little endian
+ */
+bool tfsavegame_parsefield(const char* value, size_t width, bool issigned, uint8_t* out) {
+	char* end = NULL;
+	uint64_t raw;
+	errno = 0;
+	if (issigned) {
+		int64_t v = strtoll(value, &end, 0);
+		int64_t max = width >= 8 ? INT64_MAX : (((int64_t)1 << (width*8 - 1)) - 1);
+		if (v > max || v < -max - 1) {
+			return false;
+		}
+		raw = (uint64_t)v;
+	} else {
+		if (value[0] == '-') {
+			return false;
+		}
+		raw = strtoull(value, &end, 0);
+		if (width < 8 && raw >> (width*8)) {
+			return false;
+		}
+	}
+	if (errno != 0 || end == value || *end != 0) {
+		return false;
+	}
+	for (size_t i = 0; i < width; i++) {
+		out[i] = (uint8_t)(raw >> (i*8));
+	}
+	return true;
+}
+
+/*
+ * Finds where the sections of an uncompressed savegame start, offsets gets
+ * TFSAVEGAME_SECTIONS + 1 entries: header, mods, settings, aftersettings,
+ * modelrep, remaining data and the end. Returns false if the sections
+ * don't fit into the data.
+ */
+bool tfsavegame_sections(const void* data, size_t len, size_t* offsets) {
+	size_t pos = 0;
+	offsets[0] = 0;
+	if (!TFHeader_skip(data, len, &pos)) return false;
+	offsets[1] = pos;
+	if (!TFMods_skip(data, len, &pos)) return false;
+	offsets[2] = pos;
+	if (!TFSettingsConfig_skip(data, len, &pos)) return false;
+	offsets[3] = pos;
+	if (!TFAfterSettings_skip(data, len, &pos)) return false;
+	offsets[4] = pos;
+	if (!TFModelRep_skip(data, len, &pos)) return false;
+	offsets[5] = pos;
+	offsets[6] = len;
+	return true;
+}
@@ -15,8 +15,16 @@
 extern "C" {
 #endif
 
-void tfsavegame_read(FILE *fd, char* filename, char *outputdir);
-void tfsavegame_write(FILE *fd, char *sourcedir);
+#define TFSECTION_FORMAT_JSON 0
+#define TFSECTION_FORMAT_BIN 1
+
+#define TFSAVEGAME_SECTIONS 6
+
+bool tfsavegame_read(FILE *fd, char* filename, char *outputdir);
+bool tfsavegame_write(char* outfilename, char *sourcedir);
+bool tfsavegame_locate(const char* path, size_t* offset, size_t* width, bool* issigned);
+bool tfsavegame_parsefield(const char* value, size_t width, bool issigned, uint8_t* out);
+bool tfsavegame_sections(const void* data, size_t len, size_t* offsets);
 
 
 
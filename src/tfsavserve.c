@@ -0,0 +1,560 @@
+/*
+ * This file is part of tfsavcodec.
+ *
+ * Copyright (c) 2016, Oskar Eisemuth
+ *
+ * For the full copyright and license information,
+ * please view the LICENSE file that was distributed with this source code.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <stdbool.h>
+
+#include "misc.h"
+#include "tfsavserve.h"
+
+#if defined(_WIN32)
+
+int tfsavserve_run(const char* socketpath, int workers) {
+	print_err(0, "--serve needs unix sockets and isn't available on Windows\n");
+	return EXIT_FAILURE;
+}
+
+#else
+
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "memfunc.h"
+#include "filefunc.h"
+#include "threadpool.h"
+#include "libtfsav.h"
+#include "libtfsavinternal.h"
+#include "tfsavegame.h"
+#include "tfsavcodec.h"
+
+/*
+ * The client sends one request per line, "<command> [argument]", and may
+ * attach one file descriptor to the line with SCM_RIGHTS. Every request
+ * is answered with one line, "OK <ms> ..." or "ERROR <ms> <message>".
+ *
+ *  info [file]           header fields and section sizes
+ *  verify [file]         decompress and check all checksums
+ *  extract <file>        like -x
+ *  extract <directory>   with a descriptor, extracts the savegame read from it
+ *  compress <directory>  like -c, with a descriptor the savegame is written to it
+ *  shutdown              stops the server once the running jobs are done
+ *
+ * Every connection has a thread of its own that only reads requests and
+ * writes replies. The requests run as tasks on one pool that lives as long
+ * as the server, so an idle client never holds a worker and the workers
+ * and their LZ4 contexts stay warm between jobs.
+ */
+
+#define SERVE_LINEMAX 4096
+#define SERVE_MESSAGEMAX 1024
+// Status, time and message
+#define SERVE_REPLYMAX (SERVE_MESSAGEMAX + 64)
+#define SERVE_MAXFDS 4
+#define SERVE_MAXCONNS 64
+
+typedef struct tfsavserve_conn tfsavserve_conn;
+struct tfsavserve_conn {
+	int sock;
+	char line[SERVE_LINEMAX];
+	size_t linelen;
+	int fds[SERVE_MAXFDS];		// received descriptors, taken by the lines in order
+	int numfds;
+};
+
+// One request on the pool, the connection thread waits for done
+typedef struct tfsavserve_job tfsavserve_job;
+struct tfsavserve_job {
+	char* line;
+	int fd;
+	char* reply;
+	size_t replylen;
+	bool done;
+};
+
+static int serveListen = -1;
+static int serveShutdown = 0;
+static THREADPOOL* servePool = NULL;
+static pthread_mutex_t serveLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t serveDone = PTHREAD_COND_INITIALIZER;	// a job or a connection ended
+static int serveConns[SERVE_MAXCONNS];
+static int numServeConns = 0;
+
+static double serve_ms(const struct timespec* start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static bool serve_recv(tfsavserve_conn* conn) {
+	char control[CMSG_SPACE(sizeof(int) * SERVE_MAXFDS)];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr* cmsg;
+
+	iov.iov_base = conn->line + conn->linelen;
+	iov.iov_len = SERVE_LINEMAX - conn->linelen;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t n = recvmsg(conn->sock, &msg, 0);
+	if (n < 0 && errno == EINTR) {
+		return true;
+	}
+	if (n <= 0) {
+		return false;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		int* fds = (int*)CMSG_DATA(cmsg);
+		size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < count; i++) {
+			if (conn->numfds < SERVE_MAXFDS) {
+				conn->fds[conn->numfds++] = fds[i];
+			} else {
+				close(fds[i]);
+			}
+		}
+	}
+	conn->linelen += n;
+	return true;
+}
+
+static void* serve_readfd(int fd, size_t* len) {
+	size_t size = 1 << 20;
+	size_t pos = 0;
+	char* buffer = memory_tryalloc_category(size, MEMORY_OTHER);
+	if (buffer == NULL) {
+		return NULL;
+	}
+	for (;;) {
+		if (pos == size) {
+			char* grown = memory_tryrealloc_category(buffer, size * 2, MEMORY_OTHER);
+			if (grown == NULL) {
+				memory_free(buffer);
+				return NULL;
+			}
+			buffer = grown;
+			size *= 2;
+		}
+		ssize_t n = read(fd, buffer + pos, size - pos);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			memory_free(buffer);
+			return NULL;
+		}
+		if (n == 0) {
+			break;
+		}
+		pos += n;
+	}
+	*len = pos;
+	return buffer;
+}
+
+static bool serve_writefd(int fd, const void* data, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		data = (const char*)data + n;
+		len -= n;
+	}
+	return true;
+}
+
+static TFSAV_RESULT serve_open(const char* arg, int fd, TFSAV** sav) {
+	if (fd < 0) {
+		if (arg == NULL) {
+			return TFSAV_ERROR_ARGUMENT;
+		}
+		return tfsav_open_file(arg, NULL, sav);
+	}
+	size_t len = 0;
+	void* data = serve_readfd(fd, &len);
+	if (data == NULL) {
+		return errno == ENOMEM ? TFSAV_ERROR_MEMORY : TFSAV_ERROR_IO;
+	}
+	// The handle keeps the buffer, no second copy of a big savegame
+	return tfsav_open_owned(data, len, NULL, sav);
+}
+
+static bool serve_info(const char* arg, int fd, char* reply, size_t replylen) {
+	static const char* fields[] = { "savegameversion", "difficulty", "startYear", "numTiles", "date", "money" };
+	char field[64];
+	TFSAV* sav;
+	TFSAV_RESULT result = serve_open(arg, fd, &sav);
+	if (result != TFSAV_OK) {
+		snprintf(reply, replylen, "%s", tfsav_strerror(result));
+		return false;
+	}
+	size_t pos = 0;
+	for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]) && pos < replylen; i++) {
+		int64_t value = 0;
+		snprintf(field, sizeof(field), "header.%s", fields[i]);
+		tfsav_get(sav, field, &value);
+		pos += snprintf(reply + pos, replylen - pos, "%s=%lld ", fields[i], (long long)value);
+	}
+	for (int s = 0; s < TFSAV_SECTION_COUNT && pos < replylen; s++) {
+		const void* data;
+		size_t len;
+		tfsav_section(sav, s, &data, &len);
+		pos += snprintf(reply + pos, replylen - pos, "%s%zu", s ? "," : "sections=", len);
+	}
+	tfsav_close(sav);
+	return true;
+}
+
+static bool serve_verify(const char* arg, int fd, char* reply, size_t replylen) {
+	TFSAV* sav;
+	TFSAV_RESULT result = serve_open(arg, fd, &sav);
+	if (result != TFSAV_OK) {
+		snprintf(reply, replylen, "%s", tfsav_strerror(result));
+		return false;
+	}
+	tfsav_close(sav);
+	return true;
+}
+
+static bool serve_extract(char* arg, int fd, char* reply, size_t replylen) {
+	if (arg == NULL) {
+		snprintf(reply, replylen, "missing file or directory");
+		return false;
+	}
+	if (fd < 0) {
+		if (!tfsavegame_readCompressed(arg)) {
+			snprintf(reply, replylen, "extracting %s failed", arg);
+			return false;
+		}
+		return true;
+	}
+	if (mkdir(arg, 0777) != 0 && errno != EEXIST) {
+		snprintf(reply, replylen, "creating %s, %s", arg, strerror(errno));
+		return false;
+	}
+
+	TFSAV* sav;
+	TFSAV_RESULT result = serve_open(NULL, fd, &sav);
+	if (result != TFSAV_OK) {
+		snprintf(reply, replylen, "%s", tfsav_strerror(result));
+		return false;
+	}
+	const void* content;
+	size_t contentlen;
+	tfsav_content(sav, &content, &contentlen);
+
+	FILEPATH* ff = filepath_new();
+	filepath_basepath(ff, arg);
+	filepath_filename(ff, "uncompressed.data");
+	FILE* fdout = fopen(ff->filepath, "w+b");
+	bool ok = fdout != NULL && fwrite(content, contentlen, 1, fdout) == 1;
+	tfsav_close(sav);
+	if (ok) {
+		fseek(fdout, 0, SEEK_SET);
+		ok = tfsavegame_read(fdout, ff->filepath, arg);
+		if (!ok) {
+			snprintf(reply, replylen, "extracting to %s failed", arg);
+		}
+	} else {
+		snprintf(reply, replylen, "writing %s failed", ff->filepath);
+	}
+	if (fdout != NULL) {
+		fclose(fdout);
+	}
+	filepath_free(ff);
+	return ok;
+}
+
+static bool serve_compress(char* arg, int fd, char* reply, size_t replylen) {
+	if (arg == NULL || !is_dir(arg)) {
+		snprintf(reply, replylen, "missing directory");
+		return false;
+	}
+	if (fd < 0) {
+		if (!tfsavegame_writeCompressed(arg)) {
+			snprintf(reply, replylen, "compressing %s failed", arg);
+			return false;
+		}
+		return true;
+	}
+
+	FILEPATH* ff = filepath_new();
+	filepath_basepath(ff, arg);
+	filepath_filename(ff, "uncompressed.tmp");
+	if (!tfsavegame_write(ff->filepath, arg)) {
+		snprintf(reply, replylen, "can't import sections from %s", arg);
+		filepath_free(ff);
+		return false;
+	}
+
+	TFSAV* sav;
+	void* data = NULL;
+	size_t len = 0;
+	TFSAV_RESULT result = tfsav_open_file(ff->filepath, NULL, &sav);
+	filepath_free(ff);
+	if (result == TFSAV_OK) {
+		result = tfsav_write_buffer(sav, &data, &len);
+		if (result == TFSAV_OK && !serve_writefd(fd, data, len)) {
+			result = TFSAV_ERROR_IO;
+		}
+		tfsav_free(sav, data);
+		tfsav_close(sav);
+	}
+	if (result != TFSAV_OK) {
+		snprintf(reply, replylen, "%s", tfsav_strerror(result));
+		return false;
+	}
+	return true;
+}
+
+static void serve_stop() {
+	pthread_mutex_lock(&serveLock);
+	serveShutdown = 1;
+	shutdown(serveListen, SHUT_RDWR);
+	// Idle connections end, requests in progress still get their answer
+	for (int i = 0; i < numServeConns; i++) {
+		shutdown(serveConns[i], SHUT_RD);
+	}
+	pthread_mutex_unlock(&serveLock);
+}
+
+static void serve_request(char* line, int fd, char* reply, size_t replylen) {
+	char message[SERVE_MESSAGEMAX];
+	struct timespec start;
+	bool ok;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	char* arg = strchr(line, ' ');
+	if (arg != NULL) {
+		*arg++ = 0;
+		if (*arg == 0) {
+			arg = NULL;
+		}
+	}
+	message[0] = 0;
+	if (strcmp(line, "info") == 0) {
+		ok = serve_info(arg, fd, message, sizeof(message));
+	} else if (strcmp(line, "verify") == 0) {
+		ok = serve_verify(arg, fd, message, sizeof(message));
+	} else if (strcmp(line, "extract") == 0) {
+		ok = serve_extract(arg, fd, message, sizeof(message));
+	} else if (strcmp(line, "compress") == 0) {
+		ok = serve_compress(arg, fd, message, sizeof(message));
+	} else if (strcmp(line, "shutdown") == 0) {
+		serve_stop();
+		ok = true;
+	} else {
+		snprintf(message, sizeof(message), "unknown command %.64s", line);
+		ok = false;
+	}
+	if (!ok && message[0] == 0) {
+		snprintf(message, sizeof(message), "%.64s failed", line);
+	}
+	double ms = serve_ms(&start);
+	print(0, "Job %s%s%s: %s, %.1fms\n", line, arg ? " " : "", arg ? arg : "", ok ? "OK" : "ERROR", ms);
+	log_flush();
+	snprintf(reply, replylen, "%s %.1fms%s%.*s\n", ok ? "OK" : "ERROR", ms, message[0] ? " " : "", SERVE_MESSAGEMAX, message);
+}
+
+static void serve_job_task(void* arg) {
+	tfsavserve_job* job = arg;
+	serve_request(job->line, job->fd, job->reply, job->replylen);
+	pthread_mutex_lock(&serveLock);
+	job->done = true;
+	pthread_cond_broadcast(&serveDone);
+	pthread_mutex_unlock(&serveLock);
+}
+
+// Runs one request on the pool, the connection thread only waits
+static void serve_job(char* line, int fd, char* reply, size_t replylen) {
+	tfsavserve_job job;
+	job.line = line;
+	job.fd = fd;
+	job.reply = reply;
+	job.replylen = replylen;
+	job.done = false;
+	threadpool_submit(servePool, serve_job_task, &job);
+	pthread_mutex_lock(&serveLock);
+	while (!job.done) {
+		pthread_cond_wait(&serveDone, &serveLock);
+	}
+	pthread_mutex_unlock(&serveLock);
+}
+
+static void* serve_connection(void* arg) {
+	tfsavserve_conn* conn = arg;
+	char reply[SERVE_REPLYMAX];
+
+	for (;;) {
+		char* newline;
+		while ((newline = memchr(conn->line, '\n', conn->linelen)) == NULL) {
+			if (conn->linelen == SERVE_LINEMAX) {
+				snprintf(reply, sizeof(reply), "ERROR 0.0ms request too long\n");
+				serve_writefd(conn->sock, reply, strlen(reply));
+				goto done;
+			}
+			if (!serve_recv(conn)) {
+				goto done;
+			}
+		}
+		*newline = 0;
+		if (newline > conn->line && newline[-1] == '\r') {
+			newline[-1] = 0;
+		}
+		int fd = -1;
+		if (conn->numfds > 0) {
+			fd = conn->fds[0];
+			memmove(conn->fds, conn->fds + 1, sizeof(int) * --conn->numfds);
+		}
+
+		serve_job(conn->line, fd, reply, sizeof(reply));
+		if (fd >= 0) {
+			close(fd);
+		}
+		if (!serve_writefd(conn->sock, reply, strlen(reply))) {
+			goto done;
+		}
+
+		size_t used = newline - conn->line + 1;
+		memmove(conn->line, newline + 1, conn->linelen - used);
+		conn->linelen -= used;
+	}
+done:
+	for (int i = 0; i < conn->numfds; i++) {
+		close(conn->fds[i]);
+	}
+	int sock = conn->sock;
+	memory_free(conn);
+	// Closed under the lock, so accept can't hand out the number while it is still listed
+	pthread_mutex_lock(&serveLock);
+	for (int i = 0; i < numServeConns; i++) {
+		if (serveConns[i] == sock) {
+			serveConns[i] = serveConns[--numServeConns];
+			break;
+		}
+	}
+	close(sock);
+	pthread_cond_broadcast(&serveDone);
+	pthread_mutex_unlock(&serveLock);
+	return NULL;
+}
+
+int tfsavserve_run(const char* socketpath, int workers) {
+	struct sockaddr_un addr;
+
+	if (strlen(socketpath) >= sizeof(addr.sun_path)) {
+		print_err(0, "Socket path %s is too long\n", socketpath);
+		return EXIT_FAILURE;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socketpath);
+
+	// A client going away must not end the server
+	signal(SIGPIPE, SIG_IGN);
+
+	serveListen = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (serveListen < 0) {
+		print_err(0, "Creating socket, %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	unlink(socketpath);
+	if (bind(serveListen, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(serveListen, 16) != 0) {
+		print_err(0, "Listening on %s, %s\n", socketpath, strerror(errno));
+		close(serveListen);
+		return EXIT_FAILURE;
+	}
+
+	servePool = threadpool_create(workers);
+	print(0, "Serving on %s\n", socketpath);
+	log_flush();
+
+	for (;;) {
+		int sock = accept(serveListen, NULL, NULL);
+		pthread_mutex_lock(&serveLock);
+		if (serveShutdown) {
+			pthread_mutex_unlock(&serveLock);
+			if (sock >= 0) {
+				close(sock);
+			}
+			break;
+		}
+		if (sock < 0) {
+			pthread_mutex_unlock(&serveLock);
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			print_err(0, "Accepting connection, %s\n", strerror(errno));
+			break;
+		}
+		if (numServeConns == SERVE_MAXCONNS) {
+			pthread_mutex_unlock(&serveLock);
+			const char* busy = "ERROR 0.0ms too many connections\n";
+			serve_writefd(sock, busy, strlen(busy));
+			close(sock);
+			continue;
+		}
+		tfsavserve_conn* conn = memory_alloc(sizeof(tfsavserve_conn));
+		conn->sock = sock;
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, serve_connection, conn) != 0) {
+			pthread_mutex_unlock(&serveLock);
+			pthread_attr_destroy(&attr);
+			const char* busy = "ERROR 0.0ms can't start connection\n";
+			serve_writefd(sock, busy, strlen(busy));
+			close(sock);
+			memory_free(conn);
+			continue;
+		}
+		pthread_attr_destroy(&attr);
+		serveConns[numServeConns++] = sock;
+		pthread_mutex_unlock(&serveLock);
+	}
+
+	// Connection threads end once their last reply is written
+	pthread_mutex_lock(&serveLock);
+	while (numServeConns > 0) {
+		pthread_cond_wait(&serveDone, &serveLock);
+	}
+	pthread_mutex_unlock(&serveLock);
+	threadpool_wait(servePool);
+	threadpool_free(servePool);
+	servePool = NULL;
+	close(serveListen);
+	unlink(socketpath);
+	print(0, "Server stopped\n");
+	return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,25 @@
+/*
+ * This file is part of tfsavcodec.
+ * 
+ * Copyright (c) 2016, Oskar Eisemuth
+ * 
+ * For the full copyright and license information,
+ * please view the LICENSE file that was distributed with this source code.
+ * 
+ */
+
+#ifndef TFSAVSERVE_H
+#define TFSAVSERVE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Serves jobs on a unix socket until a client sends shutdown, workers < 1 uses one per cpu
+int tfsavserve_run(const char* socketpath, int workers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TFSAVSERVE_H */
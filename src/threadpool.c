@@ -0,0 +1,325 @@
+/*
+ * This file is part of tfsavcodec.
+ *
+ * Copyright (c) 2016, Oskar Eisemuth
+ *
+ * For the full copyright and license information,
+ * please view the LICENSE file that was distributed with this source code.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "misc.h"
+#include "memfunc.h"
+#include "threadpool.h"
+
+/*
+ * Work stealing: every worker has its own queue. Tasks submitted by a
+ * worker go to its own queue and are taken back newest first, so a task
+ * split into smaller ones keeps working on them while they are hot. Idle
+ * workers steal the oldest task of another queue, which is the biggest
+ * piece of work left. Tasks from other threads go to an extra queue that
+ * is only stolen from.
+ */
+
+typedef struct _THREADPOOL_TASK THREADPOOL_TASK;
+struct _THREADPOOL_TASK {
+	THREADPOOL_FUNC func;
+	void* arg;
+	THREADPOOL_GROUP* group;
+	THREADPOOL_TASK* prev;
+	THREADPOOL_TASK* next;
+};
+
+typedef struct _THREADPOOL_QUEUE THREADPOOL_QUEUE;
+struct _THREADPOOL_QUEUE {
+	pthread_mutex_t lock;
+	THREADPOOL_TASK* head;	// oldest, stolen from here
+	THREADPOOL_TASK* tail;	// newest, the owner takes from here
+};
+
+typedef struct _THREADPOOL_WORKER THREADPOOL_WORKER;
+struct _THREADPOOL_WORKER {
+	THREADPOOL* pool;
+	int index;
+};
+
+struct _THREADPOOL {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	size_t queued;		// tasks waiting in the queues
+	size_t pending;		// tasks not finished yet
+	int waiting;		// threads inside threadpool_group_wait
+	int shutdown;
+	int nthreads;		// number of worker queues
+	int nstarted;		// number of running workers
+	pthread_t* threads;
+	THREADPOOL_WORKER* workers;
+	THREADPOOL_QUEUE* queues;	// one per worker and the shared one at nthreads
+};
+
+static pthread_key_t workerKey;
+static pthread_once_t workerOnce = PTHREAD_ONCE_INIT;
+
+static void threadpool_worker_key_create(void) {
+	pthread_key_create(&workerKey, NULL);
+}
+
+int threadpool_cpucount() {
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? n : 1;
+#endif
+}
+
+// Index of the calling thread inside pool, -1 if it isn't one of its workers
+static int threadpool_self(THREADPOOL* pool) {
+	pthread_once(&workerOnce, threadpool_worker_key_create);
+	THREADPOOL_WORKER* worker = pthread_getspecific(workerKey);
+	if (worker == NULL || worker->pool != pool) {
+		return -1;
+	}
+	return worker->index;
+}
+
+THREADPOOL* threadpool_current() {
+	pthread_once(&workerOnce, threadpool_worker_key_create);
+	THREADPOOL_WORKER* worker = pthread_getspecific(workerKey);
+	return worker ? worker->pool : NULL;
+}
+
+static THREADPOOL_TASK* threadpool_take(THREADPOOL* pool, int self) {
+	THREADPOOL_TASK* task = NULL;
+	THREADPOOL_QUEUE* queue;
+
+	if (self >= 0) {
+		queue = &pool->queues[self];
+		pthread_mutex_lock(&queue->lock);
+		task = queue->tail;
+		if (task != NULL) {
+			queue->tail = task->prev;
+			if (queue->tail) {
+				queue->tail->next = NULL;
+			} else {
+				queue->head = NULL;
+			}
+		}
+		pthread_mutex_unlock(&queue->lock);
+	}
+	for (int i = 1; task == NULL && i <= pool->nthreads + 1; i++) {
+		queue = &pool->queues[(self + i + pool->nthreads + 1) % (pool->nthreads + 1)];
+		pthread_mutex_lock(&queue->lock);
+		task = queue->head;
+		if (task != NULL) {
+			queue->head = task->next;
+			if (queue->head) {
+				queue->head->prev = NULL;
+			} else {
+				queue->tail = NULL;
+			}
+		}
+		pthread_mutex_unlock(&queue->lock);
+	}
+	if (task != NULL) {
+		pthread_mutex_lock(&pool->lock);
+		pool->queued--;
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return task;
+}
+
+static void threadpool_run(THREADPOOL* pool, THREADPOOL_TASK* task) {
+	THREADPOOL_GROUP* group = task->group;
+	task->func(task->arg);
+	memory_free(task);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->pending--;
+	if (group != NULL) {
+		group->pending--;
+	}
+	if (pool->pending == 0 || (group != NULL && pool->waiting > 0)) {
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void* threadpool_worker(void* arg) {
+	THREADPOOL_WORKER* worker = arg;
+	THREADPOOL* pool = worker->pool;
+	THREADPOOL_TASK* task;
+
+	pthread_once(&workerOnce, threadpool_worker_key_create);
+	pthread_setspecific(workerKey, worker);
+	for (;;) {
+		task = threadpool_take(pool, worker->index);
+		if (task != NULL) {
+			threadpool_run(pool, task);
+			continue;
+		}
+		pthread_mutex_lock(&pool->lock);
+		while (pool->queued == 0 && !pool->shutdown) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+		}
+		if (pool->queued == 0) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+THREADPOOL* threadpool_create(int threads) {
+	THREADPOOL* pool = memory_alloc(sizeof(THREADPOOL));
+	if (threads < 1) {
+		threads = threadpool_cpucount();
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->queued = 0;
+	pool->pending = 0;
+	pool->waiting = 0;
+	pool->shutdown = 0;
+	pool->nthreads = threads;
+	pool->threads = memory_alloc(sizeof(pthread_t) * threads);
+	pool->workers = memory_alloc(sizeof(THREADPOOL_WORKER) * threads);
+	pool->queues = memory_alloc(sizeof(THREADPOOL_QUEUE) * (threads + 1));
+	for (int i = 0; i <= threads; ++i) {
+		pthread_mutex_init(&pool->queues[i].lock, NULL);
+		pool->queues[i].head = NULL;
+		pool->queues[i].tail = NULL;
+	}
+
+	// Queues of workers that couldn't be started just stay empty
+	pool->nstarted = 0;
+	for (int i = 0; i < threads; ++i) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].index = i;
+		if (pthread_create(&pool->threads[i], NULL, threadpool_worker, &pool->workers[i]) != 0) {
+			break;
+		}
+		pool->nstarted++;
+	}
+	if (pool->nstarted == 0) {
+		print_err(0, "Can't create worker threads\n");
+		exit(-1);
+	}
+	return pool;
+}
+
+void threadpool_group_submit(THREADPOOL* pool, THREADPOOL_GROUP* group, THREADPOOL_FUNC func, void* arg) {
+	THREADPOOL_TASK* task = memory_alloc(sizeof(THREADPOOL_TASK));
+	int self = threadpool_self(pool);
+	THREADPOOL_QUEUE* queue = &pool->queues[self >= 0 ? self : pool->nthreads];
+	task->func = func;
+	task->arg = arg;
+	task->group = group;
+	task->next = NULL;
+
+	// Counted before it is visible, so queued never drops below zero
+	pthread_mutex_lock(&pool->lock);
+	pool->pending++;
+	pool->queued++;
+	if (group != NULL) {
+		group->pending++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_mutex_lock(&queue->lock);
+	task->prev = queue->tail;
+	if (queue->tail) {
+		queue->tail->next = task;
+	} else {
+		queue->head = task;
+	}
+	queue->tail = task;
+	pthread_mutex_unlock(&queue->lock);
+
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_signal(&pool->work);
+	if (pool->waiting > 0) {
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void threadpool_submit(THREADPOOL* pool, THREADPOOL_FUNC func, void* arg) {
+	threadpool_group_submit(pool, NULL, func, arg);
+}
+
+/*
+ * Waits for all tasks of group. The calling thread runs queued tasks
+ * meanwhile, so a worker waiting on its own subtasks never blocks the pool.
+ */
+void threadpool_group_wait(THREADPOOL* pool, THREADPOOL_GROUP* group) {
+	int self = threadpool_self(pool);
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		size_t pending = group->pending;
+		pthread_mutex_unlock(&pool->lock);
+		if (pending == 0) {
+			return;
+		}
+
+		THREADPOOL_TASK* task = threadpool_take(pool, self);
+		if (task != NULL) {
+			threadpool_run(pool, task);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		pool->waiting++;
+		while (group->pending > 0 && pool->queued == 0) {
+			pthread_cond_wait(&pool->done, &pool->lock);
+		}
+		pool->waiting--;
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+void threadpool_wait(THREADPOOL* pool) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void threadpool_free(THREADPOOL* pool) {
+	if (pool == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->nstarted; ++i) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	for (int i = 0; i <= pool->nthreads; ++i) {
+		pthread_mutex_destroy(&pool->queues[i].lock);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	memory_free(pool->queues);
+	memory_free(pool->workers);
+	memory_free(pool->threads);
+	memory_free(pool);
+}
@@ -0,0 +1,45 @@
+/*
+ * This file is part of tfsavcodec.
+ * 
+ * Copyright (c) 2016, Oskar Eisemuth
+ * 
+ * For the full copyright and license information,
+ * please view the LICENSE file that was distributed with this source code.
+ * 
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stddef.h>
+
+typedef void (*THREADPOOL_FUNC)(void* arg);
+
+typedef struct _THREADPOOL THREADPOOL;
+typedef struct _THREADPOOL_GROUP THREADPOOL_GROUP;
+
+// Tasks that are waited for together, start with pending = 0
+struct _THREADPOOL_GROUP {
+	size_t pending;
+};
+
+int threadpool_cpucount();
+
+// threads < 1 uses one thread per cpu
+THREADPOOL* threadpool_create(int threads);
+void threadpool_submit(THREADPOOL* pool, THREADPOOL_FUNC func, void* arg);
+void threadpool_wait(THREADPOOL* pool);
+void threadpool_group_submit(THREADPOOL* pool, THREADPOOL_GROUP* group, THREADPOOL_FUNC func, void* arg);
+void threadpool_group_wait(THREADPOOL* pool, THREADPOOL_GROUP* group);
+// Pool the calling thread works for, NULL outside of pools
+THREADPOOL* threadpool_current();
+void threadpool_free(THREADPOOL* pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* THREADPOOL_H */
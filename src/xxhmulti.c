@@ -0,0 +1,283 @@
+/*
+ * This file is part of tfsavcodec.
+ * 
+ * Copyright (c) 2016, Oskar Eisemuth
+ * 
+ * For the full copyright and license information,
+ * please view the LICENSE file that was distributed with this source code.
+ * 
+ */
+
+/*
+ * Multi-buffer XXH32: every SIMD lane carries the four accumulators of a
+ * different buffer, so independent blocks are hashed side by side instead
+ * of one after another. Buffers are grouped by length, lanes that run out
+ * of stripes early keep their state through a mask. The tail of every
+ * buffer is finished with scalar code.
+ * Needs SSE4.1 (pmulld), plain SSE2 builds hash one buffer after another,
+ * emulating the 32 bit multiply there is slower than the scalar code.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memfunc.h"
+#include "lz4/xxhash.h"
+#include "xxhmulti.h"
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+
+#define PRIME32_1 2654435761U
+#define PRIME32_2 2246822519U
+#define PRIME32_3 3266489917U
+#define PRIME32_4 668265263U
+#define PRIME32_5 374761393U
+
+#if defined(__AVX512F__)
+#define XXHM_LANES 16
+typedef __m512i xxhm_vec;
+typedef __mmask16 xxhm_mask;
+#define xxhm_set1(x)		_mm512_set1_epi32((int)(x))
+#define xxhm_loadu(p)		_mm512_loadu_si512((const void*)(p))
+#define xxhm_storeu(p, v)	_mm512_storeu_si512((void*)(p), v)
+#define xxhm_add(a, b)		_mm512_add_epi32(a, b)
+#define xxhm_mul(a, b)		_mm512_mullo_epi32(a, b)
+#define xxhm_rotl(x, r)		_mm512_rol_epi32(x, r)
+#define xxhm_active(n, i)	_mm512_cmpgt_epi32_mask(n, i)
+#define xxhm_select(m, a, b)	_mm512_mask_mov_epi32(b, m, a)
+#define xxhm_unpacklo32		_mm512_unpacklo_epi32
+#define xxhm_unpackhi32		_mm512_unpackhi_epi32
+#define xxhm_unpacklo64		_mm512_unpacklo_epi64
+#define xxhm_unpackhi64		_mm512_unpackhi_epi64
+
+// Row k holds 16 bytes of buffers k, k+4, k+8 and k+12
+static inline xxhm_vec xxhm_row(const uint8_t* const* p, int k) {
+	xxhm_vec r = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i*)p[k]));
+	r = _mm512_inserti32x4(r, _mm_loadu_si128((const __m128i*)p[k + 4]), 1);
+	r = _mm512_inserti32x4(r, _mm_loadu_si128((const __m128i*)p[k + 8]), 2);
+	return _mm512_inserti32x4(r, _mm_loadu_si128((const __m128i*)p[k + 12]), 3);
+}
+
+#elif defined(__AVX2__)
+#define XXHM_LANES 8
+typedef __m256i xxhm_vec;
+typedef __m256i xxhm_mask;
+#define xxhm_set1(x)		_mm256_set1_epi32((int)(x))
+#define xxhm_loadu(p)		_mm256_loadu_si256((const __m256i*)(p))
+#define xxhm_storeu(p, v)	_mm256_storeu_si256((__m256i*)(p), v)
+#define xxhm_add(a, b)		_mm256_add_epi32(a, b)
+#define xxhm_mul(a, b)		_mm256_mullo_epi32(a, b)
+#define xxhm_rotl(x, r)		_mm256_or_si256(_mm256_slli_epi32(x, r), _mm256_srli_epi32(x, 32 - (r)))
+#define xxhm_active(n, i)	_mm256_cmpgt_epi32(n, i)
+#define xxhm_select(m, a, b)	_mm256_blendv_epi8(b, a, m)
+#define xxhm_unpacklo32		_mm256_unpacklo_epi32
+#define xxhm_unpackhi32		_mm256_unpackhi_epi32
+#define xxhm_unpacklo64		_mm256_unpacklo_epi64
+#define xxhm_unpackhi64		_mm256_unpackhi_epi64
+
+// Row k holds 16 bytes of buffers k and k+4
+static inline xxhm_vec xxhm_row(const uint8_t* const* p, int k) {
+	xxhm_vec r = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p[k]));
+	return _mm256_inserti128_si256(r, _mm_loadu_si128((const __m128i*)p[k + 4]), 1);
+}
+
+#elif defined(__SSE4_1__)
+#define XXHM_LANES 4
+typedef __m128i xxhm_vec;
+typedef __m128i xxhm_mask;
+#define xxhm_set1(x)		_mm_set1_epi32((int)(x))
+#define xxhm_loadu(p)		_mm_loadu_si128((const __m128i*)(p))
+#define xxhm_storeu(p, v)	_mm_storeu_si128((__m128i*)(p), v)
+#define xxhm_add(a, b)		_mm_add_epi32(a, b)
+#define xxhm_mul(a, b)		_mm_mullo_epi32(a, b)
+#define xxhm_rotl(x, r)		_mm_or_si128(_mm_slli_epi32(x, r), _mm_srli_epi32(x, 32 - (r)))
+#define xxhm_active(n, i)	_mm_cmpgt_epi32(n, i)
+#define xxhm_select(m, a, b)	_mm_blendv_epi8(b, a, m)
+#define xxhm_unpacklo32		_mm_unpacklo_epi32
+#define xxhm_unpackhi32		_mm_unpackhi_epi32
+#define xxhm_unpacklo64		_mm_unpacklo_epi64
+#define xxhm_unpackhi64		_mm_unpackhi_epi64
+
+static inline xxhm_vec xxhm_row(const uint8_t* const* p, int k) {
+	return _mm_loadu_si128((const __m128i*)p[k]);
+}
+
+#else
+#define XXHM_LANES 1
+#endif
+
+
+#if XXHM_LANES > 1
+
+static inline uint32_t xxhm_rotl32(uint32_t x, int r) {
+	return (x << r) | (x >> (32 - r));
+}
+
+static inline uint32_t xxhm_read32(const uint8_t* p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Finishes a buffer after its full stripes went through the lanes
+static uint32_t xxhm_finish(const uint32_t* v, const uint8_t* p, size_t len, uint32_t seed) {
+	const uint8_t* end = p + (len & 15);
+	uint32_t h32;
+	if (len >= 16) {
+		h32 = xxhm_rotl32(v[0], 1) + xxhm_rotl32(v[1], 7) + xxhm_rotl32(v[2], 12) + xxhm_rotl32(v[3], 18);
+	} else {
+		h32 = seed + PRIME32_5;
+	}
+	h32 += (uint32_t)len;
+	
+	while (p + 4 <= end) {
+		h32 += xxhm_read32(p) * PRIME32_3;
+		h32 = xxhm_rotl32(h32, 17) * PRIME32_4;
+		p += 4;
+	}
+	while (p < end) {
+		h32 += (*p) * PRIME32_5;
+		h32 = xxhm_rotl32(h32, 11) * PRIME32_1;
+		p++;
+	}
+	
+	h32 ^= h32 >> 15;
+	h32 *= PRIME32_2;
+	h32 ^= h32 >> 13;
+	h32 *= PRIME32_3;
+	h32 ^= h32 >> 16;
+	return h32;
+}
+
+static const uint8_t xxhm_zero[16];
+
+#define XXHM_ROUND(acc, input) xxhm_mul(xxhm_rotl(xxhm_add(acc, xxhm_mul(input, prime2)), 13), prime1)
+
+// Loads one stripe of every lane, wK holds input word K of every lane
+#define XXHM_TRANSPOSE(p)					\
+	xxhm_vec r0 = xxhm_row(p, 0);				\
+	xxhm_vec r1 = xxhm_row(p, 1);				\
+	xxhm_vec r2 = xxhm_row(p, 2);				\
+	xxhm_vec r3 = xxhm_row(p, 3);				\
+	xxhm_vec t0 = xxhm_unpacklo32(r0, r1);			\
+	xxhm_vec t1 = xxhm_unpacklo32(r2, r3);			\
+	xxhm_vec t2 = xxhm_unpackhi32(r0, r1);			\
+	xxhm_vec t3 = xxhm_unpackhi32(r2, r3);			\
+	xxhm_vec w0 = xxhm_unpacklo64(t0, t1);			\
+	xxhm_vec w1 = xxhm_unpackhi64(t0, t1);			\
+	xxhm_vec w2 = xxhm_unpacklo64(t2, t3);			\
+	xxhm_vec w3 = xxhm_unpackhi64(t2, t3);
+
+static void xxh32_lanes(const void* const* inputs, const size_t* lengths, const size_t* order, size_t n, uint32_t seed, uint32_t* digests) {
+	const uint8_t* base[XXHM_LANES];
+	const uint8_t* p[XXHM_LANES];
+	int32_t stripes[XXHM_LANES];
+	uint32_t v[4][XXHM_LANES];
+	int32_t maxstripes = 0;
+	int32_t minstripes = INT32_MAX;
+	
+	for (size_t l = 0; l < XXHM_LANES; l++) {
+		base[l] = xxhm_zero;
+		stripes[l] = 0;
+		if (l < n) {
+			base[l] = inputs[order[l]];
+			stripes[l] = (int32_t)(lengths[order[l]] / 16);
+			if (stripes[l] > maxstripes) {
+				maxstripes = stripes[l];
+			}
+		}
+		if (stripes[l] < minstripes) {
+			minstripes = stripes[l];
+		}
+	}
+	
+	const xxhm_vec prime1 = xxhm_set1(PRIME32_1);
+	const xxhm_vec prime2 = xxhm_set1(PRIME32_2);
+	const xxhm_vec counts = xxhm_loadu(stripes);
+	xxhm_vec v1 = xxhm_set1(seed + PRIME32_1 + PRIME32_2);
+	xxhm_vec v2 = xxhm_set1(seed + PRIME32_2);
+	xxhm_vec v3 = xxhm_set1(seed);
+	xxhm_vec v4 = xxhm_set1(seed - PRIME32_1);
+	
+	// All lanes active: no masking needed
+	for (int32_t s = 0; s < minstripes; s++) {
+		for (size_t l = 0; l < XXHM_LANES; l++) {
+			p[l] = base[l] + (size_t)s * 16;
+		}
+		XXHM_TRANSPOSE(p);
+		v1 = XXHM_ROUND(v1, w0);
+		v2 = XXHM_ROUND(v2, w1);
+		v3 = XXHM_ROUND(v3, w2);
+		v4 = XXHM_ROUND(v4, w3);
+	}
+	// Shorter buffers are done, keep their state
+	for (int32_t s = minstripes; s < maxstripes; s++) {
+		for (size_t l = 0; l < XXHM_LANES; l++) {
+			p[l] = s < stripes[l] ? base[l] + (size_t)s * 16 : xxhm_zero;
+		}
+		XXHM_TRANSPOSE(p);
+		xxhm_mask active = xxhm_active(counts, xxhm_set1(s));
+		v1 = xxhm_select(active, XXHM_ROUND(v1, w0), v1);
+		v2 = xxhm_select(active, XXHM_ROUND(v2, w1), v2);
+		v3 = xxhm_select(active, XXHM_ROUND(v3, w2), v3);
+		v4 = xxhm_select(active, XXHM_ROUND(v4, w3), v4);
+	}
+	
+	xxhm_storeu(v[0], v1);
+	xxhm_storeu(v[1], v2);
+	xxhm_storeu(v[2], v3);
+	xxhm_storeu(v[3], v4);
+	
+	for (size_t l = 0; l < n; l++) {
+		uint32_t lane[4] = { v[0][l], v[1][l], v[2][l], v[3][l] };
+		size_t len = lengths[order[l]];
+		digests[order[l]] = xxhm_finish(lane, base[l] + (len & ~(size_t)15), len, seed);
+	}
+}
+
+typedef struct {
+	size_t length;
+	size_t index;
+} xxhm_item;
+
+static int xxhm_compare_length(const void* a, const void* b) {
+	size_t la = ((const xxhm_item*)a)->length;
+	size_t lb = ((const xxhm_item*)b)->length;
+	return la < lb ? -1 : la > lb;
+}
+
+#endif
+
+int xxh32_multi_lanes() {
+	return XXHM_LANES;
+}
+
+void xxh32_multi(const void* const* inputs, const size_t* lengths, size_t count, uint32_t seed, uint32_t* digests) {
+#if XXHM_LANES > 1
+	xxhm_item* items = memory_alloc(sizeof(xxhm_item) * (count ? count : 1));
+	size_t* order = memory_alloc(sizeof(size_t) * (count ? count : 1));
+	for (size_t i = 0; i < count; i++) {
+		items[i].length = lengths[i];
+		items[i].index = i;
+	}
+	// Similar lengths share a batch, so few lanes idle at the end
+	qsort(items, count, sizeof(xxhm_item), xxhm_compare_length);
+	for (size_t i = 0; i < count; i++) {
+		order[i] = items[i].index;
+	}
+	memory_free(items);
+	
+	for (size_t i = 0; i < count; i += XXHM_LANES) {
+		size_t n = count - i < XXHM_LANES ? count - i : XXHM_LANES;
+		xxh32_lanes(inputs, lengths, order + i, n, seed, digests);
+	}
+	memory_free(order);
+#else
+	for (size_t i = 0; i < count; i++) {
+		digests[i] = XXH32(inputs[i], lengths[i], seed);
+	}
+#endif
+}
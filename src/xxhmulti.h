@@ -0,0 +1,31 @@
+/*
+ * This file is part of tfsavcodec.
+ * 
+ * Copyright (c) 2016, Oskar Eisemuth
+ * 
+ * For the full copyright and license information,
+ * please view the LICENSE file that was distributed with this source code.
+ * 
+ */
+
+#ifndef XXHMULTI_H
+#define XXHMULTI_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Number of buffers hashed side by side
+int xxh32_multi_lanes();
+
+// Same result as XXH32(inputs[i], lengths[i], seed) for every buffer
+void xxh32_multi(const void* const* inputs, const size_t* lengths, size_t count, uint32_t seed, uint32_t* digests);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* XXHMULTI_H */